@@ -1,17 +1,109 @@
 #include "app.hpp"
 
+#include "capture.hpp"
+#include "correction.hpp"
 #include "db.hpp"
 #include "log.hpp"
-#include <cassert>
+#include "mpsc_queue.hpp"
+#include "protocol.hpp"
+#include "spsc_ring.hpp"
+#include "task.hpp"
+#include "worker_pool.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <unordered_set>
+
+// How long a read blocks waiting for the first byte before giving the reader thread a chance to check if it
+// should exit
+static constexpr u32 kReadTimeoutMs = 50;
+static constexpr u32 kReaderRingSize = 4_MB;
+// Decoded frames start on a multiple of this in the ring, so packed arrays in them come out aligned
+static constexpr u32 kRxFrameAlign = alignof(u64);
+// Way more than a frame's worth of clicks or a long acquisition plan
+static constexpr u32 kCommandQueueSize = 4096;
+// How late a response can be on top of the exposure before the command counts as lost
+static constexpr std::chrono::seconds kCommandTimeout(5);
+// Extra attempts for a CCD command that timed out
+static constexpr u32 kCommandRetries = 2;
 
 #if _WIN32
 #define NOMINMAX
 #include "windows.h"
+#else
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#endif
 
 struct COMHandle {
+#if _WIN32
     HANDLE com_handle;
+#else
+    int fd;
+#endif
+
+    // Filled by `reader_thread`. The consumer COBS decodes straight out of it and releases the bytes as soon as they
+    // went through the decoder
+    SPSCRing rx;
+    std::thread reader_thread;
+    std::atomic<bool> reader_running = false;
+    // Times the reader found the ring full and had to leave the bytes in the driver buffer
+    std::atomic<u32> rx_full_stalls = 0;
+    // Set by the reader when the device goes away (unplugged, pty closed...)
+    std::atomic<bool> device_lost = false;
+    // While recording, every chunk read from the device is also appended here
+    CaptureWriter capture;
+
+    // Replay connections have no device, `replay_thread` feeds `rx` from a capture file instead
+    bool is_replay = false;
+    bool replay_realtime = false;
+    CaptureReader replay;
+    std::atomic<bool> replay_done = false;
+    bool replay_reported = false;
+
+    // Consumer side state, only touched from handle_incomming_data/handle_commands.
+    // Frames get decoded over themselves inside the ring. The decoder keeps the state of a partially received frame
+    // between calls, its bytes stay unreleased from `rx_frame_start` on until the frame is parsed. `rx_decoded_pos` is
+    // how far the decoder got
+    CobsDecodeCtx rx_decoder;
+    u32 rx_frame_start = 0;
+    u32 rx_decoded_pos = 0;
+    // Parsed on the worker pool, stored and handed to App on the main thread, and cleared once they're handed over.
+    // Only metadata, the pixels of row `i` get unpacked straight into `rx_pixels[i]`, which the db writer and the pixel
+    // cache then share
+    CCDOperationStore rx_results;
+    std::vector<std::shared_ptr<CCDPixels>> rx_pixels;
+    // Shows up as the file of the device logs so they can be told apart
+    std::string log_name;
+
+    std::chrono::steady_clock::time_point connected_at;
+    u64 rx_bytes = 0;
+    u64 rx_frames_decoded = 0;
+    // Frames thrown away before parsing, either because the crc didn't match or they didn't fit the payload buffer
+    u64 rx_crc_errors = 0;
+    u64 rx_oversized_frames = 0;
+    // From the device's Info. Frames only have a crc to check once it says FrameCrc
+    u32 device_capabilities = 0;
+    bool device_info_received = false;
+
+    // Host commands get COBS framed back to back in here while handle_commands runs and go out with a single write
+    // at the end of it, so a burst of commands costs one syscall (and USB transfer) instead of one each
+    std::vector<u8> tx_pending;
+    u32 tx_pending_commands = 0;
+    u64 tx_commands = 0;
+    u64 tx_writes = 0;
 };
 
+#if _WIN32
 COMHandle *setup_com_port(std::string_view com_port)
 {
     HANDLE hCom = CreateFile(com_port.data(),
@@ -51,14 +143,32 @@ COMHandle *setup_com_port(std::string_view com_port)
     }
 #endif
 
+    // With these values ReadFile returns as soon as there is at least one byte in the input buffer, and waits up to
+    // kReadTimeoutMs for one to arrive otherwise. This way the reader thread sleeps in the driver instead of spinning
     COMMTIMEOUTS timeouts;
     GetCommTimeouts(hCom, &timeouts);
     timeouts.ReadIntervalTimeout = MAXDWORD;
-    timeouts.ReadTotalTimeoutMultiplier = 0;
-    timeouts.ReadTotalTimeoutConstant = 0;
+    timeouts.ReadTotalTimeoutMultiplier = MAXDWORD;
+    timeouts.ReadTotalTimeoutConstant = kReadTimeoutMs;
     SetCommTimeouts(hCom, &timeouts);
 
-    return new COMHandle{hCom};
+    COMHandle *handle = new COMHandle;
+    handle->com_handle = hCom;
+    return handle;
+}
+
+static COMHandle *create_replay_handle()
+{
+    COMHandle *handle = new COMHandle;
+    handle->com_handle = INVALID_HANDLE_VALUE;
+    return handle;
+}
+
+static void close_com_port_handle(COMHandle *conn)
+{
+    if (conn->com_handle != INVALID_HANDLE_VALUE) {
+        CloseHandle(conn->com_handle);
+    }
 }
 
 void enumerate_com_ports(std::vector<ComPort> *ports)
@@ -125,435 +235,1404 @@ bool write_to_com_device(COMHandle *conn, void *data, uint32_t len)
 uint32_t read_from_com_device(COMHandle *conn, void *data, uint32_t len)
 {
     DWORD read = 0;
-    ReadFile(conn->com_handle, data, len, &read, NULL);
+    if (!ReadFile(conn->com_handle, data, len, &read, NULL)) {
+        conn->device_lost = true;
+    }
     return read;
 }
-#endif
+#else
+COMHandle *setup_com_port(std::string_view com_port)
+{
+    std::string path{com_port};
+    int fd = open(path.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        LOG_ERROR("open failed with error {}", strerror(errno));
+        return nullptr;
+    }
 
-enum class HostToDeviceCommand : u8 {
-    GetInfo,
-    CCDSensor,
-};
+    termios tty;
+    if (tcgetattr(fd, &tty) != 0) {
+        LOG_ERROR("tcgetattr failed with error {}", strerror(errno));
+        close(fd);
+        return nullptr;
+    }
 
-enum class DeviceToHostResponse : u8 {
-    CCDResult,
-    Log,
-};
+    // Same as on windows, the line settings are ignored by our device (it's USB CDC) so only raw mode matters.
+    // Reads are gated on poll(), which for a non canonical tty reports readable once VMIN bytes are queued, so
+    // VMIN=1/VTIME=0 wakes us up on the first byte without any inter-byte timer
+    cfmakeraw(&tty);
+    tty.c_cflag |= CLOCAL | CREAD;
+    tty.c_cc[VMIN] = 1;
+    tty.c_cc[VTIME] = 0;
+    if (tcsetattr(fd, TCSANOW, &tty) != 0) {
+        LOG_ERROR("tcsetattr failed with error {}", strerror(errno));
+        close(fd);
+        return nullptr;
+    }
+
+    COMHandle *handle = new COMHandle;
+    handle->fd = fd;
+    return handle;
+}
+
+static COMHandle *create_replay_handle()
+{
+    COMHandle *handle = new COMHandle;
+    handle->fd = -1;
+    return handle;
+}
+
+static void close_com_port_handle(COMHandle *conn)
+{
+    if (conn->fd >= 0) {
+        close(conn->fd);
+    }
+}
+
+void enumerate_com_ports(std::vector<ComPort> *ports)
+{
+    namespace fs = std::filesystem;
+    std::error_code ec;
+
+    // udev keeps stable, human readable names for every USB serial device here
+    for (const auto &entry : fs::directory_iterator("/dev/serial/by-id", ec)) {
+        fs::path target = fs::canonical(entry.path(), ec);
+        if (ec) {
+            continue;
+        }
+        ports->push_back(ComPort{entry.path().filename().string(), target.string()});
+    }
+
+    if (!ports->empty()) {
+        return;
+    }
+
+    for (const auto &entry : fs::directory_iterator("/dev", ec)) {
+        std::string name = entry.path().filename().string();
+        if (name.starts_with("ttyACM") || name.starts_with("ttyUSB")) {
+            ports->push_back(ComPort{name, entry.path().string()});
+        }
+    }
+}
 
-inline constexpr u32 get_cobs_overhead(u32 len)
+bool write_to_com_device(COMHandle *conn, void *data, uint32_t len)
 {
-    return 1 + (len + 253) / 254;
+    u32 written = 0;
+    while (written < len) {
+        ssize_t n = write(conn->fd, (u8 *)data + written, len - written);
+        if (n > 0) {
+            written += (u32)n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            return false;
+        }
+
+        // The driver's tx buffer is full, wait until it drains instead of spinning on EAGAIN
+        pollfd pfd = {conn->fd, POLLOUT, 0};
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+            return false;
+        }
+    }
+    return true;
 }
 
-inline constexpr u32 get_max_encoded_size(u32 payload_len)
+uint32_t read_from_com_device(COMHandle *conn, void *data, uint32_t len)
 {
-    u32 cmd_size = 1                        // type
-                   + 2 * (payload_len != 0) // payload_Len
-                   + payload_len            // payload
-                   + 2;                     // crc
+    pollfd pfd = {conn->fd, POLLIN, 0};
+    int ready = poll(&pfd, 1, kReadTimeoutMs);
+    if (ready <= 0) {
+        return 0;
+    }
+
+    if (!(pfd.revents & POLLIN) && (pfd.revents & (POLLHUP | POLLERR | POLLNVAL))) {
+        // poll keeps returning straight away from now on, so stop reading instead of spinning
+        conn->device_lost = true;
+        return 0;
+    }
 
-    return get_cobs_overhead(cmd_size) + 2 /*frame markers*/;
+    ssize_t n = read(conn->fd, data, len);
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            conn->device_lost = true;
+        }
+        return 0;
+    }
+    return (u32)n;
 }
+#endif
 
-u32 cobs_decode(const u8 *data, u32 data_len, u8 *output, u32 output_len)
+static void reader_thread(COMHandle *conn)
 {
-    u8 *output_it = output;
+    using namespace std::chrono_literals;
+    while (conn->reader_running.load(std::memory_order_relaxed) && !conn->device_lost.load(std::memory_order_relaxed)) {
+        RingSpan span = spsc_ring_write_span(&conn->rx);
+        if (span.len == 0) {
+            // The consumer is behind. Don't drop anything, the bytes wait in the driver until there is room again
+            conn->rx_full_stalls.fetch_add(1, std::memory_order_relaxed);
+            std::this_thread::sleep_for(1ms);
+            continue;
+        }
 
-    u8 distance_to_next_0 = 1;
-    bool is_delimiter = true;
+        u32 read = read_from_com_device(conn, span.data, span.len);
+        if (read != 0) {
+            capture_write_chunk(&conn->capture, span.data, read);
+            spsc_ring_commit(&conn->rx, read);
+            wake_main_loop();
+        }
+    }
+    // Lost devices have to show up without waiting for the next input
+    wake_main_loop();
+}
 
-    const u8 *data_it = data;
-    while (data_it != data + data_len) {
-        if (output_it >= output + output_len) {
-            return -1;
+static void replay_thread(COMHandle *conn)
+{
+    using namespace std::chrono;
+    using namespace std::chrono_literals;
+
+    std::vector<u8> chunk;
+    u32 delta_us = 0;
+    auto next_chunk_at = steady_clock::now();
+    while (conn->reader_running.load(std::memory_order_relaxed)
+           && capture_read_chunk(&conn->replay, &chunk, &delta_us)) {
+        if (conn->replay_realtime) {
+            next_chunk_at += microseconds(delta_us);
+            std::this_thread::sleep_until(next_chunk_at);
         }
 
-        if (distance_to_next_0 == 1) {
-            if (!is_delimiter) {
-                *output_it++ = 0;
+        u32 written = 0;
+        while (written < chunk.size() && conn->reader_running.load(std::memory_order_relaxed)) {
+            u32 n = spsc_ring_write(&conn->rx, chunk.data() + written, (u32)chunk.size() - written);
+            if (n == 0) {
+                conn->rx_full_stalls.fetch_add(1, std::memory_order_relaxed);
+                std::this_thread::sleep_for(1ms);
+            } else {
+                wake_main_loop();
             }
-            distance_to_next_0 = *data_it;
-            is_delimiter = distance_to_next_0 == 0xFF;
-        } else {
-            *output_it = *data_it;
-            output_it++;
-            distance_to_next_0--;
+            written += n;
         }
+    }
+    conn->replay_done.store(true, std::memory_order_release);
+    wake_main_loop();
+}
 
-        data_it++;
+static bool start_reader(COMHandle *conn)
+{
+    // A frame that starts right before the end of the ring gets decoded on into the overrun, so every payload is in
+    // one piece
+    if (!spsc_ring_init(&conn->rx, kReaderRingSize, kMaxPayloadSize)) {
+        LOG_ERROR("Failed to allocate [{}] bytes for the reader ring", kReaderRingSize);
+        return false;
     }
+    conn->rx_decoder = cobs_decode_init(spsc_ring_at(&conn->rx, 0), kMaxPayloadSize);
+    conn->connected_at = std::chrono::steady_clock::now();
+    conn->reader_running = true;
+    conn->reader_thread = std::thread(conn->is_replay ? replay_thread : reader_thread, conn);
+    return true;
+}
 
-    return output_it - output;
+static COMHandle *setup_replay_port(std::string_view capture_path, bool realtime)
+{
+    COMHandle *handle = create_replay_handle();
+    handle->is_replay = true;
+    handle->replay_realtime = realtime;
+    if (!capture_reader_open(&handle->replay, std::string{capture_path}.c_str())) {
+        delete handle;
+        return nullptr;
+    }
+    return handle;
 }
 
-struct CobsCtx {
-    u8 *output_buffer = nullptr;
-    u8 *output_it = nullptr;
-    u8 *code_byte = nullptr;
-    u8 distance_to_last_0;
-    u32 output_len;
-};
+static void close_com_port(COMHandle *conn)
+{
+    conn->reader_running = false;
+    if (conn->reader_thread.joinable()) {
+        conn->reader_thread.join();
+    }
+    close_com_port_handle(conn);
+    capture_writer_close(&conn->capture);
+    capture_reader_close(&conn->replay);
+    spsc_ring_free(&conn->rx);
+    delete conn;
+}
 
-inline CobsCtx cobs_encode_init(u8 *output_buffer, u32 output_len)
+static MPSCQueue<AppCommand> gCommandQueue;
+static const bool gCommandQueueReady = mpsc_queue_init(&gCommandQueue, kCommandQueueSize);
+// Coroutines waiting on device commands get resumed here, once per handle_commands
+static TaskExecutor gTaskExecutor;
+
+bool queue_commands(const AppCommand *commands, u32 count)
 {
-    return {output_buffer, output_buffer + 1, output_buffer, 1, output_len};
-};
+    ASSERT(gCommandQueueReady);
+    if (!mpsc_queue_push(&gCommandQueue, commands, count)) {
+        LOG_ERROR("Command queue is full, dropping [{}] commands", count);
+        return false;
+    }
+    wake_main_loop();
+    return true;
+}
 
-inline u32 cobs_encode_end(CobsCtx *ctx)
+void queue_command(const AppCommand &cmd)
 {
-    *ctx->code_byte = ctx->distance_to_last_0;
-    if ((u32)(ctx->output_it - ctx->output_buffer) >= ctx->output_len) {
-        return u32Max;
+    queue_commands(&cmd, 1);
+}
+
+DeviceConnection *find_connection(Comms *comms, u32 device_id)
+{
+    for (DeviceConnection &conn : comms->connections) {
+        if (conn.device_id == device_id) {
+            return &conn;
+        }
     }
+    return nullptr;
+}
+
+DeviceStats get_device_stats(const DeviceConnection *conn)
+{
+    COMHandle *handle = conn->handle;
+    const CommandStats &commands = conn->command_stats;
+    return {
+        handle->rx_bytes,
+        handle->rx_frames_decoded,
+        handle->rx_crc_errors,
+        handle->rx_oversized_frames,
+        handle->rx_full_stalls.load(std::memory_order_relaxed),
+        handle->tx_commands,
+        handle->tx_writes,
+        (u32)conn->pending_commands.size(),
+        commands.timed_out,
+        commands.completed ? commands.total_latency_ms / commands.completed : 0.0,
+        commands.max_latency_ms,
+        handle->device_lost.load(std::memory_order_relaxed),
+        handle->is_replay,
+    };
+}
 
-    *ctx->output_it = '\0';
-    ctx->output_it++;
+// Resolves every command still waiting on `conn`, its coroutines run on the next task_executor_run
+static void fail_pending_commands(DeviceConnection *conn)
+{
+    for (PendingCommand &pending : conn->pending_commands) {
+        *pending.result = {CommandStatus::Disconnected, pending.id, 0};
+        task_executor_schedule(&gTaskExecutor, pending.waiter);
+    }
+    conn->pending_commands.clear();
+}
 
-    return ctx->output_it - ctx->output_buffer;
+void close_com_connection(Comms *comms)
+{
+    for (DeviceConnection &conn : comms->connections) {
+        fail_pending_commands(&conn);
+        close_com_port(conn.handle);
+    }
+    comms->connections.clear();
+    // Lets whatever was waiting see the disconnect and finish, nothing can send anything anymore
+    task_executor_run(&gTaskExecutor);
+    comms->connection_status = COMConnectionStatus::NOT_CONNECTED;
+    worker_pool_shutdown();
 }
 
-inline bool cobs_encode(CobsCtx *ctx, const void *data, u32 data_len)
+// Runs on the worker pool, one connection per worker, so this can't touch App or the db. CCD results are left in
+// `handle->rx_results` for the main thread
+static void parse_device_response(COMHandle *handle, Payload payload)
 {
-    u8 *data_it = (u8 *)data;
-    while (data_it != (u8 *)data + data_len) {
-        if ((u32)(ctx->output_it - ctx->output_buffer) >= ctx->output_len) {
-            return false;
+    DeviceToHostResponse cmd;
+    deserialize(&payload, &cmd);
+
+    switch (cmd) {
+        case DeviceToHostResponse::CCDResult:
+        case DeviceToHostResponse::CCDResultDelta: {
+            // Both have the same header
+            CCDResultMessage result;
+            if (!deserialize_message(&payload, &result)) {
+                LOG_ERROR("[{}] Failed deserializing CCD result", handle->log_name);
+                break;
+            }
+            if (result.pixel_count > kMaxPixelCount) {
+                LOG_ERROR("[{}] Dropping CCD result [{}] with [{}] pixels, max is [{}]",
+                          handle->log_name,
+                          result.id,
+                          result.pixel_count,
+                          kMaxPixelCount);
+                break;
+            }
+            LOG_NORM(
+                "[{}] Got CCD result for [{}] with [{}] elements", handle->log_name, result.id, result.pixel_count);
+
+            auto pixels = std::make_shared<CCDPixels>();
+            pixels->raw.resize(result.pixel_count);
+            bool pixels_ok = cmd == DeviceToHostResponse::CCDResultDelta
+                                 ? deserialize_delta_array(&payload, pixels->raw.data(), result.pixel_count)
+                                 : deserialize_array(&payload, pixels->raw.data(), result.pixel_count);
+            if (!pixels_ok) {
+                LOG_ERROR("[{}] CCD result [{}] is missing pixel values", handle->log_name, result.id);
+                break;
+            }
+
+            using namespace std::chrono;
+            auto now = time_point_cast<seconds>(current_zone()->to_local(system_clock::now()));
+            ccd_store_push_metadata(&handle->rx_results,
+                                    {result.id, 0, now, result.exposure, result.iterations},
+                                    result.pixel_count);
+            handle->rx_pixels.push_back(std::move(pixels));
+            break;
+        }
+        case DeviceToHostResponse::CCDResultPacked: {
+            // The pixels come out as a span over the frame in the ring, which goes back to the reader right after, so
+            // they get one bulk copy into the buffer the db writer and the pixel cache share and nothing else
+            CCDResultPackedMessage result;
+            if (!deserialize_message(&payload, &result)) {
+                LOG_ERROR("[{}] Failed deserializing packed CCD result", handle->log_name);
+                break;
+            }
+            if (result.pixels.values.size() > kMaxPixelCount) {
+                LOG_ERROR("[{}] Dropping CCD result [{}] with [{}] pixels, max is [{}]",
+                          handle->log_name,
+                          result.id,
+                          result.pixels.values.size(),
+                          kMaxPixelCount);
+                break;
+            }
+            LOG_NORM("[{}] Got CCD result for [{}] with [{}] elements",
+                     handle->log_name,
+                     result.id,
+                     result.pixels.values.size());
+
+            auto pixels = std::make_shared<CCDPixels>();
+            pixels->raw.assign(result.pixels.values.begin(), result.pixels.values.end());
+
+            using namespace std::chrono;
+            auto now = time_point_cast<seconds>(current_zone()->to_local(system_clock::now()));
+            ccd_store_push_metadata(&handle->rx_results,
+                                    {result.id, 0, now, result.exposure, result.iterations},
+                                    (u32)pixels->raw.size());
+            handle->rx_pixels.push_back(std::move(pixels));
+            break;
         }
+        case DeviceToHostResponse::Info: {
+            InfoMessage info;
+            if (!deserialize_message(&payload, &info)) {
+                LOG_ERROR("[{}] Failed deserializing device info", handle->log_name);
+                break;
+            }
+            LOG_NORM("[{}] Device capabilities [{:#x}]", handle->log_name, info.capabilities);
+            handle->device_capabilities = info.capabilities;
+            handle->device_info_received = true;
+            break;
+        }
+        case DeviceToHostResponse::Log: {
+            LogMessage log;
+            if (!deserialize_message(&payload, &log)) {
+                LOG_ERROR("[{}] Failed deserializing log message", handle->log_name);
+                break;
+            }
+            log_impl(LogContext::DEVICE,
+                     handle->log_name,
+                     {(const char *)log.function.data, log.function.len},
+                     log.line,
+                     LogSeverity(log.severity),
+                     {(const char *)log.msg.data, log.msg.len});
+            break;
+        }
+        default: {
+            break;
+        }
+    }
+}
+
+// Runs on the worker pool. Everything the reader published since the last call goes through the streaming decoder in
+// one pass, which writes each frame back over itself in the ring. Complete payloads get parsed as soon as their
+// delimiter shows up, straight out of the ring, and only then are their bytes handed back to the reader
+static u32 decode_incomming_data(COMHandle *handle)
+{
+    SPSCRing *rx = &handle->rx;
+    CobsDecodeCtx *decoder = &handle->rx_decoder;
+    u32 start = handle->rx_decoded_pos;
+    u32 end = spsc_ring_write_pos(rx);
+    RingRange range = spsc_ring_peek(rx, start, end - start);
+
+    u32 pos = start;
+    for (RingSpan span : {range.first, range.second}) {
+        while (span.len != 0) {
+            bool frame_done;
+            u32 consumed = cobs_decode_stream(decoder, span.data, span.len, &frame_done);
+            span.data += consumed;
+            span.len -= consumed;
+            pos += consumed;
+            if (!frame_done) {
+                break;
+            }
 
-        if (*data_it == 0) {
-            *ctx->code_byte = ctx->distance_to_last_0;
-            ctx->distance_to_last_0 = 1;
-            ctx->code_byte = ctx->output_it;
-            data_it++;
-        } else if (ctx->distance_to_last_0 == 0xFF) {
-            *ctx->code_byte = ctx->distance_to_last_0;
-            ctx->distance_to_last_0 = 1;
-            ctx->code_byte = ctx->output_it;
-        } else {
-            *ctx->output_it = *data_it;
-            ctx->distance_to_last_0++;
-            data_it++;
+            u32 len = cobs_decoded_size(decoder);
+            if (decoder->overflow) {
+                LOG_ERROR("[{}] Dropping frame bigger than [{}] bytes", handle->log_name, decoder->output_len);
+                handle->rx_oversized_frames++;
+            } else if (len != 0) {
+                // Empty frames are just back to back delimiters, everything else has to carry a valid crc once the
+                // device said it adds one
+                bool has_crc = has_capability(handle->device_capabilities, DeviceCapability::FrameCrc);
+                if (!has_crc || check_frame_crc(decoder->output_buffer, &len)) {
+                    parse_device_response(handle, {decoder->output_buffer, decoder->output_buffer, (u16)len});
+                    handle->rx_frames_decoded++;
+                } else {
+                    handle->rx_crc_errors++;
+                }
+            }
+            // The next frame gets decoded over itself, from a bit before where it starts to keep it aligned. Those
+            // bytes are what's left of the frame that just got parsed
+            handle->rx_frame_start = pos & ~(kRxFrameAlign - 1);
+            *decoder = cobs_decode_init(spsc_ring_at(rx, handle->rx_frame_start), kMaxPayloadSize);
         }
+    }
 
-        ctx->output_it++;
+    // Nothing of a frame that overflowed gets written or parsed anymore, so it doesn't have to hold on to the ring
+    if (decoder->overflow) {
+        handle->rx_frame_start = end & ~(kRxFrameAlign - 1);
     }
+    spsc_ring_release(rx, handle->rx_frame_start);
+    handle->rx_decoded_pos = end;
+    handle->rx_bytes += end - start;
+    return end - start;
+}
 
+u32 handle_incomming_data(Comms *comms)
+{
+    // Connections don't share any decode state, so each one goes to its own worker. Storing the results and
+    // touching App is left for handle_commands on the main thread
+    std::atomic<u32> total = 0;
+    parallel_for((u32)comms->connections.size(), [comms, &total](u32 i) {
+        total.fetch_add(decode_incomming_data(comms->connections[i].handle), std::memory_order_relaxed);
+    });
+    return total.load(std::memory_order_relaxed);
+}
+
+// Results are stored in the background, so ids come from here instead of the db. Returns -1 when the db can't be
+// asked for the first one
+static s64 allocate_ccd_result_id(Comms *comms)
+{
+    if (comms->next_ccd_result_id == 0) {
+        s64 next_id = get_next_ccd_result_id();
+        if (next_id < 0) {
+            return -1;
+        }
+        comms->next_ccd_result_id = next_id;
+    }
+    return comms->next_ccd_result_id++;
+}
+
+// Completes the command waiting for `id`, false when there isn't one
+static bool complete_pending_command(DeviceConnection *conn, u32 id)
+{
+    auto pending = std::find_if(conn->pending_commands.begin(),
+                                conn->pending_commands.end(),
+                                [id](const PendingCommand &p) { return p.id == id; });
+    if (pending == conn->pending_commands.end()) {
+        return false;
+    }
+
+    f64 latency_ms =
+        std::chrono::duration<f64, std::milli>(std::chrono::steady_clock::now() - pending->sent_at).count();
+    CommandStats *stats = &conn->command_stats;
+    stats->completed++;
+    stats->max_latency_ms = std::max(stats->max_latency_ms, latency_ms);
+    stats->total_latency_ms += latency_ms;
+
+    *pending->result = {CommandStatus::Done, id, latency_ms};
+    task_executor_schedule(&gTaskExecutor, pending->waiter);
+    conn->pending_commands.erase(pending);
     return true;
 }
 
-struct Payload {
-    u8 *data;
-    u8 *cursor;
-    u16 len;
-};
+// A result means the device is done with everything before it. What's still pending gets the time it really needs
+// from here on, when a late result held it up
+static void push_back_pending_deadlines(DeviceConnection *conn, std::chrono::steady_clock::time_point now)
+{
+    for (PendingCommand &pending : conn->pending_commands) {
+        now += pending.exposure;
+        pending.deadline = std::max(pending.deadline, now + kCommandTimeout);
+    }
+}
 
-static u16 get_size(Payload *payload)
+// Empty when there's no dark and reference for the way `op` was taken, or they don't have as many pixels
+static std::vector<f32> correct_ccd_result(App *app, const CCDOperation &op, std::span<const u32> pixels)
 {
-    u16 size = payload->data < payload->cursor ? payload->cursor - payload->data : payload->data - payload->cursor;
-    return size;
+    auto it = app->corrections.find(get_correction_key(op.exposure_time_in_us, op.iterations));
+    if (it == app->corrections.end()) {
+        return {};
+    }
+    const CorrectionFrames &frames = it->second;
+    if (frames.dark.size() != pixels.size() || frames.reference.size() != pixels.size()) {
+        return {};
+    }
+
+    std::vector<f32> corrected(pixels.size());
+    correct_spectrum(pixels.data(), frames.dark.data(), frames.reference.data(), corrected.data(), (u32)pixels.size());
+    app->corrected_results++;
+    return corrected;
 }
 
-static bool reached_end(Payload *payload)
+// Main thread side of the decode, stores what the workers parsed and hands it over to App. The id a device sends
+// back only says which command the result answers, a device that rebooted or two devices counting on their own can
+// send the same one twice. Rows always come from allocate_ccd_result_id
+static void apply_device_results(App *app, Comms *comms, DeviceConnection *conn)
 {
-    return payload->data + payload->len == payload->cursor;
+    COMHandle *handle = conn->handle;
+    CCDOperationStore *results = &handle->rx_results;
+    for (u32 row = 0; row < ccd_store_size(results); ++row) {
+        CCDOperation op = ccd_store_get(results, row);
+        u32 device_result_id = op.id;
+        op.device_id = conn->device_id;
+
+        // The id of a command was allocated for it and stops being pending once its result is in, so that one can
+        // be the row. Anything else gets a new one, replays carry the ids of whatever db they were recorded against
+        bool answered = false;
+        if (!handle->is_replay) {
+            answered = complete_pending_command(conn, device_result_id);
+            push_back_pending_deadlines(conn, std::chrono::steady_clock::now());
+        }
+        if (!answered) {
+            s64 id = allocate_ccd_result_id(comms);
+            if (id < 0) {
+                LOG_ERROR("[{}] Dropping CCD result [{}], couldn't get an id for it", handle->log_name, op.id);
+                continue;
+            }
+            op.id = (u32)id;
+        }
+
+        // Filled in before it's shared, neither the writer nor the cache copy it
+        std::shared_ptr<CCDPixels> &pixels = handle->rx_pixels[row];
+        pixels->corrected = correct_ccd_result(app, op, pixels->raw);
+        db_ccd_result_create(op.id,
+                             op.device_id,
+                             device_result_id,
+                             op.ts.time_since_epoch(),
+                             op.exposure_time_in_us,
+                             op.iterations,
+                             pixels);
+
+        // Whatever just came in is the likeliest to be looked at
+        ccd_store_push_metadata(&app->ccd_operations, op, (u32)pixels->raw.size());
+        ccd_pixel_cache_put(&app->ccd_pixels, op.id, std::move(pixels));
+    }
+    ccd_store_clear(results);
+    handle->rx_pixels.clear();
 }
 
-static bool ensure_capacity(Payload *payload, u32 desired_cap)
+static void report_replay_stats(COMHandle *handle)
 {
-    u16 used = get_size(payload);
-    u16 left = payload->len - used;
-    return left >= desired_cap;
+    if (!handle->is_replay || handle->replay_reported || !handle->replay_done.load(std::memory_order_acquire)
+        || spsc_ring_readable(&handle->rx) != 0) {
+        return;
+    }
+    handle->replay_reported = true;
+
+    using namespace std::chrono;
+    f64 seconds = duration<f64>(steady_clock::now() - handle->connected_at).count();
+    f64 mb = handle->rx_bytes / (f64)1_MB;
+    LOG_NORM("[{}] Replay finished: [{}] frames, [{:.2f}] MB in [{:.3f}] s ({:.0f} frames/s, {:.2f} MB/s)",
+             handle->log_name,
+             handle->rx_frames_decoded,
+             mb,
+             seconds,
+             handle->rx_frames_decoded / seconds,
+             mb / seconds);
 }
 
-template <typename T>
-typename std::enable_if_t<std::is_unsigned_v<T>> serialize_varint(Payload *payload, T number)
+// Every device records to its own file, so the id goes into the name the user picked
+static std::string get_device_capture_path(std::string_view base_path, u32 device_id)
 {
-    do {
-        *payload->cursor = ((u8)number & 0b0111'1111) | (u8)((!!(number >> 7)) << 7);
-        payload->cursor++;
-        number >>= 7;
-    } while (number);
+    std::filesystem::path path{base_path};
+    std::string file_name = std::format("{}-dev{}{}", path.stem().string(), device_id, path.extension().string());
+    return (path.parent_path() / file_name).string();
 }
 
-template <typename T>
-typename std::enable_if_t<std::is_signed_v<T>> serialize_varint(Payload *payload, T number)
+static void update_window_title(Comms *comms)
 {
-    std::make_unsigned_t<T> zig_zag = (number >> (sizeof(number) * 8 - 1)) ^ (number << 1);
-    serialize_varint(payload, zig_zag);
+    if (comms->connections.empty()) {
+        set_window_title("Not connected");
+    } else if (comms->connections.size() == 1) {
+        const DeviceConnection &conn = comms->connections[0];
+        set_window_title(
+            std::format("{}: {}", conn.handle->is_replay ? "Replaying" : "Connected to", conn.com_path));
+    } else {
+        set_window_title(std::format("Connected to [{}] devices", comms->connections.size()));
+    }
 }
 
-template <typename T>
-typename std::enable_if_t<std::is_integral_v<T>, bool> serialize(Payload *payload, T number)
+// Frames the command at the end of the connection's tx batch, flush_host_commands sends it. The payload buffer and
+// the room reserved for the frame are sized from the message descriptor, so encoding can't run out of space
+template <typename Msg>
+static void queue_host_command(DeviceConnection *conn, const Msg &msg)
 {
-    static_assert(sizeof(T) < 8, "64 bit integer are not supported for now");
-    if (!ensure_capacity(payload, 5 /*Worst case for u64*/)) {
-        return false;
+    u8 buffer[get_max_command_size<Msg>()];
+    Payload payload = {buffer, buffer, sizeof(buffer)};
+    serialize_command(&payload, msg);
+
+    std::vector<u8> *tx = &conn->handle->tx_pending;
+    size_t frame_start = tx->size();
+    tx->resize(frame_start + get_max_encoded_size(sizeof(buffer)));
+    CobsCtx ctx = cobs_encode_init(tx->data() + frame_start, (u32)(tx->size() - frame_start));
+    cobs_encode(&ctx, buffer, get_size(&payload));
+    tx->resize(frame_start + cobs_encode_end(&ctx));
+    conn->handle->tx_pending_commands++;
+}
+
+static void add_connection(Comms *comms, std::string_view path, COMHandle *handle)
+{
+    s64 device_id = db_device_get_id(path);
+    if (device_id < 0) {
+        close_com_port(handle);
+        comms->connection_status = COMConnectionStatus::CONNECTION_ERROR;
+        return;
     }
-    // ensure_capacity(payload, 1 /*Tag*/ + 5 /*Worst case for u64*/))
-    // serialize(payload, SerializedFieldTag::VarInt);
-    serialize_varint(payload, number);
-    return true;
+
+    handle->log_name = std::format("device {}", device_id);
+    if (!handle->is_replay && !comms->capture_path.empty()) {
+        std::string capture_path = get_device_capture_path(comms->capture_path, (u32)device_id);
+        capture_writer_open(&handle->capture, capture_path.c_str());
+    }
+    // Only starts reading once everything above is set up
+    if (!start_reader(handle)) {
+        close_com_port(handle);
+        comms->connection_status = COMConnectionStatus::CONNECTION_ERROR;
+        return;
+    }
+
+    LOG_NORM("Connected [{}] as device [{}]", path, device_id);
+    comms->connections.push_back({(u32)device_id, std::string{path}, handle});
+    // What the device can do decides whether its frames have a crc and if it can switch encodings
+    if (!handle->is_replay) {
+        queue_host_command(&comms->connections.back(), GetInfoCommand{});
+    }
+    comms->connection_status = COMConnectionStatus::CONNECTED;
+    update_window_title(comms);
 }
 
-template <typename T>
-typename std::enable_if_t<std::is_enum_v<T>, bool> serialize(Payload *payload, T number)
+// Sends `conn->pixel_encoding`, or goes back to absolute when the device doesn't know about encodings
+static void send_pixel_encoding(DeviceConnection *conn)
 {
-    return serialize(payload, static_cast<std::underlying_type_t<T>>(number));
+    if (!has_capability(conn->capabilities, DeviceCapability::PixelEncoding)) {
+        LOG_ERROR("Device [{}] can't switch pixel encodings", conn->device_id);
+        conn->pixel_encoding = PixelEncoding::Absolute;
+        return;
+    }
+    LOG_NORM("Switching device [{}] to [{}] pixels", conn->device_id, get_pixel_encoding_name(conn->pixel_encoding));
+    queue_host_command(conn, SetPixelEncodingCommand{conn->pixel_encoding});
 }
 
-inline bool serialize(Payload *payload, const byte *data, u32 len)
+// Picks up the device's Info the first time it shows up, and sends the encoding asked for before it did
+static void apply_device_info(DeviceConnection *conn)
 {
-    // ensure_capacity(payload, 1 /*Tag*/ + 5 /*Worst case for u32 Len*/);
-    if (!ensure_capacity(payload, 5 + len)) {
-        return false;
+    COMHandle *handle = conn->handle;
+    if (conn->has_info || !handle->device_info_received) {
+        return;
+    }
+    conn->has_info = true;
+    conn->capabilities = handle->device_capabilities;
+    if (conn->pixel_encoding != PixelEncoding::Absolute && !handle->is_replay) {
+        send_pixel_encoding(conn);
     }
-    // serialize(payload, SerializedFieldTag::DataWithLen);
-    serialize_varint(payload, len);
-    memcpy(payload->cursor, data, len);
-    payload->cursor += len;
-    return true;
 }
 
-template <typename T>
-typename std::enable_if_t<std::is_unsigned_v<T>, bool> deserialize_varint(Payload *payload, T *number)
+static void flush_host_commands(DeviceConnection *conn)
 {
-    *number = *payload->cursor & 0b0111'1111;
-    for (u32 i = 7; *payload->cursor & 0b1000'0000; i += 7) {
-        if (reached_end(payload)) {
+    COMHandle *handle = conn->handle;
+    if (handle->tx_pending.empty()) {
+        return;
+    }
+
+    if (write_to_com_device(handle, handle->tx_pending.data(), (u32)handle->tx_pending.size())) {
+        handle->tx_commands += handle->tx_pending_commands;
+        handle->tx_writes++;
+    } else {
+        LOG_ERROR("Failed sending [{}] commands to device [{}]", handle->tx_pending_commands, conn->device_id);
+    }
+    handle->tx_pending.clear();
+    handle->tx_pending_commands = 0;
+}
+
+////////////////////////////////////////////////////////////////
+//// Acquisition plans
+////////////////////////////////////////////////////////////////
+
+// Commands of a plan kept queued on the device. Two is enough for the next exposure to start as soon as the current
+// one is done, more only makes stopping a plan slower
+static constexpr u32 kAcquisitionPipelineDepth = 2;
+
+// Which step of which run of a plan a CCD command is a shot of
+struct PlanShot {
+    u32 generation;
+    u32 step;
+};
+
+// The run `shot` was sent for, nullptr when it was stopped or its device is gone
+static AcquisitionRun *find_plan_run(Comms *comms, u32 device_id, PlanShot shot)
+{
+    DeviceConnection *conn = find_connection(comms, device_id);
+    if (!conn || !conn->acquisition.running || conn->acquisition.generation != shot.generation) {
+        return nullptr;
+    }
+    return &conn->acquisition;
+}
+
+static bool is_plan_running(Comms *comms, u32 device_id, PlanShot shot)
+{
+    return find_plan_run(comms, device_id, shot) != nullptr;
+}
+
+// Frees the pipeline slot of the shot
+static void plan_shot_done(Comms *comms, u32 device_id, PlanShot shot, f64 latency_ms)
+{
+    using namespace std::chrono;
+
+    AcquisitionRun *run = find_plan_run(comms, device_id, shot);
+    if (!run) {
+        return;
+    }
+
+    auto now = steady_clock::now();
+    AcquisitionStepStats *stats = &run->stats[shot.step];
+    stats->done++;
+    stats->max_latency_ms = std::max(stats->max_latency_ms, latency_ms);
+    stats->total_latency_ms += latency_ms;
+    stats->total_interval_ms += duration<f64, std::milli>(now - run->last_result_at).count();
+
+    run->in_flight--;
+    run->last_result_at = now;
+    run->done++;
+}
+
+// A shot that ran out of retries takes the whole plan with it
+static void plan_shot_failed(Comms *comms, u32 device_id, PlanShot shot, std::string_view reason)
+{
+    AcquisitionRun *run = find_plan_run(comms, device_id, shot);
+    if (!run) {
+        return;
+    }
+    LOG_ERROR(
+        "Device [{}] {}, aborting acquisition plan after [{}/{}] shots", device_id, reason, run->done, run->total);
+    run->running = false;
+}
+
+static void start_acquisition(DeviceConnection *conn, std::span<const AcquisitionStep> steps)
+{
+    AcquisitionRun *run = &conn->acquisition;
+    if (run->running) {
+        LOG_ERROR("Device [{}] is already running an acquisition plan", conn->device_id);
+        return;
+    }
+
+    // Shots of the last run can still be waiting for their result, they must not count towards this one
+    u32 generation = run->generation + 1;
+    *run = {};
+    run->generation = generation;
+    for (const AcquisitionStep &step : steps) {
+        if (step.exposure == 0 || step.iterations == 0 || step.repeat == 0) {
+            LOG_ERROR("Skipping acquisition step with exposure [{}], iterations [{}], repeat [{}]",
+                      step.exposure,
+                      step.iterations,
+                      step.repeat);
+            continue;
+        }
+        run->steps.push_back(step);
+        run->total += step.repeat;
+    }
+    if (run->steps.empty()) {
+        LOG_ERROR("Acquisition plan for device [{}] has nothing to run", conn->device_id);
+        return;
+    }
+
+    run->stats.resize(run->steps.size());
+    run->running = true;
+    run->started_at = std::chrono::steady_clock::now();
+    run->last_result_at = run->started_at;
+    LOG_NORM("Starting acquisition plan on device [{}]: [{}] steps, [{}] shots",
+             conn->device_id,
+             run->steps.size(),
+             run->total);
+}
+
+// Shots go out as CCD commands, with the same timeout and retries as any other
+static Task run_ccd_operation(
+    Comms *comms, u32 device_id, u32 exposure, u32 iterations, std::optional<PlanShot> shot = std::nullopt);
+
+// Keeps the device's queue topped up with the next shots of the plan. Runs every tick, after the results of the
+// tick freed their slots and before the commands get flushed
+static void run_acquisition(Comms *comms, DeviceConnection *conn)
+{
+    using namespace std::chrono;
+
+    AcquisitionRun *run = &conn->acquisition;
+    if (!run->running) {
+        return;
+    }
+
+    auto now = steady_clock::now();
+    while (run->in_flight < kAcquisitionPipelineDepth && run->next_step < run->steps.size()) {
+        if (run->last_delay_ms != 0
+            && (run->in_flight != 0 || now < run->last_result_at + milliseconds(run->last_delay_ms))) {
+            break;
+        }
+
+        const AcquisitionStep step = run->steps[run->next_step];
+        PlanShot shot = {run->generation, run->next_step};
+        run->in_flight++;
+        run->last_delay_ms = step.delay_ms;
+        if (++run->next_repeat == step.repeat) {
+            run->next_repeat = 0;
+            run->next_step++;
+        }
+
+        // Runs until the command is queued, a shot that couldn't be sent already aborted the plan
+        run_ccd_operation(comms, conn->device_id, step.exposure, step.iterations, shot);
+        if (!run->running) {
+            return;
+        }
+    }
+
+    if (run->done == run->total) {
+        LOG_NORM("Acquisition plan on device [{}] done, [{}] shots in [{:.2f}] s",
+                 conn->device_id,
+                 run->total,
+                 duration<f64>(run->last_result_at - run->started_at).count());
+        run->running = false;
+    }
+}
+
+////////////////////////////////////////////////////////////////
+//// Awaitable device commands
+////////////////////////////////////////////////////////////////
+
+// The device runs commands one after the other, so one that's queued behind others only starts once they're done
+static std::chrono::steady_clock::time_point get_command_start(const DeviceConnection *conn,
+                                                               std::chrono::steady_clock::time_point now)
+{
+    for (const PendingCommand &pending : conn->pending_commands) {
+        now += pending.exposure;
+    }
+    return now;
+}
+
+// Sends a CCD command when awaited and resumes with its CommandResult once the result with the same id is stored,
+// once the exposure plus kCommandTimeout is over or once the device is gone
+struct CCDCommandAwaiter {
+    Comms *comms;
+    u32 device_id;
+    u32 exposure;
+    u32 iterations;
+    CommandResult result;
+
+    bool await_ready()
+    {
+        return false;
+    }
+
+    // Returning false resumes right away, for commands that couldn't be sent
+    bool await_suspend(std::coroutine_handle<> waiter)
+    {
+        using namespace std::chrono;
+
+        result = {CommandStatus::Disconnected, 0, 0};
+        DeviceConnection *conn = find_connection(comms, device_id);
+        if (!conn || conn->handle->is_replay) {
+            return false;
+        }
+        s64 id = allocate_ccd_result_id(comms);
+        if (id < 0) {
             return false;
         }
-        // assert(sizeof(T) <= i / 7 - 1);
-        payload->cursor++;
-        *number |= (T)(*(payload->cursor) & 0b0111'1111) << i;
+
+        queue_host_command(conn, CCDSensorCommand{(u32)id, iterations, exposure});
+
+        auto now = steady_clock::now();
+        auto duration = duration_cast<steady_clock::duration>(microseconds((u64)exposure * iterations));
+        auto deadline = get_command_start(conn, now) + duration + kCommandTimeout;
+        conn->pending_commands.push_back({(u32)id, now, duration, deadline, &result, waiter});
+        return true;
     }
-    payload->cursor++;
-    return true;
+
+    CommandResult await_resume()
+    {
+        return result;
+    }
+};
+
+static CCDCommandAwaiter send_ccd_command(Comms *comms, u32 device_id, u32 exposure, u32 iterations)
+{
+    return {comms, device_id, exposure, iterations, {}};
 }
 
-template <typename T>
-typename std::enable_if_t<std::is_signed_v<T>, bool> deserialize_varint(Payload *payload, T *number)
+// What StartCCDOperation and the shots of acquisition plans run. A result that doesn't come back in time is asked for
+// again under a new id, the late one still gets stored if it does show up
+static Task run_ccd_operation(
+    Comms *comms, u32 device_id, u32 exposure, u32 iterations, std::optional<PlanShot> shot)
 {
-    if (deserialize_varint(payload, (std::make_unsigned_t<T> *)number)) {
-        *number = (*number >> 1) ^ -(*number & 1);
+    for (u32 attempt = 0; attempt <= kCommandRetries; ++attempt) {
+        // Plans send far too many to log every one
+        if (!shot) {
+            LOG_NORM("Sending CCD command to device [{}]: Exposure={}, Iterations={}", device_id, exposure, iterations);
+        }
+        CommandResult result = co_await send_ccd_command(comms, device_id, exposure, iterations);
+        switch (result.status) {
+            case CommandStatus::Done: {
+                if (shot) {
+                    plan_shot_done(comms, device_id, *shot, result.latency_ms);
+                } else {
+                    LOG_NORM(
+                        "CCD result [{}] from device [{}] took [{:.1f}] ms", result.id, device_id, result.latency_ms);
+                }
+                co_return;
+            }
+            case CommandStatus::TimedOut: {
+                LOG_ERROR("CCD command [{}] to device [{}] timed out", result.id, device_id);
+                // Nobody is waiting for the shots of a plan that was stopped in the meantime
+                if (shot && !is_plan_running(comms, device_id, *shot)) {
+                    co_return;
+                }
+                break;
+            }
+            case CommandStatus::Disconnected: {
+                LOG_ERROR("CCD command to device [{}] failed, the device is gone", device_id);
+                if (shot) {
+                    plan_shot_failed(comms, device_id, *shot, "couldn't send a shot");
+                }
+                co_return;
+            }
+        }
+    }
+    LOG_ERROR("Giving up on CCD command to device [{}] after [{}] attempts", device_id, kCommandRetries + 1);
+    if (shot) {
+        plan_shot_failed(comms, device_id, *shot, "stopped answering");
+    }
+}
+
+static void expire_pending_commands(DeviceConnection *conn, std::chrono::steady_clock::time_point now)
+{
+    std::erase_if(conn->pending_commands, [conn, now](const PendingCommand &pending) {
+        if (now < pending.deadline) {
+            return false;
+        }
+        conn->command_stats.timed_out++;
+        *pending.result = {CommandStatus::TimedOut, pending.id, 0};
+        task_executor_schedule(&gTaskExecutor, pending.waiter);
         return true;
+    });
+}
+
+std::chrono::steady_clock::time_point get_next_deadline(const Comms *comms)
+{
+    using namespace std::chrono;
+
+    steady_clock::time_point next = steady_clock::time_point::max();
+    for (const DeviceConnection &conn : comms->connections) {
+        for (const PendingCommand &pending : conn.pending_commands) {
+            next = std::min(next, pending.deadline);
+        }
+
+        const AcquisitionRun *run = &conn.acquisition;
+        if (!run->running) {
+            continue;
+        }
+        // Shots in flight are pending commands, only the delay between them is left
+        if (run->in_flight == 0 && run->last_delay_ms != 0) {
+            next = std::min(next, run->last_result_at + milliseconds(run->last_delay_ms));
+        }
     }
-    return false;
+    return next;
 }
 
-template <typename T>
-typename std::enable_if_t<std::is_integral_v<T>, bool> deserialize(Payload *payload, T *number)
+////////////////////////////////////////////////////////////////
+//// Pixels
+////////////////////////////////////////////////////////////////
+
+// Rows on each side that get read along with one that isn't cached. Whoever looks at a result usually goes through
+// the ones next to it after
+static constexpr u32 kPixelPrefetchRows = 2;
+
+// Reads pixels for the main thread, so a row that isn't cached never holds up a frame. Started on first use
+struct PixelLoader {
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable work_ready;
+    bool running = false;
+    // Waiting to be read, and read but not taken by the main thread yet. Both in the order they were asked for
+    std::vector<s64> requested;
+    std::vector<DBResultData> loaded;
+    // Main thread only. Asked for and not in the cache yet, so nothing gets asked for again every frame
+    std::unordered_set<u32> loading;
+};
+
+static PixelLoader gPixelLoader;
+
+static void pixel_loader_main()
 {
-    // if (read_tag(payload) != SerializedFieldTag::VarInt) {
-    //     return false;
-    // }
+    std::vector<s64> ids;
+    std::vector<DBResultData> results;
+    std::unique_lock lock(gPixelLoader.mutex);
+    while (true) {
+        gPixelLoader.work_ready.wait(lock, [] { return !gPixelLoader.running || !gPixelLoader.requested.empty(); });
+        if (!gPixelLoader.running) {
+            return;
+        }
+        ids.swap(gPixelLoader.requested);
+
+        // Everything asked for since the last round goes in one read
+        lock.unlock();
+        db_ccd_result_get_data(ids, &results);
+        ids.clear();
+        lock.lock();
 
-    return deserialize_varint(payload, number);
+        for (DBResultData &result : results) {
+            gPixelLoader.loaded.push_back(std::move(result));
+        }
+        wake_main_loop();
+    }
 }
 
-bool deserialize(Payload *payload, const u8 **data, u32 *len)
+void pixel_loader_shutdown()
 {
-    if (reached_end(payload)) {
-        return false;
+    if (!gPixelLoader.thread.joinable()) {
+        return;
     }
+    {
+        std::lock_guard lock(gPixelLoader.mutex);
+        gPixelLoader.running = false;
+    }
+    gPixelLoader.work_ready.notify_one();
+    gPixelLoader.thread.join();
+}
 
-    if (deserialize(payload, len)) {
-        *data = payload->cursor;
-        payload->cursor += *len;
-        return true;
+// Moves what the loader read into the cache, returns how many
+static u32 take_loaded_pixels(App *app)
+{
+    static std::vector<DBResultData> loaded;
+    {
+        std::lock_guard lock(gPixelLoader.mutex);
+        loaded.swap(gPixelLoader.loaded);
     }
 
-    return false;
+    for (DBResultData &data : loaded) {
+        gPixelLoader.loading.erase((u32)data.row_id);
+        // Rows the db doesn't have are cached as empty too, so they aren't asked for again every frame
+        ccd_pixel_cache_put(&app->ccd_pixels, (u32)data.row_id, {std::move(data.pixels), std::move(data.corrected)});
+    }
+    u32 count = (u32)loaded.size();
+    loaded.clear();
+    return count;
 }
 
-template <typename T>
-typename std::enable_if_t<std::is_enum_v<T>, bool> deserialize(Payload *payload, T *number)
+// Reads them right away when they aren't cached, for the few things that can't wait for the loader
+static const CCDPixels *load_ccd_operation_pixels(App *app, u32 id)
 {
-    return deserialize(payload, (std::underlying_type_t<T> *)(number));
+    if (const CCDPixels *pixels = ccd_pixel_cache_get(&app->ccd_pixels, id)) {
+        return pixels;
+    }
+    // A failed read is cached as empty so it isn't retried every frame
+    CCDPixels pixels;
+    db_ccd_result_get_data(id, &pixels.raw, &pixels.corrected);
+    return ccd_pixel_cache_put(&app->ccd_pixels, id, std::move(pixels));
 }
 
-static std::vector<AppCommand> gCommandQueue;
+const CCDPixels &get_ccd_operation_pixels(App *app, u32 row)
+{
+    static const CCDPixels kNotLoaded;
 
-void queue_command(const AppCommand &cmd)
+    const CCDOperationStore *ops = &app->ccd_operations;
+    u32 id = ops->ids[row];
+    if (const CCDPixels *pixels = ccd_pixel_cache_get(&app->ccd_pixels, id)) {
+        return *pixels;
+    }
+
+    // The row itself goes last, so once they're in the neighbours can't push it out of the cache
+    s64 ids[2 * kPixelPrefetchRows + 1];
+    u32 count = 0;
+    u32 first = row > kPixelPrefetchRows ? row - kPixelPrefetchRows : 0;
+    u32 last = std::min(row + kPixelPrefetchRows, ccd_store_size(ops) - 1);
+    for (u32 i = first; i <= last; ++i) {
+        u32 neighbour = ops->ids[i];
+        if (i != row && !ccd_pixel_cache_contains(&app->ccd_pixels, neighbour)
+            && !gPixelLoader.loading.contains(neighbour)) {
+            ids[count++] = neighbour;
+        }
+    }
+    if (!gPixelLoader.loading.contains(id)) {
+        ids[count++] = id;
+    }
+    if (count == 0) {
+        return kNotLoaded;
+    }
+
+    for (u32 i = 0; i < count; ++i) {
+        gPixelLoader.loading.insert((u32)ids[i]);
+    }
+    {
+        std::lock_guard lock(gPixelLoader.mutex);
+        if (!gPixelLoader.running) {
+            gPixelLoader.running = true;
+            gPixelLoader.thread = std::thread(pixel_loader_main);
+        }
+        gPixelLoader.requested.insert(gPixelLoader.requested.end(), ids, ids + count);
+    }
+    gPixelLoader.work_ready.notify_one();
+    return kNotLoaded;
+}
+
+////////////////////////////////////////////////////////////////
+//// Dark / reference correction
+////////////////////////////////////////////////////////////////
+
+static void set_correction_frame(
+    App *app, u32 exposure, u32 iterations, CorrectionFrameKind kind, u32 id, std::span<const u32> pixels)
 {
-    gCommandQueue.push_back(cmd);
+    CorrectionFrames *frames = &app->corrections[get_correction_key(exposure, iterations)];
+    if (kind == CorrectionFrameKind::Dark) {
+        frames->dark_id = id;
+        frames->dark.assign(pixels.begin(), pixels.end());
+    } else {
+        frames->reference_id = id;
+        frames->reference.assign(pixels.begin(), pixels.end());
+    }
 }
 
-u32 handle_incomming_data(COMHandle *handle, u8 *buffer, u32 offset, u32 len)
+static void load_ccd_operations(App *app, std::chrono::seconds start_date, std::chrono::seconds end_date)
 {
-    if (handle == nullptr) {
-        return 0;
+    db_ccd_result_get_by_time_range(start_date, end_date, &app->ccd_operations);
+    app->ccd_operations_since = start_date;
+    app->has_older_ccd_operations = true;
+}
+
+void load_recent_ccd_operations(App *app)
+{
+    using namespace std::chrono;
+    auto today = floor<days>(current_zone()->to_local(system_clock::now()));
+    load_ccd_operations(app, (today - kRecentCCDOperationDays).time_since_epoch(), seconds(s64Max));
+}
+
+// Results the Results tab pages in at a time
+static constexpr u32 kCCDOperationPageSize = 1000;
+
+// Rows are in (timestamp, id) order, so the page is whatever comes right before the first one
+static void load_older_ccd_operations(App *app)
+{
+    CCDOperationStore *ops = &app->ccd_operations;
+    std::chrono::seconds before = app->ccd_operations_since;
+    u32 before_id = 0;
+    if (ccd_store_size(ops) != 0) {
+        before = ops->timestamps[0].time_since_epoch();
+        before_id = ops->ids[0];
     }
 
-    u32 total = offset;
-    u32 read = 0;
-    do {
-        read = read_from_com_device(handle, buffer + offset, len - total);
-        for (u32 i = 0, j = 0; i < read; ++i) {
-            if (buffer[total + i] == '\0') {
-                queue_command({
-                    .type = AppCommand::DecodeIncommingData,
-                    .data{
-                          .frame_start = total + j,
-                          .frame_end = total + i,
-                          }
-                });
-                j = i + 1;
-            }
+    CCDOperationStore older;
+    db_ccd_result_get_before(before, before_id, kCCDOperationPageSize, &older);
+    app->has_older_ccd_operations = ccd_store_size(&older) == kCCDOperationPageSize;
+    if (ccd_store_size(&older) == 0) {
+        return;
+    }
+    app->ccd_operations_since = older.timestamps[0].time_since_epoch();
+    ccd_store_reserve(&older, ccd_store_size(&older) + ccd_store_size(ops), 0);
+    ccd_store_append(&older, ops);
+    *ops = std::move(older);
+}
+
+void load_correction_frames(App *app)
+{
+    std::vector<DBCorrectionFrame> frames;
+    db_correction_frames_get(&frames);
+    for (const DBCorrectionFrame &frame : frames) {
+        CCDPixels pixels;
+        if (!db_ccd_result_get_data(frame.result_id, &pixels.raw, &pixels.corrected) || pixels.raw.empty()) {
+            LOG_ERROR("Correction frame [{}] has no pixels, skipping it", frame.result_id);
+            continue;
         }
-        total += read;
-    } while (read != 0 && total < len);
+        set_correction_frame(
+            app, frame.integration_time, frame.iterations, frame.kind, (u32)frame.result_id, pixels.raw);
+    }
+    LOG_NORM("Loaded [{}] correction frames", frames.size());
+}
 
-    return total - offset;
+static bool is_connected(Comms *comms, std::string_view path)
+{
+    for (const DeviceConnection &conn : comms->connections) {
+        if (conn.com_path == path) {
+            return true;
+        }
+    }
+    return false;
 }
 
-void handle_commands(App *app, Comms *comms)
+u32 handle_commands(App *app, Comms *comms)
 {
-    u32 incomming_data_decoded_len = 0;
-    for (const auto &command : gCommandQueue) {
+    // Only takes what is there right now, anything queued while these run waits for the next tick
+    static std::vector<AppCommand> commands;
+    commands.clear();
+    while (const AppCommand *command = mpsc_queue_peek(&gCommandQueue)) {
+        commands.push_back(*command);
+        mpsc_queue_release(&gCommandQueue);
+    }
+
+    for (const auto &command : commands) {
         switch (command.type) {
             case AppCommand::ConnectToDevice: {
+                if (is_connected(comms, command.data.com_path)) {
+                    LOG_ERROR("Already connected to [{}]", command.data.com_path);
+                    break;
+                }
                 COMHandle *handle = setup_com_port(command.data.com_path);
                 if (handle) {
-                    comms->connected_com_path = command.data.com_path;
-                    comms->com_connection = handle;
-                    comms->connection_status = COMConnectionStatus::CONNECTED;
-                    set_window_title(std::format("Connected to: {}", command.data.com_path));
+                    add_connection(comms, command.data.com_path, handle);
                 } else {
                     comms->connection_status = COMConnectionStatus::CONNECTION_ERROR;
                 }
                 break;
             }
+            case AppCommand::ReplayCapture: {
+                if (is_connected(comms, command.data.replay.path)) {
+                    LOG_ERROR("Already replaying [{}]", command.data.replay.path);
+                    break;
+                }
+                COMHandle *handle = setup_replay_port(command.data.replay.path, command.data.replay.realtime);
+                if (handle) {
+                    LOG_NORM("Replaying capture [{}] {}",
+                             command.data.replay.path,
+                             command.data.replay.realtime ? "in real time" : "as fast as possible");
+                    add_connection(comms, command.data.replay.path, handle);
+                } else {
+                    comms->connection_status = COMConnectionStatus::CONNECTION_ERROR;
+                }
+                break;
+            }
+            case AppCommand::DisconnectDevice: {
+                DeviceConnection *conn = find_connection(comms, command.data.device_id);
+                if (!conn) {
+                    LOG_ERROR("Trying to disconnect unknown device [{}]", command.data.device_id);
+                    break;
+                }
+                // Commands queued before this one still go out, whatever the device sends back is lost with the
+                // connection
+                LOG_NORM("Disconnecting device [{}] ([{}])", conn->device_id, conn->com_path);
+                fail_pending_commands(conn);
+                flush_host_commands(conn);
+                close_com_port(conn->handle);
+                comms->connections.erase(comms->connections.begin() + (conn - comms->connections.data()));
+                update_window_title(comms);
+                break;
+            }
             case AppCommand::StartCCDOperation: {
-                u8 buffer[64];
-                Payload payload = {buffer, buffer, sizeof(buffer)};
-                serialize(&payload, HostToDeviceCommand::CCDSensor);
-                u32 id = get_next_ccd_result_id();
-                serialize(&payload, id);
-                serialize(&payload, command.data.ccd_op.iterations);
-                serialize(&payload, command.data.ccd_op.exposure);
-                serialize(&payload, (u16)420 /*crc*/);
-
-                u8 cobs[32];
-                CobsCtx ctx = cobs_encode_init(cobs, sizeof(cobs));
-                assert(cobs_encode(&ctx, buffer, get_size(&payload)));
-                u32 cobs_size = cobs_encode_end(&ctx);
-
-                LOG_NORM("Sending CCD command: Id={}, Exposure={}, Iterations={}",
-                         id,
-                         command.data.ccd_op.exposure,
-                         command.data.ccd_op.iterations);
+                DeviceConnection *conn = find_connection(comms, command.data.ccd_op.device_id);
+                if (!conn) {
+                    LOG_ERROR("Trying to send a CCD command to unknown device [{}]", command.data.ccd_op.device_id);
+                    break;
+                }
+                if (conn->handle->is_replay) {
+                    LOG_ERROR("Can't send commands while replaying a capture");
+                    break;
+                }
+
+                run_ccd_operation(
+                    comms, conn->device_id, command.data.ccd_op.exposure, command.data.ccd_op.iterations);
+                break;
+            }
+            case AppCommand::SetPixelEncoding: {
+                DeviceConnection *conn = find_connection(comms, command.data.pixel_encoding.device_id);
+                if (!conn) {
+                    LOG_ERROR("Trying to change the pixel encoding of unknown device [{}]",
+                              command.data.pixel_encoding.device_id);
+                    break;
+                }
+                if (conn->handle->is_replay) {
+                    LOG_ERROR("Can't send commands while replaying a capture");
+                    break;
+                }
 
-                assert(write_to_com_device(comms->com_connection, cobs, cobs_size));
+                conn->pixel_encoding = command.data.pixel_encoding.encoding;
+                if (!conn->has_info) {
+                    LOG_NORM("Switching device [{}] to [{}] pixels once it sent its info",
+                             conn->device_id,
+                             get_pixel_encoding_name(conn->pixel_encoding));
+                    break;
+                }
+                send_pixel_encoding(conn);
+                break;
+            }
+            case AppCommand::StartAcquisition: {
+                DeviceConnection *conn = find_connection(comms, command.data.acquisition.device_id);
+                if (!conn) {
+                    LOG_ERROR("Trying to start an acquisition plan on unknown device [{}]",
+                              command.data.acquisition.device_id);
+                    break;
+                }
+                if (conn->handle->is_replay) {
+                    LOG_ERROR("Can't send commands while replaying a capture");
+                    break;
+                }
+                start_acquisition(conn, {command.data.acquisition.steps, command.data.acquisition.step_count});
+                break;
+            }
+            case AppCommand::StopAcquisition: {
+                DeviceConnection *conn = find_connection(comms, command.data.device_id);
+                if (!conn || !conn->acquisition.running) {
+                    break;
+                }
+                // Shots already queued on the device still come back and get stored, they just aren't tracked
+                LOG_NORM("Stopping acquisition plan on device [{}] after [{}/{}] shots",
+                         conn->device_id,
+                         conn->acquisition.done,
+                         conn->acquisition.total);
+                conn->acquisition.running = false;
                 break;
             }
             case AppCommand::CCDOperationUpdateName: {
-                if (command.data.operation_to_update < app->ccd_operations.size()) {
-                    LOG_ERROR("Trying to update a non exising operation [{}] while current max is [{}]",
-                              command.data.operation_to_update,
-                              app->ccd_operations.size());
+                // Commands refer to operations by their row id, not by where they are in the list
+                s64 row = ccd_store_find(&app->ccd_operations, command.data.operation_to_update);
+                if (row < 0) {
+                    LOG_ERROR("Trying to update a non existing operation [{}]", command.data.operation_to_update);
                     break;
                 }
-                db_ccd_result_update_name(command.data.operation_to_update,
-                                          app->ccd_operations[command.data.operation_to_update].name);
+                db_ccd_result_update_name(command.data.operation_to_update, app->ccd_operations.names[row]);
                 break;
             }
             case AppCommand::CCDOperationUpdateNote: {
-                if (command.data.operation_to_update < app->ccd_operations.size()) {
-                    LOG_ERROR("Trying to update a non exising operation [{}] while current max is [{}]",
-                              command.data.operation_to_update,
-                              app->ccd_operations.size());
+                s64 row = ccd_store_find(&app->ccd_operations, command.data.operation_to_update);
+                if (row < 0) {
+                    LOG_ERROR("Trying to update a non existing operation [{}]", command.data.operation_to_update);
                     break;
                 }
-                db_ccd_result_update_name(command.data.operation_to_update,
-                                          app->ccd_operations[command.data.operation_to_update].note);
+                db_ccd_result_update_notes(command.data.operation_to_update, app->ccd_operations.notes[row]);
                 break;
             }
             case AppCommand::CCDOperationLoad: {
-                app->ccd_operations.clear();
-                db_ccd_result_get_by_time_range(command.data.start_date, command.data.end_date, &app->ccd_operations);
+                load_ccd_operations(app, command.data.load_range.start_date, command.data.load_range.end_date);
+                break;
+            }
+            case AppCommand::CCDOperationLoadOlder: {
+                load_older_ccd_operations(app);
                 break;
             }
-            case AppCommand::DecodeIncommingData: {
-                // NOTE we keep this buffer for as long as the program is running
-                static u8 *decode_buffer = (u8 *)calloc(1, 1 << 20);
-
-                u16 len = cobs_decode(comms->read_data_buffer + command.data.frame_start,
-                                      command.data.frame_end - command.data.frame_start,
-                                      decode_buffer,
-                                      1 << 20);
-
-                incomming_data_decoded_len += command.data.frame_end - command.data.frame_start;
-
-                Payload payload = {decode_buffer, decode_buffer, len};
-
-                DeviceToHostResponse cmd;
-                deserialize(&payload, &cmd);
-
-#define OK(x)                                    \
-    if (!(x)) {                                  \
-        LOG_ERROR("Failed deserializing field"); \
-        break;                                   \
-    }
-
-                switch (cmd) {
-                    case DeviceToHostResponse::CCDResult: {
-                        u32 id;
-                        OK(deserialize(&payload, &id))
-                        u32 iterations;
-                        OK(deserialize(&payload, &iterations))
-                        u32 exposure;
-                        OK(deserialize(&payload, &exposure))
-                        u32 pixel_count;
-                        OK(deserialize(&payload, &pixel_count));
-                        LOG_NORM("Got CCD result for [{}] with [{}] elements", id, pixel_count);
-
-                        using namespace std::chrono;
-                        auto now = time_point_cast<seconds>(current_zone()->to_local(system_clock::now()));
-                        CCDOperation op = {id, now, exposure, iterations};
-                        // TODO validate that pixel count is not something crazy
-                        assert(pixel_count < 5000);
-                        op.accumulated_values.reserve(pixel_count);
-                        for (u32 i = 0; i < pixel_count; ++i) {
-                            u32 &n = op.accumulated_values.emplace_back();
-                            if (!deserialize(&payload, &n)) {
-                                break;
-                            }
-                        }
-
-                        s64 created_id = db_ccd_result_create(now.time_since_epoch(),
-                                                              exposure,
-                                                              iterations,
-                                                              op.accumulated_values.data(),
-                                                              op.accumulated_values.size());
-                        assert(id == created_id);
-
-                        app->ccd_operations.push_back(std::move(op));
-                        break;
-                    }
-                    case DeviceToHostResponse::Log: {
-                        LogSeverity level;
-                        OK(deserialize(&payload, &level));
-                        u32 line;
-                        OK(deserialize(&payload, &line));
-                        u32 func_name_len;
-                        const u8 *func_name;
-                        OK(deserialize(&payload, &func_name, &func_name_len));
-                        u32 msg_len;
-                        const u8 *msg;
-                        OK(deserialize(&payload, &msg, &msg_len));
-                        log_impl(LogContext::DEVICE,
-                                 {},
-                                 {(char *)func_name, func_name_len},
-                                 line,
-                                 LogSeverity(level),
-                                 {(char *)msg, msg_len});
-                        break;
-                    }
-                    default: {
-                        break;
-                    }
+            case AppCommand::SetCorrectionFrame: {
+                u32 id = command.data.correction_frame.operation_id;
+                CorrectionFrameKind kind = command.data.correction_frame.kind;
+                s64 row = ccd_store_find(&app->ccd_operations, id);
+                if (row < 0) {
+                    LOG_ERROR("Trying to use a non existing operation [{}] as correction frame", id);
+                    break;
+                }
+                std::span<const u32> pixels = load_ccd_operation_pixels(app, id)->raw;
+                if (pixels.empty()) {
+                    LOG_ERROR("Operation [{}] has no pixels to use as correction frame", id);
+                    break;
                 }
-#undef OK
+
+                u32 exposure = app->ccd_operations.exposures[row];
+                u32 iterations = app->ccd_operations.iterations[row];
+                set_correction_frame(app, exposure, iterations, kind, id, pixels);
+                db_correction_frame_set(exposure, iterations, kind, id);
+                LOG_NORM("Using [{}] as {} for [{}] us x [{}]",
+                         id,
+                         kind == CorrectionFrameKind::Dark ? "dark" : "reference",
+                         exposure,
+                         iterations);
                 break;
             }
             default: {
@@ -563,12 +1642,23 @@ void handle_commands(App *app, Comms *comms)
         }
     }
 
-    if (incomming_data_decoded_len != 0) {
-        comms->read_data_size = comms->read_data_size - incomming_data_decoded_len;
-        if (comms->read_data_size != 0) {
-            memmove(
-                comms->read_data_buffer, comms->read_data_buffer + incomming_data_decoded_len, comms->read_data_size);
-        }
+    u32 loaded_pixels = take_loaded_pixels(app);
+
+    auto now = std::chrono::steady_clock::now();
+    for (DeviceConnection &conn : comms->connections) {
+        apply_device_info(&conn);
+        apply_device_results(app, comms, &conn);
+        expire_pending_commands(&conn, now);
     }
-    gCommandQueue.clear();
+
+    // Whatever got resumed can send more commands, they go out with this tick's flush
+    task_executor_run(&gTaskExecutor);
+
+    for (DeviceConnection &conn : comms->connections) {
+        run_acquisition(comms, &conn);
+        flush_host_commands(&conn);
+        report_replay_stats(conn.handle);
+    }
+
+    return (u32)commands.size() + loaded_pixels;
 }
@@ -1,9 +1,41 @@
 #pragma once
 #include "shorthand.hpp"
 
+#include "ccd_store.hpp"
+
 #include <chrono>
+#include <coroutine>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 void set_window_title(std::string_view);
+// Wakes the main loop up if it's sleeping, can be called from any thread. Anything that needs handle_* or a redraw
+// and doesn't come from window input has to call it
+void wake_main_loop();
+
+struct FrameStats {
+    u64 frames_rendered;
+    // Times the main loop woke up and found nothing to draw
+    u64 frames_skipped;
+};
+
+FrameStats get_frame_stats();
+
+// protocol.hpp
+enum class PixelEncoding : u8;
+
+// Stored in the db, don't reorder
+enum class CorrectionFrameKind : u8 { Dark, Reference };
+
+struct AcquisitionStep {
+    u32 exposure;
+    u32 iterations;
+    u32 repeat;
+    // Pause after every result of this step before the next exposure starts. With 0 the next command is already
+    // queued on the device when the result comes back, so the sensor never waits for the host
+    u32 delay_ms;
+};
 
 struct AppCommand {
     enum Type : u8 {
@@ -12,28 +44,53 @@ struct AppCommand {
         CCDOperationUpdateName,
         CCDOperationUpdateNote,
         CCDOperationLoad,
-        DecodeIncommingData,
+        CCDOperationLoadOlder,
+        ReplayCapture,
+        DisconnectDevice,
+        SetPixelEncoding,
+        StartAcquisition,
+        StopAcquisition,
+        SetCorrectionFrame,
     };
 
     Type type;
     union {
         std::string_view com_path;
         struct {
+            u32 device_id;
             u32 exposure;
             u32 iterations;
         } ccd_op;
-        struct {
-            u32 frame_start;
-            u32 frame_end;
-        };
         struct {
             std::chrono::seconds start_date;
             std::chrono::seconds end_date;
-        };
+        } load_range;
+        struct {
+            std::string_view path;
+            bool realtime;
+        } replay;
+        struct {
+            u32 device_id;
+            PixelEncoding encoding;
+        } pixel_encoding;
+        struct {
+            u32 device_id;
+            // Copied when the command runs, has to stay alive until then
+            const AcquisitionStep *steps;
+            u32 step_count;
+        } acquisition;
+        struct {
+            u32 operation_id;
+            CorrectionFrameKind kind;
+        } correction_frame;
         u32 operation_to_update;
+        u32 device_id;
     }data;
 };
 
+// Thread safe and lock free, any thread can queue commands for handle_commands to run on the main thread.
+// A batch goes in all or nothing and comes out in order, with nothing from other threads in between
+bool queue_commands(const AppCommand *commands, u32 count);
 void queue_command(const AppCommand &cmd);
 
 struct ComPort {
@@ -45,33 +102,166 @@ struct COMHandle;
 
 enum class COMConnectionStatus : u8 { NOT_CONNECTED, CONNECTED, CONNECTION_ERROR };
 
+enum class CommandStatus : u8 { Done, TimedOut, Disconnected };
+
+struct CommandResult {
+    CommandStatus status;
+    u32 id;
+    // From queueing the command to its response coming back
+    f64 latency_ms;
+};
+
+// A command sent to a device, waiting for the response with its id. Whoever co_awaits it gets resumed when that
+// comes back, when the deadline passes or when the device goes away
+struct PendingCommand {
+    u32 id;
+    std::chrono::steady_clock::time_point sent_at;
+    // How long the device takes for it once it gets to it
+    std::chrono::steady_clock::duration exposure;
+    std::chrono::steady_clock::time_point deadline;
+    CommandResult *result;
+    std::coroutine_handle<> waiter;
+};
+
+struct CommandStats {
+    u64 completed;
+    u64 timed_out;
+    f64 max_latency_ms;
+    f64 total_latency_ms;
+};
+
+struct AcquisitionStepStats {
+    u32 done;
+    // From sending the command to storing its result, includes the time it spent queued behind the one before
+    f64 max_latency_ms;
+    f64 total_latency_ms;
+    // Between a result and the previous one, what a shot of the step really costs once the pipeline is full
+    f64 total_interval_ms;
+};
+
+// A plan running on one device. Everything in here is main thread only
+struct AcquisitionRun {
+    bool running = false;
+    // Goes up with every plan started on the device, shots of an older one don't count towards it
+    u32 generation = 0;
+    std::vector<AcquisitionStep> steps;
+    std::vector<AcquisitionStepStats> stats;
+    // Shots sent and waiting for a result. They are pending commands like any other, retries included
+    u32 in_flight = 0;
+    u32 next_step = 0;
+    u32 next_repeat = 0;
+    u32 done = 0;
+    u32 total = 0;
+    // Delay of the last shot sent, the next one waits for its result when it isn't 0
+    u32 last_delay_ms = 0;
+    std::chrono::steady_clock::time_point started_at;
+    std::chrono::steady_clock::time_point last_result_at;
+};
+
+struct DeviceConnection {
+    // Row of `com_path` in the devices table, so the same port keeps its id between runs
+    u32 device_id;
+    std::string com_path;
+    COMHandle *handle;
+    // Last encoding asked for with SetPixelEncoding. Devices start sending absolute values, every kind is always
+    // accepted so results already in flight when it changes are fine. One asked for before the device's Info is sent
+    // once it's there, if the device has DeviceCapability::PixelEncoding
+    PixelEncoding pixel_encoding = {};
+    // DeviceCapability bits from the device's answer to GetInfo, only valid once `has_info` is set
+    u32 capabilities = 0;
+    bool has_info = false;
+    AcquisitionRun acquisition;
+    std::vector<PendingCommand> pending_commands;
+    CommandStats command_stats = {};
+};
+
+struct DeviceStats {
+    u64 rx_bytes;
+    u64 rx_frames;
+    u64 rx_crc_errors;
+    u64 rx_oversized_frames;
+    u32 rx_full_stalls;
+    // Host commands sent and the writes it took, batching makes the second one smaller
+    u64 tx_commands;
+    u64 tx_writes;
+    // Commands waiting for their response and how long the ones that got it took
+    u32 commands_in_flight;
+    u64 command_timeouts;
+    f64 avg_command_latency_ms;
+    f64 max_command_latency_ms;
+    bool lost;
+    bool is_replay;
+};
+
+DeviceStats get_device_stats(const DeviceConnection *conn);
+
 struct Comms {
     std::vector<ComPort> enumerated_ports;
-    COMHandle *com_connection = nullptr;
+    // Every device (or replay) has its own reader thread, ring and decode state
+    std::vector<DeviceConnection> connections;
+    // Result of the last connection attempt
     COMConnectionStatus connection_status = COMConnectionStatus::NOT_CONNECTED;
-    std::string connected_com_path;
-
-    static constexpr auto kReadDataMaxSize = 1_MB;
-    u8 *read_data_buffer = nullptr;
-    u32 read_data_size = 0;
+    // When not empty, the next connection records a raw capture of everything it reads. Each device gets its own
+    // file with the device id appended to the name
+    std::string capture_path;
+    // Ids sent along with CCD commands. Tracked here instead of asking the db because several devices can have
+    // commands in flight whose results aren't stored yet. 0 until the first command
+    s64 next_ccd_result_id = 0;
 };
 
-u32 handle_incomming_data(COMHandle *handle, u8 *buffer, u32 offset, u32 len);
+DeviceConnection *find_connection(Comms *comms, u32 device_id);
+// Earliest time handle_commands has something to do without any data coming in, like an acquisition delay running
+// out or a command timing out. time_point::max() when nothing is waiting
+std::chrono::steady_clock::time_point get_next_deadline(const Comms *comms);
+
+// Decodes whatever the reader threads buffered since the last call and parses every complete frame. The results are
+// stored and handed to App by handle_commands. Returns the amount of new bytes over all the connections
+u32 handle_incomming_data(Comms *comms);
+// Closes every connection
+void close_com_connection(Comms *comms);
 void enumerate_com_ports(std::vector<ComPort> *ports);
 
-struct CCDOperation {
-    u32 id;
-    std::chrono::local_seconds ts;
-    u32 exposure_time_in_us;
-    u32 iterations;
-    // TODO change this from vector to just an alloc because vector is idiotic
-    std::vector<u32> accumulated_values;
-    std::string name;
-    std::string note;
+// Dark and white reference for one exposure time and iteration count. Results taken the same way get corrected with
+// them as they come in
+struct CorrectionFrames {
+    // 0 until one gets picked
+    u32 dark_id = 0;
+    u32 reference_id = 0;
+    std::vector<u32> dark;
+    std::vector<u32> reference;
 };
 
+inline u64 get_correction_key(u32 exposure, u32 iterations)
+{
+    return (u64)exposure << 32 | iterations;
+}
+
 struct App {
-    std::vector<CCDOperation> ccd_operations;
+    // Only metadata, the pixels go through `ccd_pixels`
+    CCDOperationStore ccd_operations;
+    CCDPixelCache ccd_pixels;
+    // Every result from here on is in `ccd_operations`, older ones get paged in with CCDOperationLoadOlder. False
+    // once a page came back short
+    std::chrono::seconds ccd_operations_since{0};
+    bool has_older_ccd_operations = true;
+
+    // By get_correction_key
+    std::unordered_map<u64, CorrectionFrames> corrections;
+    u64 corrected_results = 0;
 };
 
-void handle_commands(App *app, Comms *comms);
+// Pixels of `row` in app->ccd_operations. When they aren't cached they come back empty, and get read from the db in the
+// background together with the rows around it. The main loop is woken up once they're in. They stay empty when the db
+// doesn't have them. Only good until the next call
+const CCDPixels &get_ccd_operation_pixels(App *app, u32 row);
+// Stops the thread get_ccd_operation_pixels reads with, before db_close
+void pixel_loader_shutdown();
+// Picks up the darks and references stored in the db, call it once after db_open
+void load_correction_frames(App *app);
+// Days of results the Results tab starts with
+static constexpr std::chrono::days kRecentCCDOperationDays{7};
+// Loads the results of the last kRecentCCDOperationDays, call it once after db_open
+void load_recent_ccd_operations(App *app);
+
+// Returns the amount of commands it ran plus the results whose pixels finished loading, either needs a redraw
+u32 handle_commands(App *app, Comms *comms);
@@ -4,7 +4,11 @@ SETLOCAL
 
 IF NOT DEFINED CMD_BAT ( SET CMD_BAT="C:\Program Files\Microsoft Visual Studio\2022\Community\Common7\Tools\VsDevCmd.bat" )
 IF NOT DEFINED DEBUG ( SET DEBUG=1 )
-IF NOT DEFINED EXE_NAME ( SET EXE_NAME=controller-app )
+REM HEADLESS=1 builds the console only controller from headless.cpp, without GLFW/ImGui/ImPlot
+IF NOT DEFINED HEADLESS ( SET HEADLESS=0 )
+IF NOT DEFINED EXE_NAME (
+    IF %HEADLESS%==1 ( SET EXE_NAME=controller-headless ) ELSE ( SET EXE_NAME=controller-app )
+)
 IF NOT DEFINED RUN_AFTER_BUILD ( SET RUN_AFTER_BUILD=1 )
 
 REM Set the visual studio console/vars
@@ -23,20 +27,34 @@ ECHO -Ithird-party/sqlite >> compile_flags.txt
 ECHO -D_CRT_SECURE_NO_WARNINGS >> compile_flags.txt
 
 SET FILES=^
-    third-party/imgui/backends/imgui_impl_glfw.cpp^
-    third-party/imgui/backends/imgui_impl_opengl3.cpp^
-    third-party/imgui/imgui.cpp^
-    third-party/imgui/imgui_widgets.cpp^
-    third-party/imgui/imgui_draw.cpp^
-    third-party/imgui/imgui_tables.cpp^
-    third-party/implot/implot.cpp^
-    third-party/implot/implot_items.cpp^
     third-party/sqlite/sqlite3.c^
     app.cpp^
+    capture.cpp^
+    cobs.cpp^
+    crc.cpp^
+    cpu_features.cpp^
+    correction.cpp^
+    varint.cpp^
+    worker_pool.cpp^
     db.cpp^
-    log.cpp^
-    ui.cpp^
-    main.cpp
+    log.cpp
+
+IF %HEADLESS%==1 (
+    SET FILES=%FILES%^
+        headless.cpp
+) ELSE (
+    SET FILES=%FILES%^
+        third-party/imgui/backends/imgui_impl_glfw.cpp^
+        third-party/imgui/backends/imgui_impl_opengl3.cpp^
+        third-party/imgui/imgui.cpp^
+        third-party/imgui/imgui_widgets.cpp^
+        third-party/imgui/imgui_draw.cpp^
+        third-party/imgui/imgui_tables.cpp^
+        third-party/implot/implot.cpp^
+        third-party/implot/implot_items.cpp^
+        ui.cpp^
+        main.cpp
+)
 
 SET ASAN=0
 SET ANALIZE=0
@@ -119,9 +137,11 @@ IF %DEBUG%==0 (
     )
 )
 
+IF %HEADLESS%==1 ( SET SUBSYSTEM=CONSOLE ) ELSE ( SET SUBSYSTEM=WINDOWS )
+
 SET LFLAGS=^
     /link^
-    /SUBSYSTEM:WINDOWS^
+    /SUBSYSTEM:%SUBSYSTEM%^
     /LIBPATH:third-party/GLFW/lib-vc2022
 
 IF %DEBUG%==1 (
@@ -131,10 +151,14 @@ IF %DEBUG%==1 (
 
 SET LIBS=^
     user32.lib^
-    gdi32.lib^
-    Advapi32.lib^
-    opengl32.lib^
-    glfw3.lib
+    Advapi32.lib
+
+IF %HEADLESS%==0 (
+    SET LIBS=!LIBS!^
+        gdi32.lib^
+        opengl32.lib^
+        glfw3.lib
+)
 
 REM [Optional] Replace the pretty formating '    ' with ' '.
 SET FILES=%FILES:    = %
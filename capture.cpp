@@ -0,0 +1,106 @@
+#include "capture.hpp"
+
+#include "log.hpp"
+
+#include <cstring>
+
+// Chunks are small and come in fast, let stdio batch them into big writes
+static constexpr u32 kCaptureWriteBufferSize = 1_MB;
+
+bool capture_writer_open(CaptureWriter *writer, const char *path)
+{
+    writer->file = fopen(path, "wb");
+    if (writer->file == nullptr) {
+        LOG_ERROR("Failed to open capture file [{}]", path);
+        return false;
+    }
+    setvbuf(writer->file, nullptr, _IOFBF, kCaptureWriteBufferSize);
+
+    using namespace std::chrono;
+    CaptureFileHeader header = {};
+    memcpy(header.magic, kCaptureMagic, sizeof(header.magic));
+    header.version = kCaptureVersion;
+    header.start_unix_time_us = duration_cast<microseconds>(system_clock::now().time_since_epoch()).count();
+    writer->write_failed = fwrite(&header, sizeof(header), 1, writer->file) != 1;
+    writer->last_chunk = steady_clock::now();
+
+    LOG_NORM("Recording raw serial capture to [{}]", path);
+    return true;
+}
+
+void capture_write_chunk(CaptureWriter *writer, const void *data, u32 len)
+{
+    if (writer->file == nullptr || writer->write_failed) {
+        return;
+    }
+
+    using namespace std::chrono;
+    auto now = steady_clock::now();
+    s64 delta = duration_cast<microseconds>(now - writer->last_chunk).count();
+    writer->last_chunk = now;
+
+    CaptureChunkHeader header = {(u32)std::min<s64>(delta, u32Max), len};
+    if (fwrite(&header, sizeof(header), 1, writer->file) != 1 || fwrite(data, 1, len, writer->file) != len) {
+        writer->write_failed = true;
+    }
+}
+
+void capture_writer_close(CaptureWriter *writer)
+{
+    if (writer->file) {
+        if (writer->write_failed) {
+            LOG_ERROR("Writing to the capture file failed, the capture is truncated");
+        }
+        fclose(writer->file);
+        writer->file = nullptr;
+    }
+}
+
+bool capture_reader_open(CaptureReader *reader, const char *path)
+{
+    reader->file = fopen(path, "rb");
+    if (reader->file == nullptr) {
+        LOG_ERROR("Failed to open capture file [{}]", path);
+        return false;
+    }
+
+    CaptureFileHeader header;
+    if (fread(&header, sizeof(header), 1, reader->file) != 1
+        || memcmp(header.magic, kCaptureMagic, sizeof(header.magic)) != 0) {
+        LOG_ERROR("[{}] is not a capture file", path);
+        capture_reader_close(reader);
+        return false;
+    }
+
+    if (header.version != kCaptureVersion) {
+        LOG_ERROR("Capture file [{}] has version [{}] but only [{}] is supported", path, header.version, kCaptureVersion);
+        capture_reader_close(reader);
+        return false;
+    }
+
+    return true;
+}
+
+bool capture_read_chunk(CaptureReader *reader, std::vector<u8> *data, u32 *delta_us)
+{
+    CaptureChunkHeader header;
+    if (fread(&header, sizeof(header), 1, reader->file) != 1) {
+        return false;
+    }
+
+    data->resize(header.len);
+    if (fread(data->data(), 1, header.len, reader->file) != header.len) {
+        return false;
+    }
+
+    *delta_us = header.delta_us;
+    return true;
+}
+
+void capture_reader_close(CaptureReader *reader)
+{
+    if (reader->file) {
+        fclose(reader->file);
+        reader->file = nullptr;
+    }
+}
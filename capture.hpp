@@ -0,0 +1,50 @@
+#pragma once
+#include "shorthand.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+// Raw serial capture file. Every chunk returned by read_from_com_device is stored as is, so replaying a file goes
+// through exactly the same framing/decoding path the device data went through.
+//
+// Layout (little endian):
+//   CaptureFileHeader
+//   N x { CaptureChunkHeader, u8 data[len] }
+struct CaptureFileHeader {
+    char magic[8];
+    u32 version;
+    u32 reserved;
+    s64 start_unix_time_us; // Wall clock of the first chunk, only for reference
+};
+
+struct CaptureChunkHeader {
+    u32 delta_us; // Monotonic time since the previous chunk (or since the capture started for the first one)
+    u32 len;
+};
+
+static_assert(sizeof(CaptureFileHeader) == 24);
+static_assert(sizeof(CaptureChunkHeader) == 8);
+
+inline constexpr char kCaptureMagic[8] = {'E', 'C', 'O', 'C', 'A', 'P', 0, 0};
+inline constexpr u32 kCaptureVersion = 1;
+
+struct CaptureWriter {
+    FILE *file = nullptr;
+    std::chrono::steady_clock::time_point last_chunk;
+    bool write_failed = false;
+};
+
+bool capture_writer_open(CaptureWriter *writer, const char *path);
+// Safe to call from the reader thread, doesn't log
+void capture_write_chunk(CaptureWriter *writer, const void *data, u32 len);
+void capture_writer_close(CaptureWriter *writer);
+
+struct CaptureReader {
+    FILE *file = nullptr;
+};
+
+bool capture_reader_open(CaptureReader *reader, const char *path);
+// Returns false at the end of the file or if the chunk is truncated
+bool capture_read_chunk(CaptureReader *reader, std::vector<u8> *data, u32 *delta_us);
+void capture_reader_close(CaptureReader *reader);
@@ -0,0 +1,279 @@
+#pragma once
+#include "shorthand.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <list>
+#include <memory>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// One CCD result, without its pixels
+struct CCDOperation {
+    u32 id;
+    u32 device_id;
+    std::chrono::local_seconds ts;
+    u32 exposure_time_in_us;
+    u32 iterations;
+};
+
+// CCD results stored one column per field, row `i` of every column is the same result. The pixels of all of them go
+// back to back in one arena, so filling the store is a handful of allocations no matter how many results there are
+// and walking the pixels is one linear scan. Rows can also be only metadata, with the pixels kept somewhere else.
+// Spans into the arena are only good until the next push, it moves when it grows.
+struct CCDOperationStore {
+    std::vector<u32> ids;
+    std::vector<u32> device_ids;
+    std::vector<std::chrono::local_seconds> timestamps;
+    std::vector<u32> exposures;
+    std::vector<u32> iterations;
+    // Most results have neither, an empty std::string doesn't allocate
+    std::vector<std::string> names;
+    std::vector<std::string> notes;
+
+    // kCCDStoreNoPixels for rows that are only metadata, their count is still there
+    std::vector<u64> pixel_offsets;
+    std::vector<u32> pixel_counts;
+    std::vector<u32> pixels;
+
+    // Row of each id for ccd_store_find, only built up to `indexed_rows` when something looks for one. Rows come in
+    // in timestamp order, not id order, so a binary search over `ids` isn't an option
+    std::unordered_map<u32, u32> row_by_id;
+    u32 indexed_rows = 0;
+};
+
+static constexpr u64 kCCDStoreNoPixels = u64Max;
+
+inline u32 ccd_store_size(const CCDOperationStore *store)
+{
+    return (u32)store->ids.size();
+}
+
+inline void ccd_store_reserve(CCDOperationStore *store, u32 rows, u64 pixel_count)
+{
+    store->ids.reserve(rows);
+    store->device_ids.reserve(rows);
+    store->timestamps.reserve(rows);
+    store->exposures.reserve(rows);
+    store->iterations.reserve(rows);
+    store->names.reserve(rows);
+    store->notes.reserve(rows);
+    store->pixel_offsets.reserve(rows);
+    store->pixel_counts.reserve(rows);
+    store->pixels.reserve(pixel_count);
+}
+
+// Keeps the memory around for whatever gets pushed next
+inline void ccd_store_clear(CCDOperationStore *store)
+{
+    store->ids.clear();
+    store->device_ids.clear();
+    store->timestamps.clear();
+    store->exposures.clear();
+    store->iterations.clear();
+    store->names.clear();
+    store->notes.clear();
+    store->pixel_offsets.clear();
+    store->pixel_counts.clear();
+    store->pixels.clear();
+    store->row_by_id.clear();
+    store->indexed_rows = 0;
+}
+
+// Adds a row with room for `pixel_count` pixels and returns it. Fill them in through ccd_store_pixels
+inline u32 ccd_store_push(CCDOperationStore *store, const CCDOperation &op, u32 pixel_count)
+{
+    u32 row = ccd_store_size(store);
+    store->ids.push_back(op.id);
+    store->device_ids.push_back(op.device_id);
+    store->timestamps.push_back(op.ts);
+    store->exposures.push_back(op.exposure_time_in_us);
+    store->iterations.push_back(op.iterations);
+    store->names.emplace_back();
+    store->notes.emplace_back();
+    store->pixel_offsets.push_back(store->pixels.size());
+    store->pixel_counts.push_back(pixel_count);
+    store->pixels.resize(store->pixels.size() + pixel_count);
+    return row;
+}
+
+// Adds a row without pixels, `pixel_count` is how many it has wherever they are
+inline u32 ccd_store_push_metadata(CCDOperationStore *store, const CCDOperation &op, u32 pixel_count)
+{
+    u32 row = ccd_store_push(store, op, 0);
+    store->pixel_offsets[row] = kCCDStoreNoPixels;
+    store->pixel_counts[row] = pixel_count;
+    return row;
+}
+
+// Appends the pixels straight into the arena, without zeroing their room first
+inline u32 ccd_store_push(CCDOperationStore *store, const CCDOperation &op, std::span<const u32> pixels)
+{
+    u32 row = ccd_store_push(store, op, 0);
+    store->pixel_counts[row] = (u32)pixels.size();
+    store->pixels.insert(store->pixels.end(), pixels.begin(), pixels.end());
+    return row;
+}
+
+// Drops the last row, for one that turned out to be broken while filling it in
+inline void ccd_store_pop(CCDOperationStore *store)
+{
+    if (store->pixel_offsets.back() != kCCDStoreNoPixels) {
+        store->pixels.resize(store->pixel_offsets.back());
+    }
+    u32 row = ccd_store_size(store) - 1;
+    if (store->indexed_rows > row) {
+        auto it = store->row_by_id.find(store->ids[row]);
+        if (it != store->row_by_id.end() && it->second == row) {
+            store->row_by_id.erase(it);
+        }
+        store->indexed_rows = row;
+    }
+    store->ids.pop_back();
+    store->device_ids.pop_back();
+    store->timestamps.pop_back();
+    store->exposures.pop_back();
+    store->iterations.pop_back();
+    store->names.pop_back();
+    store->notes.pop_back();
+    store->pixel_offsets.pop_back();
+    store->pixel_counts.pop_back();
+}
+
+inline CCDOperation ccd_store_get(const CCDOperationStore *store, u32 row)
+{
+    return {
+        store->ids[row],
+        store->device_ids[row],
+        store->timestamps[row],
+        store->exposures[row],
+        store->iterations[row],
+    };
+}
+
+inline bool ccd_store_has_pixels(const CCDOperationStore *store, u32 row)
+{
+    return store->pixel_offsets[row] != kCCDStoreNoPixels;
+}
+
+inline std::span<u32> ccd_store_pixels(CCDOperationStore *store, u32 row)
+{
+    ASSERT(ccd_store_has_pixels(store, row));
+    return {store->pixels.data() + store->pixel_offsets[row], store->pixel_counts[row]};
+}
+
+inline std::span<const u32> ccd_store_pixels(const CCDOperationStore *store, u32 row)
+{
+    ASSERT(ccd_store_has_pixels(store, row));
+    return {store->pixels.data() + store->pixel_offsets[row], store->pixel_counts[row]};
+}
+
+// Adds every row of `from` after the ones already there
+inline void ccd_store_append(CCDOperationStore *store, const CCDOperationStore *from)
+{
+    for (u32 row = 0; row < ccd_store_size(from); ++row) {
+        CCDOperation op = ccd_store_get(from, row);
+        u32 to_row = ccd_store_has_pixels(from, row) ? ccd_store_push(store, op, ccd_store_pixels(from, row))
+                                                     : ccd_store_push_metadata(store, op, from->pixel_counts[row]);
+        store->names[to_row] = from->names[row];
+        store->notes[to_row] = from->notes[row];
+    }
+}
+
+// Row of the result with `id`, -1 when it isn't in the store. Indexes whatever got pushed since the last call first,
+// so pushing stays as cheap as it was and looking up is a hash lookup
+inline s64 ccd_store_find(CCDOperationStore *store, u32 id)
+{
+    for (; store->indexed_rows < ccd_store_size(store); ++store->indexed_rows) {
+        // The first row with an id wins, like it did when this was a scan
+        store->row_by_id.try_emplace(store->ids[store->indexed_rows], store->indexed_rows);
+    }
+    auto it = store->row_by_id.find(id);
+    return it == store->row_by_id.end() ? -1 : (s64)it->second;
+}
+
+////////////////////////////////////////////////////////////////
+//// Pixel cache
+////////////////////////////////////////////////////////////////
+
+// Raw counts of a result and its dark / reference corrected version, which is empty when it wasn't corrected
+struct CCDPixels {
+    std::vector<u32> raw;
+    std::vector<f32> corrected;
+};
+
+// Results that just came in are unpacked into one of these and shared by the db writer and the pixel cache, so they're
+// in memory once. Nothing changes them once they're shared
+using CCDPixelsRef = std::shared_ptr<const CCDPixels>;
+
+inline u64 get_size_bytes(const CCDPixels &pixels)
+{
+    return pixels.raw.size() * sizeof(u32) + pixels.corrected.size() * sizeof(f32);
+}
+
+// Pixels of CCD results by id. Once they take more than `budget_bytes` the least recently used ones get dropped, the
+// last one put in always stays. Whatever get/put return is only good until the next put
+struct CCDPixelCache {
+    struct Entry {
+        u32 id;
+        CCDPixelsRef pixels;
+    };
+
+    u64 budget_bytes = 32_MB;
+    u64 bytes = 0;
+    // Most recently used first
+    std::list<Entry> entries;
+    std::unordered_map<u32, std::list<Entry>::iterator> by_id;
+
+    u64 hits = 0;
+    u64 misses = 0;
+    u64 evictions = 0;
+};
+
+inline bool ccd_pixel_cache_contains(const CCDPixelCache *cache, u32 id)
+{
+    return cache->by_id.contains(id);
+}
+
+// nullptr when they aren't there
+inline const CCDPixels *ccd_pixel_cache_get(CCDPixelCache *cache, u32 id)
+{
+    auto it = cache->by_id.find(id);
+    if (it == cache->by_id.end()) {
+        cache->misses++;
+        return nullptr;
+    }
+    cache->hits++;
+    cache->entries.splice(cache->entries.begin(), cache->entries, it->second);
+    return it->second->pixels.get();
+}
+
+inline const CCDPixels *ccd_pixel_cache_put(CCDPixelCache *cache, u32 id, CCDPixelsRef pixels)
+{
+    auto it = cache->by_id.find(id);
+    if (it != cache->by_id.end()) {
+        cache->bytes -= get_size_bytes(*it->second->pixels);
+        cache->entries.erase(it->second);
+        cache->by_id.erase(it);
+    }
+
+    cache->bytes += get_size_bytes(*pixels);
+    cache->entries.push_front({id, std::move(pixels)});
+    cache->by_id[id] = cache->entries.begin();
+
+    while (cache->bytes > cache->budget_bytes && cache->entries.size() > 1) {
+        CCDPixelCache::Entry &oldest = cache->entries.back();
+        cache->bytes -= get_size_bytes(*oldest.pixels);
+        cache->by_id.erase(oldest.id);
+        cache->entries.pop_back();
+        cache->evictions++;
+    }
+    return cache->entries.front().pixels.get();
+}
+
+inline const CCDPixels *ccd_pixel_cache_put(CCDPixelCache *cache, u32 id, CCDPixels &&pixels)
+{
+    return ccd_pixel_cache_put(cache, id, std::make_shared<const CCDPixels>(std::move(pixels)));
+}
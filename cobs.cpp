@@ -0,0 +1,98 @@
+#include "cobs.hpp"
+
+#include "cpu_features.hpp"
+
+#include <bit>
+#include <vector>
+
+#if SIMD_X86
+#include <immintrin.h>
+#endif
+
+u32 cobs_find_zero_scalar(const u8 *data, u32 len)
+{
+    for (u32 i = 0; i < len; ++i) {
+        if (data[i] == 0) {
+            return i;
+        }
+    }
+    return len;
+}
+
+#if SIMD_X86
+// SSE2 is part of x64, so unlike the rest of the SIMD code this doesn't need a cpu check
+static u32 cobs_find_zero_sse2(const u8 *data, u32 len)
+{
+    u32 i = 0;
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= len; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(data + i));
+        u32 mask = (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(block, zero));
+        if (mask) {
+            return i + std::countr_zero(mask);
+        }
+    }
+    return i + cobs_find_zero_scalar(data + i, len - i);
+}
+
+// Two 32 byte blocks per round with a single branch for both, a COBS block is at most 254 bytes so that is most of
+// one in 4 rounds. Short runs, which is most of them when the data has lots of zeros, never touch a YMM register and
+// go through the same 16 byte blocks and scalar loop as the SSE2 version
+TARGET_AVX2 static u32 cobs_find_zero_avx2(const u8 *data, u32 len)
+{
+    u32 i = 0;
+    if (len >= 64) {
+        const __m256i zero = _mm256_setzero_si256();
+        for (; i + 64 <= len; i += 64) {
+            __m256i lo = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + i)), zero);
+            __m256i hi = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + i + 32)), zero);
+            __m256i any = _mm256_or_si256(lo, hi);
+            if (!_mm256_testz_si256(any, any)) {
+                u64 mask = (u32)_mm256_movemask_epi8(lo) | ((u64)(u32)_mm256_movemask_epi8(hi) << 32);
+                _mm256_zeroupper();
+                return i + std::countr_zero(mask);
+            }
+        }
+        _mm256_zeroupper();
+    }
+
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= len; i += 16) {
+        u32 mask = (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i)), zero));
+        if (mask) {
+            return i + std::countr_zero(mask);
+        }
+    }
+    for (; i < len; ++i) {
+        if (data[i] == 0) {
+            return i;
+        }
+    }
+    return len;
+}
+#endif
+
+static std::vector<CobsFindZeroImpl> get_supported_cobs_find_zero_impls()
+{
+    std::vector<CobsFindZeroImpl> impls;
+#if SIMD_X86
+    if (get_cpu_features().avx2) {
+        impls.push_back({"avx2", cobs_find_zero_avx2});
+    }
+    impls.push_back({"sse2", cobs_find_zero_sse2});
+#endif
+    impls.push_back({"scalar", cobs_find_zero_scalar});
+    return impls;
+}
+
+std::span<const CobsFindZeroImpl> get_cobs_find_zero_impls()
+{
+    static const std::vector<CobsFindZeroImpl> impls = get_supported_cobs_find_zero_impls();
+    return impls;
+}
+
+u32 cobs_find_zero_long(const u8 *data, u32 len)
+{
+    static const CobsFindZeroFn find_zero = get_cobs_find_zero_impls().front().fn;
+    return find_zero(data, len);
+}
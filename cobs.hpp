@@ -0,0 +1,37 @@
+#pragma once
+#include "shorthand.hpp"
+
+#include <span>
+
+// cobs_find_zero for runs of at least kCobsShortRun bytes. Picks the fastest implementation the cpu supports on the
+// first call
+u32 cobs_find_zero_long(const u8 *data, u32 len);
+// One byte at a time, the reference for the SIMD versions
+u32 cobs_find_zero_scalar(const u8 *data, u32 len);
+
+// Data with lots of zeros (packed pixels) has blocks of a couple of bytes, where a call through the dispatcher costs
+// more than looking at the bytes one by one
+static constexpr u32 kCobsShortRun = 32;
+
+// Index of the first 0x00 in `data`, or `len` when there is none
+inline u32 cobs_find_zero(const u8 *data, u32 len)
+{
+    if (len >= kCobsShortRun) {
+        return cobs_find_zero_long(data, len);
+    }
+    for (u32 i = 0; i < len; ++i) {
+        if (data[i] == 0) {
+            return i;
+        }
+    }
+    return len;
+}
+
+// Every way cobs_find_zero_long can run on this cpu, fastest first, cobs_find_zero_long goes with the first one. Only
+// here so each of them can be checked and timed against the scalar version
+using CobsFindZeroFn = u32 (*)(const u8 *data, u32 len);
+struct CobsFindZeroImpl {
+    const char *name;
+    CobsFindZeroFn fn;
+};
+std::span<const CobsFindZeroImpl> get_cobs_find_zero_impls();
@@ -0,0 +1,86 @@
+#include "correction.hpp"
+
+#include "cpu_features.hpp"
+
+#include <vector>
+
+#if SIMD_X86
+#include <immintrin.h>
+#endif
+
+void correct_spectrum_scalar(const u32 *signal, const u32 *dark, const u32 *reference, f32 *out, u32 count)
+{
+    for (u32 i = 0; i < count; ++i) {
+        // Same conversion as cvtepi32_ps, so the vector versions match bit for bit
+        f32 d = (f32)(s32)dark[i];
+        f32 numerator = (f32)(s32)signal[i] - d;
+        f32 denominator = (f32)(s32)reference[i] - d;
+        out[i] = denominator > 0 ? numerator / denominator : 0;
+    }
+}
+
+#if SIMD_X86
+static void correct_spectrum_sse2(const u32 *signal, const u32 *dark, const u32 *reference, f32 *out, u32 count)
+{
+    u32 i = 0;
+    const __m128 zero = _mm_setzero_ps();
+    for (; i + 4 <= count; i += 4) {
+        __m128 s = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(signal + i)));
+        __m128 d = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(dark + i)));
+        __m128 r = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(reference + i)));
+        __m128 denominator = _mm_sub_ps(r, d);
+        // Lanes that divide by 0 or less get masked out after the division
+        __m128 valid = _mm_cmpgt_ps(denominator, zero);
+        __m128 ratio = _mm_div_ps(_mm_sub_ps(s, d), denominator);
+        _mm_storeu_ps(out + i, _mm_and_ps(ratio, valid));
+    }
+    correct_spectrum_scalar(signal + i, dark + i, reference + i, out + i, count - i);
+}
+
+TARGET_AVX2 static void correct_spectrum_avx2(const u32 *signal,
+                                              const u32 *dark,
+                                              const u32 *reference,
+                                              f32 *out,
+                                              u32 count)
+{
+    u32 i = 0;
+    const __m256 zero = _mm256_setzero_ps();
+    for (; i + 8 <= count; i += 8) {
+        __m256 s = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i *)(signal + i)));
+        __m256 d = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i *)(dark + i)));
+        __m256 r = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i *)(reference + i)));
+        __m256 denominator = _mm256_sub_ps(r, d);
+        __m256 valid = _mm256_cmp_ps(denominator, zero, _CMP_GT_OQ);
+        __m256 ratio = _mm256_div_ps(_mm256_sub_ps(s, d), denominator);
+        _mm256_storeu_ps(out + i, _mm256_and_ps(ratio, valid));
+    }
+    correct_spectrum_scalar(signal + i, dark + i, reference + i, out + i, count - i);
+}
+#endif
+
+static std::vector<CorrectSpectrumImpl> get_supported_correct_spectrum_impls()
+{
+    std::vector<CorrectSpectrumImpl> impls;
+#if SIMD_X86
+    if (get_cpu_features().avx2) {
+        impls.push_back({"avx2", correct_spectrum_avx2});
+    }
+    if (get_cpu_features().sse2) {
+        impls.push_back({"sse2", correct_spectrum_sse2});
+    }
+#endif
+    impls.push_back({"scalar", correct_spectrum_scalar});
+    return impls;
+}
+
+std::span<const CorrectSpectrumImpl> get_correct_spectrum_impls()
+{
+    static const std::vector<CorrectSpectrumImpl> impls = get_supported_correct_spectrum_impls();
+    return impls;
+}
+
+void correct_spectrum(const u32 *signal, const u32 *dark, const u32 *reference, f32 *out, u32 count)
+{
+    static const CorrectSpectrumFn correct = get_correct_spectrum_impls().front().fn;
+    correct(signal, dark, reference, out, count);
+}
@@ -0,0 +1,20 @@
+#pragma once
+#include "shorthand.hpp"
+
+#include <span>
+
+// (signal - dark) / (reference - dark) for every pixel, the fraction of the white reference the sample gives back.
+// Pixels where the reference isn't above the dark come out as 0. Counts have to fit in 31 bits, which accumulated
+// 12 bit values always do. Uses AVX2 when the cpu has it
+void correct_spectrum(const u32 *signal, const u32 *dark, const u32 *reference, f32 *out, u32 count);
+// One pixel at a time, the reference for the version above. Both give the exact same floats
+void correct_spectrum_scalar(const u32 *signal, const u32 *dark, const u32 *reference, f32 *out, u32 count);
+
+// Every way correct_spectrum can run on this cpu, fastest first, correct_spectrum goes with the first one. Only here so
+// each of them can be checked against the scalar version
+using CorrectSpectrumFn = void (*)(const u32 *signal, const u32 *dark, const u32 *reference, f32 *out, u32 count);
+struct CorrectSpectrumImpl {
+    const char *name;
+    CorrectSpectrumFn fn;
+};
+std::span<const CorrectSpectrumImpl> get_correct_spectrum_impls();
@@ -0,0 +1,46 @@
+#include "cpu_features.hpp"
+
+#if SIMD_X86 && defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+static CpuFeatures detect_cpu_features()
+{
+    CpuFeatures features = {};
+#if SIMD_X86
+#if defined(_MSC_VER)
+    int regs[4];
+    __cpuid(regs, 0);
+    int max_leaf = regs[0];
+
+    __cpuid(regs, 1);
+    features.sse2 = regs[3] & (1 << 26);
+    features.ssse3 = regs[2] & (1 << 9);
+    features.sse41 = regs[2] & (1 << 19);
+    features.pclmul = regs[2] & (1 << 1);
+
+    // AVX2 also needs the OS to save the YMM registers on context switches
+    bool os_saves_ymm = (regs[2] & (1 << 27)) && (_xgetbv(0) & 0b110) == 0b110;
+    if (max_leaf >= 7 && os_saves_ymm) {
+        __cpuidex(regs, 7, 0);
+        features.avx2 = regs[1] & (1 << 5);
+        features.vpclmul = features.avx2 && (regs[2] & (1 << 10));
+    }
+#else
+    __builtin_cpu_init();
+    features.sse2 = __builtin_cpu_supports("sse2");
+    features.ssse3 = __builtin_cpu_supports("ssse3");
+    features.sse41 = __builtin_cpu_supports("sse4.1");
+    features.avx2 = __builtin_cpu_supports("avx2");
+    features.pclmul = __builtin_cpu_supports("pclmul");
+    features.vpclmul = features.avx2 && __builtin_cpu_supports("vpclmulqdq");
+#endif
+#endif
+    return features;
+}
+
+const CpuFeatures &get_cpu_features()
+{
+    static const CpuFeatures features = detect_cpu_features();
+    return features;
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include "shorthand.hpp"
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(_M_IX86) || defined(__i386__)
+#define SIMD_X86 1
+#else
+#define SIMD_X86 0
+#endif
+
+// MSVC lets us use any intrinsic without /arch, GCC and Clang need the function to opt in to the instruction set.
+// Anything marked with these must only be called after checking get_cpu_features()
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_SSSE3   __attribute__((target("ssse3")))
+#define TARGET_SSE41   __attribute__((target("sse4.1")))
+#define TARGET_AVX2    __attribute__((target("avx2")))
+#define TARGET_PCLMUL  __attribute__((target("pclmul,sse4.1")))
+#define TARGET_VPCLMUL __attribute__((target("vpclmulqdq,avx2,pclmul,sse4.1")))
+#else
+#define TARGET_SSSE3
+#define TARGET_SSE41
+#define TARGET_AVX2
+#define TARGET_PCLMUL
+#define TARGET_VPCLMUL
+#endif
+
+struct CpuFeatures {
+    bool sse2;
+    bool ssse3;
+    bool sse41;
+    bool avx2;
+    bool pclmul;
+    // Carry-less multiply on YMM registers, only counts when avx2 is there too
+    bool vpclmul;
+};
+
+const CpuFeatures &get_cpu_features();
@@ -0,0 +1,321 @@
+#include "crc.hpp"
+
+#include "cpu_features.hpp"
+
+#include <array>
+#include <cstring>
+#include <vector>
+
+#if SIMD_X86
+#include <immintrin.h>
+#endif
+
+static constexpr u16 kCrc16Poly = 0x1021;
+static constexpr u32 kCrc32Poly = 0xEDB88320; // 0x04C11DB7 bit reversed
+
+////////////////////////////////////////////////////////////////
+//// Bitwise
+////////////////////////////////////////////////////////////////
+
+u16 crc16_ccitt_bitwise(const void *data, u32 len, u16 crc)
+{
+    const u8 *it = (const u8 *)data;
+    for (u32 i = 0; i < len; ++i) {
+        crc ^= (u16)(it[i] << 8);
+        for (u32 bit = 0; bit < 8; ++bit) {
+            crc = (crc & 0x8000) ? (u16)((crc << 1) ^ kCrc16Poly) : (u16)(crc << 1);
+        }
+    }
+    return crc;
+}
+
+u32 crc32_bitwise(const void *data, u32 len, u32 crc)
+{
+    const u8 *it = (const u8 *)data;
+    crc = ~crc;
+    for (u32 i = 0; i < len; ++i) {
+        crc ^= it[i];
+        for (u32 bit = 0; bit < 8; ++bit) {
+            crc = (crc & 1) ? (crc >> 1) ^ kCrc32Poly : crc >> 1;
+        }
+    }
+    return ~crc;
+}
+
+////////////////////////////////////////////////////////////////
+//// Slice by 8
+////////////////////////////////////////////////////////////////
+
+// table[k][b] is the crc of byte b followed by k zero bytes, so 8 bytes can be looked up independently and xored
+template <typename T>
+using CrcTables = std::array<std::array<T, 256>, 8>;
+
+static constexpr CrcTables<u16> make_crc16_tables()
+{
+    CrcTables<u16> tables = {};
+    for (u32 i = 0; i < 256; ++i) {
+        u16 crc = (u16)(i << 8);
+        for (u32 bit = 0; bit < 8; ++bit) {
+            crc = (crc & 0x8000) ? (u16)((crc << 1) ^ kCrc16Poly) : (u16)(crc << 1);
+        }
+        tables[0][i] = crc;
+    }
+    for (u32 k = 1; k < 8; ++k) {
+        for (u32 i = 0; i < 256; ++i) {
+            u16 prev = tables[k - 1][i];
+            tables[k][i] = (u16)((prev << 8) ^ tables[0][prev >> 8]);
+        }
+    }
+    return tables;
+}
+
+static constexpr CrcTables<u32> make_crc32_tables()
+{
+    CrcTables<u32> tables = {};
+    for (u32 i = 0; i < 256; ++i) {
+        u32 crc = i;
+        for (u32 bit = 0; bit < 8; ++bit) {
+            crc = (crc & 1) ? (crc >> 1) ^ kCrc32Poly : crc >> 1;
+        }
+        tables[0][i] = crc;
+    }
+    for (u32 k = 1; k < 8; ++k) {
+        for (u32 i = 0; i < 256; ++i) {
+            u32 prev = tables[k - 1][i];
+            tables[k][i] = (prev >> 8) ^ tables[0][prev & 0xFF];
+        }
+    }
+    return tables;
+}
+
+static constexpr CrcTables<u16> kCrc16Tables = make_crc16_tables();
+static constexpr CrcTables<u32> kCrc32Tables = make_crc32_tables();
+
+static u16 crc16_ccitt_slice8(const u8 *data, u32 len, u16 crc)
+{
+    const auto &t = kCrc16Tables;
+    for (; len >= 8; data += 8, len -= 8) {
+        // Only the first two bytes mix with the crc, the rest just get looked up with the right amount of trailing
+        // zero bytes
+        crc = t[7][data[0] ^ (crc >> 8)] ^ t[6][data[1] ^ (crc & 0xFF)] ^ t[5][data[2]] ^ t[4][data[3]]
+              ^ t[3][data[4]] ^ t[2][data[5]] ^ t[1][data[6]] ^ t[0][data[7]];
+    }
+    for (; len != 0; ++data, --len) {
+        crc = (u16)((crc << 8) ^ t[0][(crc >> 8) ^ *data]);
+    }
+    return crc;
+}
+
+// Works on the inverted crc, callers take care of the ~ on the way in and out
+static u32 crc32_slice8(const u8 *data, u32 len, u32 crc)
+{
+    const auto &t = kCrc32Tables;
+    for (; len >= 8; data += 8, len -= 8) {
+        u32 lo;
+        u32 hi;
+        memcpy(&lo, data, 4);
+        memcpy(&hi, data + 4, 4);
+        lo ^= crc;
+        crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^ t[3][hi & 0xFF]
+              ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+    }
+    for (; len != 0; ++data, --len) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *data) & 0xFF];
+    }
+    return crc;
+}
+
+////////////////////////////////////////////////////////////////
+//// Carry-less multiply
+////////////////////////////////////////////////////////////////
+
+#if SIMD_X86
+// Folding with PCLMULQDQ as in Intel's "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction".
+// The constants are the bit reflected x^n mod P(x) values from the paper for the CRC-32 polynomial, x^(d+32) and
+// x^(d-32) move a 128 bit block forward by d bits. Needs at least 64 bytes and only handles multiples of 16, returns
+// how many bytes it consumed. Works on the inverted crc
+
+// Multiplies both halves of `acc` forward by 128 bits and adds the next block
+TARGET_PCLMUL static inline __m128i crc32_fold_128(__m128i acc, __m128i next, __m128i k)
+{
+    __m128i lo = _mm_clmulepi64_si128(acc, k, 0x00);
+    __m128i hi = _mm_clmulepi64_si128(acc, k, 0x11);
+    return _mm_xor_si128(_mm_xor_si128(hi, next), lo);
+}
+
+// Folds the rest of the 16 byte blocks into `x1` and reduces it to the crc
+TARGET_PCLMUL static u32 crc32_pclmul_finish(__m128i x1, const u8 *data, u32 len)
+{
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+    const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+    const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+
+    for (; len >= 16; data += 16, len -= 16) {
+        x1 = crc32_fold_128(x1, _mm_loadu_si128((const __m128i *)data), k3k4);
+    }
+
+    // 128 -> 64 bits
+    __m128i x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask32);
+    x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, k5k0, 0x00), x2);
+
+    // Barrett reduction down to 32 bits
+    x2 = _mm_and_si128(x1, mask32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+    x2 = _mm_and_si128(x2, mask32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return (u32)_mm_extract_epi32(x1, 1);
+}
+
+TARGET_PCLMUL static u32 crc32_pclmul(const u8 *data, u32 len, u32 *crc)
+{
+    if (len < 64) {
+        return 0;
+    }
+    u32 done = len & ~15u;
+    len = done;
+
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+
+    __m128i x1 = _mm_loadu_si128((const __m128i *)(data + 0x00));
+    __m128i x2 = _mm_loadu_si128((const __m128i *)(data + 0x10));
+    __m128i x3 = _mm_loadu_si128((const __m128i *)(data + 0x20));
+    __m128i x4 = _mm_loadu_si128((const __m128i *)(data + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)*crc));
+    data += 64;
+    len -= 64;
+
+    // Four independent 128 bit lanes so the multiplies can overlap
+    while (len >= 64) {
+        __m128i x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        __m128i x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        __m128i x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        __m128i x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)(data + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(data + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(data + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(data + 0x30)));
+        data += 64;
+        len -= 64;
+    }
+
+    // Fold the four lanes into one
+    x1 = crc32_fold_128(x1, x2, k3k4);
+    x1 = crc32_fold_128(x1, x3, k3k4);
+    x1 = crc32_fold_128(x1, x4, k3k4);
+    *crc = crc32_pclmul_finish(x1, data, len);
+    return done;
+}
+
+// Same folding on YMM registers, two 128 bit blocks per register and four registers, so every round moves 128 bytes
+// forward by 1024 bits. The four lanes get folded into one 256 bit lane and that one into the 128 bit path. Needs at
+// least 256 bytes, below that the 128 bit version is just as fast
+TARGET_VPCLMUL static inline __m256i crc32_fold_256(__m256i acc, __m256i next, __m256i k)
+{
+    __m256i lo = _mm256_clmulepi64_epi128(acc, k, 0x00);
+    __m256i hi = _mm256_clmulepi64_epi128(acc, k, 0x11);
+    return _mm256_xor_si256(_mm256_xor_si256(hi, next), lo);
+}
+
+TARGET_VPCLMUL static u32 crc32_vpclmul(const u8 *data, u32 len, u32 *crc)
+{
+    if (len < 256) {
+        return crc32_pclmul(data, len, crc);
+    }
+    u32 done = len & ~15u;
+    len = done;
+
+    const __m256i k1024 = _mm256_set_epi64x(0x014a7fe880, 0x01e88ef372, 0x014a7fe880, 0x01e88ef372);
+    const __m256i k256 = _mm256_set_epi64x(0x015a546366, 0x00f1da05aa, 0x015a546366, 0x00f1da05aa);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+
+    __m256i y1 = _mm256_loadu_si256((const __m256i *)(data + 0x00));
+    __m256i y2 = _mm256_loadu_si256((const __m256i *)(data + 0x20));
+    __m256i y3 = _mm256_loadu_si256((const __m256i *)(data + 0x40));
+    __m256i y4 = _mm256_loadu_si256((const __m256i *)(data + 0x60));
+    y1 = _mm256_xor_si256(y1, _mm256_zextsi128_si256(_mm_cvtsi32_si128((int)*crc)));
+    data += 128;
+    len -= 128;
+
+    while (len >= 128) {
+        y1 = crc32_fold_256(y1, _mm256_loadu_si256((const __m256i *)(data + 0x00)), k1024);
+        y2 = crc32_fold_256(y2, _mm256_loadu_si256((const __m256i *)(data + 0x20)), k1024);
+        y3 = crc32_fold_256(y3, _mm256_loadu_si256((const __m256i *)(data + 0x40)), k1024);
+        y4 = crc32_fold_256(y4, _mm256_loadu_si256((const __m256i *)(data + 0x60)), k1024);
+        data += 128;
+        len -= 128;
+    }
+
+    y1 = crc32_fold_256(y1, y2, k256);
+    y1 = crc32_fold_256(y1, y3, k256);
+    y1 = crc32_fold_256(y1, y4, k256);
+    __m128i x1 = crc32_fold_128(_mm256_castsi256_si128(y1), _mm256_extracti128_si256(y1, 1), k3k4);
+    // The rest runs on non-VEX SSE code, and so does whatever called this. With the upper halves still dirty every
+    // one of those instructions pays for merging them, which made the varint decode after it twice as slow
+    _mm256_zeroupper();
+    *crc = crc32_pclmul_finish(x1, data, len);
+    return done;
+}
+#endif
+
+static u32 crc32_no_pclmul(const u8 *, u32, u32 *)
+{
+    return 0;
+}
+
+using Crc32BulkFn = u32 (*)(const u8 *, u32, u32 *);
+
+// As much as `bulk` takes, slice by 8 for the rest
+template <Crc32BulkFn bulk>
+static u32 crc32_with(const void *data, u32 len, u32 crc)
+{
+    const u8 *it = (const u8 *)data;
+    crc = ~crc;
+    u32 done = bulk(it, len, &crc);
+    crc = crc32_slice8(it + done, len - done, crc);
+    return ~crc;
+}
+
+static std::vector<Crc32Impl> get_supported_crc32_impls()
+{
+    std::vector<Crc32Impl> impls;
+#if SIMD_X86
+    if (get_cpu_features().vpclmul) {
+        impls.push_back({"vpclmul", crc32_with<crc32_vpclmul>});
+    }
+    if (get_cpu_features().pclmul && get_cpu_features().sse41) {
+        impls.push_back({"pclmul", crc32_with<crc32_pclmul>});
+    }
+#endif
+    impls.push_back({"slice8", crc32_with<crc32_no_pclmul>});
+    return impls;
+}
+
+std::span<const Crc32Impl> get_crc32_impls()
+{
+    static const std::vector<Crc32Impl> impls = get_supported_crc32_impls();
+    return impls;
+}
+
+// Only ever sees host commands, which are under 16 bytes. Carry-less multiply folding needs 64 before it does
+// anything, so there's nothing to dispatch (simulator --bench times one)
+u16 crc16_ccitt(const void *data, u32 len, u16 crc)
+{
+    return crc16_ccitt_slice8((const u8 *)data, len, crc);
+}
+
+u32 crc32(const void *data, u32 len, u32 crc)
+{
+    static const Crc32Fn crc32_impl = get_crc32_impls().front().fn;
+    return crc32_impl(data, len, crc);
+}
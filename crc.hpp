@@ -0,0 +1,25 @@
+#pragma once
+#include "shorthand.hpp"
+
+#include <span>
+
+// Both take the result of a previous call as `crc` to keep going over more data, the defaults start a new one.
+// Picks the fastest implementation the cpu supports on the first call
+
+// CRC-16/CCITT-FALSE: poly 0x1021, init 0xFFFF, not reflected, no final xor. "123456789" gives 0x29B1
+u16 crc16_ccitt(const void *data, u32 len, u16 crc = 0xFFFF);
+// CRC-32 as in zlib/Ethernet: poly 0x04C11DB7 reflected, init and final xor 0xFFFFFFFF. "123456789" gives 0xCBF43926
+u32 crc32(const void *data, u32 len, u32 crc = 0);
+
+// One bit at a time, only here to check the fast versions against
+u16 crc16_ccitt_bitwise(const void *data, u32 len, u16 crc = 0xFFFF);
+u32 crc32_bitwise(const void *data, u32 len, u32 crc = 0);
+
+// Every way crc32 can run on this cpu, fastest first, crc32 goes with the first one. Only here so each of them can be
+// checked against crc32_bitwise
+using Crc32Fn = u32 (*)(const void *data, u32 len, u32 crc);
+struct Crc32Impl {
+    const char *name;
+    Crc32Fn fn;
+};
+std::span<const Crc32Impl> get_crc32_impls();
@@ -3,16 +3,30 @@
 
 #include "sqlite3.h"
 
+#include <algorithm>
+#include <condition_variable>
 #include <cstdio>
+#include <mutex>
+#include <thread>
 
 #define META_FIELD_VERSION "db_version"
 #define META_TABLE         "meta_table"
 #define CCD_RESULTS_TABLE  "ccd_results"
+#define DEVICES_TABLE      "devices"
+#define CORRECTIONS_TABLE  "correction_frames"
+#define DB_VERSION         4
 namespace {
 constexpr char kDbName[] = "results.db";
 static sqlite3 *s_database = NULL;
+// The writer thread's connection, db_device_get_id is the only other thing that goes through it
+static std::mutex s_database_mutex;
+// Reads get their own connection. The db is in WAL mode, so they see the last commit without waiting on the writer
+static sqlite3 *s_read_database = NULL;
+static std::mutex s_read_database_mutex;
 
 enum PreparedStatements {
+    DEVICE_INSERT,
+    DEVICE_GET_ID,
     CCD_RESULT_INSERT,
     CCD_RESULT_GET_LAST_ID,
     CCD_RESULT_UPDATE_DATA,
@@ -20,22 +34,53 @@ enum PreparedStatements {
     CCD_RESULT_UPDATE_NOTES,
     CCD_RESULT_COUNT_IN_TIME_RANGE,
     CCD_RESULT_QUERY_IN_TIME_RANGE,
+    CCD_RESULT_QUERY_BEFORE,
+    CCD_RESULT_GET_DATA,
+    CORRECTION_FRAME_SET,
+    CORRECTION_FRAME_GET_ALL,
     __COUNT,
 };
 
+// Placeholders in CCD_RESULT_GET_DATA, more rows than that take another query
+constexpr u32 kGetDataRows = 8;
+
 sqlite3_stmt *prepared_stmt[PreparedStatements::__COUNT];
 static const char *sql_statements[PreparedStatements::__COUNT] = {
     // clang-format off
-    /* CCD_RESULT_INSERT              */ "INSERT INTO " CCD_RESULTS_TABLE " (timestamp, integration_time, iterations, result) VALUES (?, ?, ?, ?);",
+    /* DEVICE_INSERT                  */ "INSERT OR IGNORE INTO " DEVICES_TABLE " (path) VALUES (?);",
+    /* DEVICE_GET_ID                  */ "SELECT id FROM " DEVICES_TABLE " WHERE path = ?;",
+    /* CCD_RESULT_INSERT              */ "INSERT INTO " CCD_RESULTS_TABLE " (rowid, device_id, device_result_id, timestamp, integration_time, iterations, result, corrected) VALUES (?, ?, ?, ?, ?, ?, ?, ?);",
     /*CCD_RESULT_GET_LAST_ID          */ "SELECT MAX(rowid) FROM " CCD_RESULTS_TABLE,
     /* CCD_RESULT_UPDATE_DATA         */ "UPDATE " CCD_RESULTS_TABLE " SET result = ? WHERE rowid = ?;",
     /* CCD_RESULT_UPDATE_NAME         */ "UPDATE " CCD_RESULTS_TABLE " SET name = ? WHERE rowid = ?;",
     /* CCD_RESULT_UPDATE_NOTES        */ "UPDATE " CCD_RESULTS_TABLE " SET notes = ? WHERE rowid = ?;",
     /* CCD_RESULT_COUNT_IN_TIME_RANGE */ "SELECT COUNT(*) FROM " CCD_RESULTS_TABLE " WHERE timestamp BETWEEN ? AND ?",
-    /* CCD_RESULT_QUERY_IN_TIME_RANGE */ "SELECT rowid, name, timestamp, integration_time, iterations, notes, length(result), result FROM " CCD_RESULTS_TABLE " WHERE timestamp BETWEEN ? AND ? ORDER BY timestamp;",
+    /* CCD_RESULT_QUERY_IN_TIME_RANGE */ "SELECT rowid, name, timestamp, integration_time, iterations, notes, device_id, length(result) FROM " CCD_RESULTS_TABLE " WHERE timestamp BETWEEN ? AND ? ORDER BY timestamp, rowid;",
+    /* CCD_RESULT_QUERY_BEFORE        */ "SELECT * FROM (SELECT rowid, name, timestamp, integration_time, iterations, notes, device_id, length(result) FROM " CCD_RESULTS_TABLE " WHERE (timestamp, rowid) < (?, ?) ORDER BY timestamp DESC, rowid DESC LIMIT ?) ORDER BY timestamp, rowid;",
+    /* CCD_RESULT_GET_DATA            */ "SELECT rowid, result, corrected FROM " CCD_RESULTS_TABLE " WHERE rowid IN (?, ?, ?, ?, ?, ?, ?, ?);",
+    /* CORRECTION_FRAME_SET           */ "INSERT OR REPLACE INTO " CORRECTIONS_TABLE " (integration_time, iterations, kind, result_id) VALUES (?, ?, ?, ?);",
+    /* CORRECTION_FRAME_GET_ALL       */ "SELECT integration_time, iterations, kind, result_id FROM " CORRECTIONS_TABLE ";",
     // clang-format on
 };
 
+// These are prepared on the read connection, everything else on the writer's
+bool is_read_statement(u32 statement)
+{
+    switch (statement) {
+        case CCD_RESULT_GET_LAST_ID:
+        case CCD_RESULT_COUNT_IN_TIME_RANGE:
+        case CCD_RESULT_QUERY_IN_TIME_RANGE:
+        case CCD_RESULT_QUERY_BEFORE:
+        case CCD_RESULT_GET_DATA:
+        case CORRECTION_FRAME_GET_ALL: {
+            return true;
+        }
+        default: {
+            return false;
+        }
+    }
+}
+
 bool create_tables(sqlite3 *db)
 {
     constexpr char initial_setup[] =
@@ -46,7 +91,25 @@ bool create_tables(sqlite3 *db)
         "integration_time INTEGER NOT NULL,"
         "iterations INTEGER NOT NULL,"
         "notes TEXT,"
-        "result BLOB"
+        "result BLOB,"
+        "device_id INTEGER NOT NULL DEFAULT 0,"
+        "corrected BLOB,"
+        "device_result_id INTEGER NOT NULL DEFAULT 0"
+        ");"
+        // Startup and paging in older results only read a slice of the table by time. Goes on older dbs as well
+        "CREATE INDEX IF NOT EXISTS " CCD_RESULTS_TABLE "_by_timestamp ON " CCD_RESULTS_TABLE " (timestamp);"
+        ////////////////////////////////////////////////////////////////////////////////////////////////////
+        "CREATE TABLE IF NOT EXISTS " CORRECTIONS_TABLE " ("
+        "integration_time INTEGER NOT NULL,"
+        "iterations INTEGER NOT NULL,"
+        "kind INTEGER NOT NULL,"
+        "result_id INTEGER NOT NULL,"
+        "PRIMARY KEY (integration_time, iterations, kind)"
+        ");"
+        ////////////////////////////////////////////////////////////////////////////////////////////////////
+        "CREATE TABLE IF NOT EXISTS " DEVICES_TABLE " ("
+        "id INTEGER PRIMARY KEY,"
+        "path TEXT UNIQUE NOT NULL"
         ");"
         ////////////////////////////////////////////////////////////////////////////////////////////////////
         "CREATE TABLE IF NOT EXISTS " META_TABLE " ("
@@ -54,7 +117,8 @@ bool create_tables(sqlite3 *db)
         "value NOT NULL"
         ");"
         ////////////////////////////////////////////////////////////////////////////////////////////////////
-        "INSERT OR IGNORE INTO " META_TABLE " VALUES(\"" META_FIELD_VERSION "\", 1);"
+        // Only goes in on a fresh db, older ones keep their version and get migrated by update_db
+        "INSERT OR IGNORE INTO " META_TABLE " VALUES(\"" META_FIELD_VERSION "\", " STRINGIFY(DB_VERSION) ");"
         ////////////////////////////////////////////////////////////////////////////////////////////////////
         ;
 
@@ -68,6 +132,18 @@ bool create_tables(sqlite3 *db)
     return true;
 }
 
+bool run_migration(sqlite3 *db, s64 to_version, const char *sql)
+{
+    char *err_msg = NULL;
+    if (sqlite3_exec(db, sql, 0, 0, &err_msg) != SQLITE_OK) {
+        LOG_ERROR("Migration to version [{}] failed: [{}]", to_version, err_msg);
+        sqlite3_free(err_msg);
+        return false;
+    }
+    LOG_NORM("Migrated database to version [{}]", to_version);
+    return true;
+}
+
 bool update_db(sqlite3 *db)
 {
     static constexpr char kSQL[] = "SELECT * FROM " META_TABLE;
@@ -78,6 +154,7 @@ bool update_db(sqlite3 *db)
         return false;
     }
 
+    s64 version = 0;
     bool done = false;
     while (!done) {
         int query_result = sqlite3_step(stmt);
@@ -93,18 +170,338 @@ bool update_db(sqlite3 *db)
 
         const char *field_name = (char *)sqlite3_column_text(stmt, 0);
         if (strcmp(META_FIELD_VERSION, field_name) == 0) {
-            s64 version = sqlite3_column_int64(stmt, 1);
-            switch (version) {
-                default: {
-                    case 1: LOG_NORM("Database is on latest version [{}]", version); break;
-                }
-            }
+            version = sqlite3_column_int64(stmt, 1);
         }
     }
 
+    // Migrations change the tables, so they can't run while the meta query is still open
     sqlite3_finalize(stmt);
+
+    // Each case brings the db one version up and falls through to the next one
+    switch (version) {
+        case 1: {
+            // Results get tagged with the device they came from. Everything recorded before had a single device
+            constexpr char kToVersion2[] =
+                "BEGIN;"
+                "ALTER TABLE " CCD_RESULTS_TABLE " ADD COLUMN device_id INTEGER NOT NULL DEFAULT 0;"
+                "UPDATE " META_TABLE " SET value = 2 WHERE name = \"" META_FIELD_VERSION "\";"
+                "COMMIT;";
+            if (!run_migration(db, 2, kToVersion2)) {
+                sqlite3_exec(db, "ROLLBACK;", 0, 0, NULL);
+                return false;
+            }
+            [[fallthrough]];
+        }
+        case 2: {
+            // Dark / reference corrected spectrum next to the raw one, NULL for everything taken before. The table
+            // of frames is already there, the initial setup creates it
+            constexpr char kToVersion3[] =
+                "BEGIN;"
+                "ALTER TABLE " CCD_RESULTS_TABLE " ADD COLUMN corrected BLOB;"
+                "UPDATE " META_TABLE " SET value = 3 WHERE name = \"" META_FIELD_VERSION "\";"
+                "COMMIT;";
+            if (!run_migration(db, 3, kToVersion3)) {
+                sqlite3_exec(db, "ROLLBACK;", 0, 0, NULL);
+                return false;
+            }
+            [[fallthrough]];
+        }
+        case 3: {
+            // Rows used to be the id the device sent back. Those stay as they are, the device's own id is only known
+            // for what comes in from now on
+            constexpr char kToVersion4[] =
+                "BEGIN;"
+                "ALTER TABLE " CCD_RESULTS_TABLE " ADD COLUMN device_result_id INTEGER NOT NULL DEFAULT 0;"
+                "UPDATE " META_TABLE " SET value = 4 WHERE name = \"" META_FIELD_VERSION "\";"
+                "COMMIT;";
+            if (!run_migration(db, 4, kToVersion4)) {
+                sqlite3_exec(db, "ROLLBACK;", 0, 0, NULL);
+                return false;
+            }
+            [[fallthrough]];
+        }
+        case DB_VERSION: {
+            LOG_NORM("Database is on latest version [{}]", DB_VERSION);
+            break;
+        }
+        default: {
+            LOG_ERROR("Unknown database version [{}], latest is [{}]", version, DB_VERSION);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+struct DBWrite {
+    enum Type : u8 {
+        CreateResult,
+        UpdateName,
+        UpdateNotes,
+        UpdateData,
+        SetCorrectionFrame,
+    };
+
+    Type type;
+    s64 row_id;
+    u32 device_id;
+    u32 device_result_id;
+    std::chrono::seconds timestamp;
+    u32 integration_time;
+    u32 iterations;
+    // Kept alive until the write is done, whatever the caller passed is long gone by the time the writer gets to it.
+    // Shared with the pixel cache for CreateResult, a copy of its own for UpdateData
+    CCDPixelsRef pixels;
+    std::string text;
+    CorrectionFrameKind correction_kind;
+};
+
+// Outside of a transaction every statement is its own commit with its own journal sync, which is most of the cost
+// of a write. Queued writes go in together once there are this many or the oldest one waited this long
+constexpr u32 kMaxBatchWrites = 256;
+constexpr std::chrono::milliseconds kMaxBatchDelay(100);
+
+struct DBWriter {
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable work_ready;
+    std::condition_variable work_done;
+    bool running = false;
+    // Somebody is blocked in db_flush, don't wait for the batch to fill up
+    bool flush_requested = false;
+
+    std::vector<DBWrite> queue;
+    // The batch going through write_batch. Only changes with the mutex held, so reads can look through it and the
+    // queue for whatever isn't committed yet
+    std::vector<DBWrite> writing;
+    std::chrono::steady_clock::time_point oldest_queued;
+    // Highest row of every result ever queued
+    s64 max_queued_row_id = 0;
+    // Writes ever queued and how many of them are through a transaction, db_flush waits for the second to catch up
+    u64 queued_writes = 0;
+    u64 done_writes = 0;
+    DBWriterStats stats = {};
+};
+
+DBWriter gWriter;
+
+// Calls `fn` on every write that isn't committed yet, oldest first. Needs gWriter.mutex
+template <typename Fn>
+void for_each_uncommitted_write(Fn &&fn)
+{
+    for (const DBWrite &write : gWriter.writing) {
+        fn(write);
+    }
+    for (const DBWrite &write : gWriter.queue) {
+        fn(write);
+    }
+}
+
+bool insert_ccd_result(const DBWrite &write)
+{
+    sqlite3_stmt *insert_stmt = prepared_stmt[(u32)PreparedStatements::CCD_RESULT_INSERT];
+
+    sqlite3_reset(insert_stmt);
+    sqlite3_clear_bindings(insert_stmt);
+
+    // Rows are handed out by the host before the results get here, what the device called them goes in its own column
+    sqlite3_bind_int64(insert_stmt, 1, write.row_id);
+    sqlite3_bind_int(insert_stmt, 2, write.device_id);
+    sqlite3_bind_int(insert_stmt, 3, write.device_result_id);
+    sqlite3_bind_int64(insert_stmt, 4, write.timestamp.count());
+    sqlite3_bind_int(insert_stmt, 5, write.integration_time);
+    sqlite3_bind_int(insert_stmt, 6, write.iterations);
+    const std::vector<u32> &raw = write.pixels->raw;
+    const std::vector<f32> &corrected = write.pixels->corrected;
+    sqlite3_bind_blob(insert_stmt, 7, raw.data(), (int)(raw.size() * sizeof(u32)), SQLITE_STATIC);
+    if (!corrected.empty()) {
+        sqlite3_bind_blob(insert_stmt, 8, corrected.data(), (int)(corrected.size() * sizeof(f32)), SQLITE_STATIC);
+    }
+
+    int insert_result = sqlite3_step(insert_stmt);
+    if (insert_result != SQLITE_DONE) {
+        LOG_ERROR("Insert of ccd result [{}] failed: [{}]", write.row_id, sqlite3_errmsg(s_database));
+        return false;
+    }
+
+    return true;
+}
+
+bool update_ccd_result_text(PreparedStatements statement, const DBWrite &write)
+{
+    sqlite3_stmt *update_stmt = prepared_stmt[(u32)statement];
+
+    sqlite3_reset(update_stmt);
+    sqlite3_clear_bindings(update_stmt);
+
+    sqlite3_bind_text(update_stmt, 1, write.text.data(), (int)write.text.size(), SQLITE_STATIC);
+    sqlite3_bind_int64(update_stmt, 2, write.row_id);
+
+    int update_result = sqlite3_step(update_stmt);
+    if (update_result != SQLITE_DONE) {
+        LOG_ERROR("Update of ccd result [{}] failed: [{}]", write.row_id, sqlite3_errmsg(s_database));
+        return false;
+    }
+
     return true;
 }
+
+bool update_ccd_result_data(const DBWrite &write)
+{
+    sqlite3_stmt *update_stmt = prepared_stmt[(u32)PreparedStatements::CCD_RESULT_UPDATE_DATA];
+
+    _defer
+    {
+        sqlite3_reset(update_stmt);
+    };
+
+    sqlite3_clear_bindings(update_stmt);
+
+    const std::vector<u32> &raw = write.pixels->raw;
+    sqlite3_bind_blob(update_stmt, 1, raw.data(), (int)(raw.size() * sizeof(u32)), SQLITE_STATIC);
+    sqlite3_bind_int64(update_stmt, 2, write.row_id);
+
+    int update_result = sqlite3_step(update_stmt);
+    if (update_result != SQLITE_DONE) {
+        LOG_ERROR("Update of ccd result [{}] failed: [{}]", write.row_id, sqlite3_errmsg(s_database));
+        return false;
+    }
+
+    return true;
+}
+
+bool set_correction_frame(const DBWrite &write)
+{
+    sqlite3_stmt *set_stmt = prepared_stmt[(u32)PreparedStatements::CORRECTION_FRAME_SET];
+
+    _defer
+    {
+        sqlite3_reset(set_stmt);
+    };
+
+    sqlite3_clear_bindings(set_stmt);
+
+    sqlite3_bind_int(set_stmt, 1, write.integration_time);
+    sqlite3_bind_int(set_stmt, 2, write.iterations);
+    sqlite3_bind_int(set_stmt, 3, (int)write.correction_kind);
+    sqlite3_bind_int64(set_stmt, 4, write.row_id);
+
+    int set_result = sqlite3_step(set_stmt);
+    if (set_result != SQLITE_DONE) {
+        LOG_ERROR("Setting ccd result [{}] as correction frame failed: [{}]", write.row_id, sqlite3_errmsg(s_database));
+        return false;
+    }
+
+    return true;
+}
+
+// Runs the whole batch in one transaction, returns how many writes failed. A failing statement only undoes itself,
+// the rest of the batch still goes in
+u32 write_batch(const std::vector<DBWrite> &batch)
+{
+    std::lock_guard lock(s_database_mutex);
+
+    char *err_msg = NULL;
+    if (sqlite3_exec(s_database, "BEGIN;", 0, 0, &err_msg) != SQLITE_OK) {
+        LOG_ERROR("Failed to begin transaction: [{}]", err_msg);
+        sqlite3_free(err_msg);
+        return (u32)batch.size();
+    }
+
+    u32 failed = 0;
+    for (const DBWrite &write : batch) {
+        bool ok = false;
+        switch (write.type) {
+            case DBWrite::CreateResult: {
+                ok = insert_ccd_result(write);
+                break;
+            }
+            case DBWrite::UpdateName: {
+                ok = update_ccd_result_text(PreparedStatements::CCD_RESULT_UPDATE_NAME, write);
+                break;
+            }
+            case DBWrite::UpdateNotes: {
+                ok = update_ccd_result_text(PreparedStatements::CCD_RESULT_UPDATE_NOTES, write);
+                break;
+            }
+            case DBWrite::UpdateData: {
+                ok = update_ccd_result_data(write);
+                break;
+            }
+            case DBWrite::SetCorrectionFrame: {
+                ok = set_correction_frame(write);
+                break;
+            }
+        }
+        failed += ok ? 0 : 1;
+    }
+
+    if (sqlite3_exec(s_database, "COMMIT;", 0, 0, &err_msg) != SQLITE_OK) {
+        LOG_ERROR("Failed to commit [{}] writes: [{}]", batch.size(), err_msg);
+        sqlite3_free(err_msg);
+        sqlite3_exec(s_database, "ROLLBACK;", 0, 0, NULL);
+        return (u32)batch.size();
+    }
+
+    return failed;
+}
+
+void writer_main()
+{
+    std::unique_lock lock(gWriter.mutex);
+    while (true) {
+        if (gWriter.queue.empty()) {
+            // Whatever was queued before db_close still gets written
+            if (!gWriter.running) {
+                return;
+            }
+            gWriter.work_ready.wait(lock, [] { return !gWriter.running || !gWriter.queue.empty(); });
+            continue;
+        }
+
+        gWriter.work_ready.wait_until(lock, gWriter.oldest_queued + kMaxBatchDelay, [] {
+            return !gWriter.running || gWriter.flush_requested || gWriter.queue.size() >= kMaxBatchWrites;
+        });
+        gWriter.writing.swap(gWriter.queue);
+        gWriter.flush_requested = false;
+        u64 batch_end = gWriter.queued_writes;
+
+        lock.unlock();
+        auto start = std::chrono::steady_clock::now();
+        u32 failed = write_batch(gWriter.writing);
+        f64 flush_ms = std::chrono::duration<f64, std::milli>(std::chrono::steady_clock::now() - start).count();
+        lock.lock();
+
+        // Committed, reads find these in the table from now on
+        u32 batch_size = (u32)gWriter.writing.size();
+        gWriter.writing.clear();
+        gWriter.done_writes = batch_end;
+        gWriter.stats.writes += batch_size;
+        gWriter.stats.failed_writes += failed;
+        gWriter.stats.transactions++;
+        gWriter.stats.last_batch_size = batch_size;
+        gWriter.stats.last_flush_ms = flush_ms;
+        gWriter.stats.max_flush_ms = std::max(gWriter.stats.max_flush_ms, flush_ms);
+        gWriter.work_done.notify_all();
+    }
+}
+
+void queue_write(DBWrite &&write)
+{
+    {
+        std::lock_guard lock(gWriter.mutex);
+        if (gWriter.queue.empty()) {
+            gWriter.oldest_queued = std::chrono::steady_clock::now();
+        }
+        if (write.type == DBWrite::CreateResult) {
+            gWriter.max_queued_row_id = std::max(gWriter.max_queued_row_id, write.row_id);
+        }
+        gWriter.queue.push_back(std::move(write));
+        gWriter.queued_writes++;
+        gWriter.stats.max_queue_depth = std::max(gWriter.stats.max_queue_depth, (u32)gWriter.queue.size());
+    }
+    gWriter.work_ready.notify_one();
+}
 } // namespace
 
 bool db_open()
@@ -115,54 +512,108 @@ bool db_open()
         return false;
     }
 
+    // Readers and the writer don't block each other in WAL mode. It sticks to the file, older dbs switch over here
+    char *err_msg = NULL;
+    if (sqlite3_exec(s_database, "PRAGMA journal_mode=WAL;", 0, 0, &err_msg) != SQLITE_OK) {
+        LOG_ERROR("Failed to switch database to WAL: [{}]", err_msg);
+        sqlite3_free(err_msg);
+    }
+
     if (!create_tables(s_database) || !update_db(s_database)) {
         sqlite3_close(s_database);
         return false;
     }
 
+    open_result = sqlite3_open_v2(kDbName, &s_read_database, SQLITE_OPEN_READONLY, NULL);
+    if (open_result != SQLITE_OK) {
+        LOG_ERROR("Cannot open database for reading: [{}]", sqlite3_errmsg(s_read_database));
+        sqlite3_close(s_read_database);
+        sqlite3_close(s_database);
+        return false;
+    }
+    // Only matters when WAL didn't work out, reads then wait for the writer's commit instead of failing
+    sqlite3_busy_timeout(s_read_database, 5000);
+
     for (u32 i = 0; i < (u32)PreparedStatements::__COUNT; ++i) {
         const char *sql_stmt = sql_statements[i];
-        int prepare_result = sqlite3_prepare_v2(s_database, sql_stmt, -1, &prepared_stmt[i], NULL);
+        sqlite3 *db = is_read_statement(i) ? s_read_database : s_database;
+        int prepare_result = sqlite3_prepare_v2(db, sql_stmt, -1, &prepared_stmt[i], NULL);
         if (prepare_result != SQLITE_OK) {
-            LOG_ERROR("Failed to prepare statement: [{}-{}] [{}]\n", i, sql_stmt, sqlite3_errmsg(s_database));
+            LOG_ERROR("Failed to prepare statement: [{}-{}] [{}]\n", i, sql_stmt, sqlite3_errmsg(db));
+            sqlite3_close(s_read_database);
             sqlite3_close(s_database);
             return false;
         }
     }
 
+    gWriter.running = true;
+    gWriter.thread = std::thread(writer_main);
     return true;
 }
 
-s64 db_ccd_result_create(
-    std::chrono::seconds timestamp, u32 integration_time, u32 iterations, const void *result_data, s32 data_size)
+s64 db_device_get_id(std::string_view path)
 {
-    sqlite3_stmt *insert_stmt = prepared_stmt[(u32)PreparedStatements::CCD_RESULT_INSERT];
-
+    std::lock_guard lock(s_database_mutex);
+    sqlite3_stmt *insert_stmt = prepared_stmt[(u32)PreparedStatements::DEVICE_INSERT];
     sqlite3_reset(insert_stmt);
     sqlite3_clear_bindings(insert_stmt);
-
-    sqlite3_bind_int64(insert_stmt, 1, timestamp.count());
-    sqlite3_bind_int(insert_stmt, 2, integration_time);
-    sqlite3_bind_int(insert_stmt, 3, iterations);
-    sqlite3_bind_blob(insert_stmt, 4, result_data, data_size, SQLITE_STATIC);
-
-    int insert_result = sqlite3_step(insert_stmt);
-    if (insert_result != SQLITE_DONE) {
+    sqlite3_bind_text(insert_stmt, 1, path.data(), (int)path.size(), SQLITE_STATIC);
+    if (sqlite3_step(insert_stmt) != SQLITE_DONE) {
         LOG_ERROR("Insert execution failed: [{}]", sqlite3_errmsg(s_database));
         return -1;
     }
 
-    return sqlite3_last_insert_rowid(s_database);
+    sqlite3_stmt *get_id_stmt = prepared_stmt[(u32)PreparedStatements::DEVICE_GET_ID];
+    _defer
+    {
+        sqlite3_reset(get_id_stmt);
+    };
+    sqlite3_clear_bindings(get_id_stmt);
+    sqlite3_bind_text(get_id_stmt, 1, path.data(), (int)path.size(), SQLITE_STATIC);
+    if (sqlite3_step(get_id_stmt) != SQLITE_ROW) {
+        LOG_ERROR("Query device id failed: [{}]", sqlite3_errmsg(s_database));
+        return -1;
+    }
+
+    return sqlite3_column_int64(get_id_stmt, 0);
+}
+
+void db_ccd_result_create(s64 id,
+                          u32 device_id,
+                          u32 device_result_id,
+                          std::chrono::seconds timestamp,
+                          u32 integration_time,
+                          u32 iterations,
+                          CCDPixelsRef pixels)
+{
+    queue_write({
+        .type = DBWrite::CreateResult,
+        .row_id = id,
+        .device_id = device_id,
+        .device_result_id = device_result_id,
+        .timestamp = timestamp,
+        .integration_time = integration_time,
+        .iterations = iterations,
+        .pixels = std::move(pixels),
+    });
 }
 
 s64 get_next_ccd_result_id()
 {
+    // Results still in the queue have rows too, they just aren't in the table yet
+    s64 max_queued_row_id = 0;
+    {
+        std::lock_guard lock(gWriter.mutex);
+        max_queued_row_id = gWriter.max_queued_row_id;
+    }
+
+    std::lock_guard lock(s_read_database_mutex);
     sqlite3_stmt *get_id_stmt = prepared_stmt[(u32)PreparedStatements::CCD_RESULT_GET_LAST_ID];
     sqlite3_reset(get_id_stmt);
 
     int insert_result = sqlite3_step(get_id_stmt);
     if (insert_result != SQLITE_ROW) {
-        LOG_ERROR("Insert execution failed: [{}]", sqlite3_errmsg(s_database));
+        LOG_ERROR("Insert execution failed: [{}]", sqlite3_errmsg(s_read_database));
         return -1;
     }
 
@@ -170,78 +621,148 @@ s64 get_next_ccd_result_id()
 
     insert_result = sqlite3_step(get_id_stmt);
     if (insert_result != SQLITE_DONE) {
-        LOG_ERROR("Insert execution failed: [{}]", sqlite3_errmsg(s_database));
+        LOG_ERROR("Insert execution failed: [{}]", sqlite3_errmsg(s_read_database));
         return -1;
     }
 
-    return id + 1;
+    return std::max(id, max_queued_row_id) + 1;
 }
 
-bool db_ccd_result_update_name(s64 row_id, std::string_view name)
+void db_ccd_result_update_name(s64 row_id, std::string_view name)
 {
-    sqlite3_stmt *update_stmt = prepared_stmt[(u32)PreparedStatements::CCD_RESULT_UPDATE_NAME];
+    queue_write({.type = DBWrite::UpdateName, .row_id = row_id, .text = std::string(name)});
+}
 
-    sqlite3_reset(update_stmt);
-    sqlite3_clear_bindings(update_stmt);
+void db_ccd_result_update_notes(s64 row_id, std::string_view notes)
+{
+    queue_write({.type = DBWrite::UpdateNotes, .row_id = row_id, .text = std::string(notes)});
+}
 
-    sqlite3_bind_text(update_stmt, 1, name.data(), (int)name.size(), SQLITE_STATIC);
-    sqlite3_bind_int64(update_stmt, 2, row_id);
+void db_ccd_result_update_data(s64 row_id, std::span<const u32> pixels)
+{
+    CCDPixels copy = {{pixels.begin(), pixels.end()}};
+    queue_write(
+        {.type = DBWrite::UpdateData, .row_id = row_id, .pixels = std::make_shared<const CCDPixels>(std::move(copy))});
+}
 
-    int update_result = sqlite3_step(update_stmt);
-    if (update_result != SQLITE_DONE) {
-        LOG_ERROR("Update execution failed: [{}]", sqlite3_errmsg(s_database));
-        return false;
+void db_flush()
+{
+    std::unique_lock lock(gWriter.mutex);
+    if (!gWriter.running) {
+        return;
     }
-
-    return true;
+    u64 target = gWriter.queued_writes;
+    if (gWriter.done_writes >= target) {
+        return;
+    }
+    gWriter.flush_requested = true;
+    gWriter.work_ready.notify_one();
+    gWriter.work_done.wait(lock, [target] { return gWriter.done_writes >= target; });
 }
 
-bool db_ccd_result_update_notes(s64 row_id, std::string_view notes)
+DBWriterStats db_get_writer_stats()
 {
-    sqlite3_stmt *update_stmt = prepared_stmt[(u32)PreparedStatements::CCD_RESULT_UPDATE_NOTES];
+    std::lock_guard lock(gWriter.mutex);
+    DBWriterStats stats = gWriter.stats;
+    stats.queue_depth = (u32)gWriter.queue.size();
+    return stats;
+}
 
-    sqlite3_reset(update_stmt);
-    sqlite3_clear_bindings(update_stmt);
+// A result or a rename on its way to the table
+struct UncommittedWrite {
+    DBWrite::Type type;
+    CCDOperation op;
+    u32 pixel_count;
+    std::string text;
+};
 
-    sqlite3_bind_text(update_stmt, 1, notes.data(), (int)notes.size(), SQLITE_STATIC);
-    sqlite3_bind_int64(update_stmt, 2, row_id);
+// Copied before the query, so a batch that gets committed in between shows up in one or both of them, never in
+// neither. Renames always, results only with `with_results` and when they're in [start_time, end_time]
+static void get_uncommitted_writes(bool with_results,
+                                   std::chrono::seconds start_time,
+                                   std::chrono::seconds end_time,
+                                   std::vector<UncommittedWrite> *uncommitted)
+{
+    std::lock_guard lock(gWriter.mutex);
+    for_each_uncommitted_write([&](const DBWrite &write) {
+        bool in_range = with_results && write.timestamp >= start_time && write.timestamp <= end_time;
+        bool is_text = write.type == DBWrite::UpdateName || write.type == DBWrite::UpdateNotes;
+        if ((write.type == DBWrite::CreateResult && in_range) || is_text) {
+            CCDOperation op = {
+                (u32)write.row_id,
+                write.device_id,
+                std::chrono::local_seconds{write.timestamp},
+                write.integration_time,
+                write.iterations,
+            };
+            u32 pixel_count = write.pixels ? (u32)write.pixels->raw.size() : 0;
+            uncommitted->push_back({write.type, op, pixel_count, write.text});
+        }
+    });
+}
 
-    int update_result = sqlite3_step(update_stmt);
-    if (update_result != SQLITE_DONE) {
-        LOG_ERROR("Update execution failed: [{}]", sqlite3_errmsg(s_database));
-        return false;
+static void apply_uncommitted_writes(std::span<const UncommittedWrite> uncommitted, CCDOperationStore *ops)
+{
+    // Newer than anything committed, so results still go after the rest in timestamp order
+    for (const UncommittedWrite &write : uncommitted) {
+        s64 row = ccd_store_find(ops, write.op.id);
+        if (write.type == DBWrite::CreateResult && row < 0) {
+            ccd_store_push_metadata(ops, write.op, write.pixel_count);
+        } else if (write.type == DBWrite::UpdateName && row >= 0) {
+            ops->names[row] = write.text;
+        } else if (write.type == DBWrite::UpdateNotes && row >= 0) {
+            ops->notes[row] = write.text;
+        }
     }
-
-    return true;
 }
 
-bool db_ccd_result_update_data(s64 row_id, const void *result_data, s32 data_size)
+// Pushes every row of a query that selects what CCD_RESULT_QUERY_IN_TIME_RANGE does
+static void read_ccd_result_rows(sqlite3_stmt *stmt, CCDOperationStore *ops)
 {
-    sqlite3_stmt *update_stmt = prepared_stmt[(u32)PreparedStatements::CCD_RESULT_UPDATE_DATA];
-
-    _defer
-    {
-        sqlite3_reset(update_stmt);
-    };
+    while (true) {
+        int query_result = sqlite3_step(stmt);
+        if (query_result == SQLITE_DONE) {
+            return;
+        }
+        if (query_result != SQLITE_ROW) {
+            LOG_ERROR("Query ccd results failed: [{}]", sqlite3_errstr(query_result));
+            return;
+        }
 
-    sqlite3_clear_bindings(update_stmt);
+        CCDOperation record;
+        record.id = sqlite3_column_int64(stmt, 0);
+        {
+            using namespace std::chrono;
+            record.ts = local_seconds{seconds(sqlite3_column_int64(stmt, 2))};
+        }
+        record.exposure_time_in_us = sqlite3_column_int(stmt, 3);
+        record.iterations = sqlite3_column_int(stmt, 4);
+        record.device_id = sqlite3_column_int(stmt, 6);
 
-    sqlite3_bind_blob(update_stmt, 1, result_data, data_size, SQLITE_STATIC);
-    sqlite3_bind_int64(update_stmt, 2, row_id);
+        // Only the size, the pixels are read one result at a time when something needs them
+        size_t blob_len = sqlite3_column_int64(stmt, 7);
+        u32 row = ccd_store_push_metadata(ops, record, blob_len / sizeof(u32));
 
-    int update_result = sqlite3_step(update_stmt);
-    if (update_result != SQLITE_DONE) {
-        LOG_ERROR("Update execution failed: [{}]", sqlite3_errmsg(s_database));
-        return false;
+        const char *name = (char *)sqlite3_column_text(stmt, 1);
+        if (name) {
+            ops->names[row] = name;
+        }
+        const char *note = (char *)sqlite3_column_text(stmt, 5);
+        if (note) {
+            ops->notes[row] = note;
+        }
     }
-
-    return true;
 }
 
 void db_ccd_result_get_by_time_range(std::chrono::seconds start_time,
                                      std::chrono::seconds end_time,
-                                     std::vector<CCDOperation> *ops)
+                                     CCDOperationStore *ops)
 {
+    std::vector<UncommittedWrite> uncommitted;
+    get_uncommitted_writes(true, start_time, end_time, &uncommitted);
+
+    std::lock_guard lock(s_read_database_mutex);
+
     sqlite3_stmt *count_stmt = prepared_stmt[(u32)PreparedStatements::CCD_RESULT_COUNT_IN_TIME_RANGE];
     _defer
     {
@@ -256,9 +777,12 @@ void db_ccd_result_get_by_time_range(std::chrono::seconds start_time,
         record_count = sqlite3_column_int(count_stmt, 0);
     }
 
-    // TODO this feels weird. We probably just want to reset the list before?
-    ops->clear();
-    ops->reserve(record_count);
+    ccd_store_clear(ops);
+    ccd_store_reserve(ops, record_count + (u32)uncommitted.size(), 0);
+    _defer
+    {
+        apply_uncommitted_writes(uncommitted, ops);
+    };
 
     if (record_count == 0) {
         return;
@@ -275,61 +799,237 @@ void db_ccd_result_get_by_time_range(std::chrono::seconds start_time,
     sqlite3_clear_bindings(query_time_range_stmt);
     sqlite3_bind_int64(query_time_range_stmt, 1, start_time.count());
     sqlite3_bind_int64(query_time_range_stmt, 2, end_time.count());
+    read_ccd_result_rows(query_time_range_stmt, ops);
+}
 
-    bool done = false;
-    while (!done) {
-        int query_result = sqlite3_step(query_time_range_stmt);
-        if (query_result == SQLITE_DONE) {
-            done = true;
-            continue;
+void db_ccd_result_get_before(std::chrono::seconds timestamp, u32 id, u32 max_count, CCDOperationStore *ops)
+{
+    // Anything still queued is newer than what's already loaded, only renames can be for these
+    std::vector<UncommittedWrite> uncommitted;
+    get_uncommitted_writes(false, {}, {}, &uncommitted);
+
+    std::lock_guard lock(s_read_database_mutex);
+
+    ccd_store_clear(ops);
+    ccd_store_reserve(ops, max_count, 0);
+    _defer
+    {
+        apply_uncommitted_writes(uncommitted, ops);
+    };
+
+    sqlite3_stmt *query_before_stmt = prepared_stmt[(u32)PreparedStatements::CCD_RESULT_QUERY_BEFORE];
+    _defer
+    {
+        sqlite3_reset(query_before_stmt);
+    };
+
+    sqlite3_clear_bindings(query_before_stmt);
+    sqlite3_bind_int64(query_before_stmt, 1, timestamp.count());
+    sqlite3_bind_int64(query_before_stmt, 2, id);
+    sqlite3_bind_int(query_before_stmt, 3, (s32)max_count);
+    read_ccd_result_rows(query_before_stmt, ops);
+
+    LOG_NORM("Found [{}] ccd results before [{}]", ccd_store_size(ops), timestamp);
+}
+
+void db_ccd_result_get_data(std::span<const s64> row_ids, std::vector<DBResultData> *results)
+{
+    results->clear();
+    results->resize(row_ids.size());
+    for (u32 i = 0; i < row_ids.size(); ++i) {
+        (*results)[i].row_id = row_ids[i];
+    }
+
+    // Rows that aren't committed yet come straight out of the queue. Checked before the table, a batch committed in
+    // between is in there by the time it's read. Pixels of a queued UpdateData go over whatever the table has
+    std::vector<std::pair<u32, std::vector<u32>>> updated_pixels;
+    std::vector<s64> to_read;
+    {
+        std::lock_guard lock(gWriter.mutex);
+        for (u32 i = 0; i < row_ids.size(); ++i) {
+            const DBWrite *created = nullptr;
+            const DBWrite *updated = nullptr;
+            for_each_uncommitted_write([&](const DBWrite &write) {
+                if (write.row_id != row_ids[i]) {
+                    return;
+                }
+                if (write.type == DBWrite::CreateResult) {
+                    created = &write;
+                    updated = nullptr;
+                } else if (write.type == DBWrite::UpdateData) {
+                    updated = &write;
+                }
+            });
+
+            DBResultData *data = &(*results)[i];
+            if (created) {
+                data->found = true;
+                data->pixels = updated ? updated->pixels->raw : created->pixels->raw;
+                data->corrected = created->pixels->corrected;
+                continue;
+            }
+            if (updated) {
+                updated_pixels.push_back({i, updated->pixels->raw});
+            }
+            to_read.push_back(row_ids[i]);
         }
-        if (query_result != SQLITE_ROW) {
-            LOG_ERROR("Query time range failed: [{}]", sqlite3_errstr(query_result));
-            return;
+    }
+
+    std::lock_guard lock(s_read_database_mutex);
+
+    sqlite3_stmt *stmt = prepared_stmt[(u32)PreparedStatements::CCD_RESULT_GET_DATA];
+    for (u32 first = 0; first < to_read.size(); first += kGetDataRows) {
+        _defer
+        {
+            sqlite3_reset(stmt);
+        };
+
+        // Slots past the end stay NULL, which matches no row
+        sqlite3_clear_bindings(stmt);
+        u32 count = std::min(kGetDataRows, (u32)to_read.size() - first);
+        for (u32 i = 0; i < count; ++i) {
+            sqlite3_bind_int64(stmt, i + 1, to_read[first + i]);
         }
 
-        CCDOperation &record = ops->emplace_back();
-        record.id = sqlite3_column_int64(query_time_range_stmt, 0);
-        const char *name = (char *)sqlite3_column_text(query_time_range_stmt, 1);
-        if (name) {
-            record.name = name;
+        while (true) {
+            int result = sqlite3_step(stmt);
+            if (result == SQLITE_DONE) {
+                break;
+            }
+            if (result != SQLITE_ROW) {
+                LOG_ERROR("Getting data of [{}] ccd results failed: [{}]", count, sqlite3_errstr(result));
+                break;
+            }
+
+            s64 row_id = sqlite3_column_int64(stmt, 0);
+            auto data = std::find_if(
+                results->begin(), results->end(), [row_id](const DBResultData &d) { return d.row_id == row_id; });
+            if (data == results->end()) {
+                continue;
+            }
+
+            data->found = true;
+            const void *blob_data = sqlite3_column_blob(stmt, 1);
+            size_t blob_len = sqlite3_column_bytes(stmt, 1);
+            data->pixels.resize(blob_data ? blob_len / sizeof(u32) : 0);
+            if (!data->pixels.empty()) {
+                // Blobs have no alignment guarantee
+                memcpy(data->pixels.data(), blob_data, data->pixels.size() * sizeof(u32));
+            }
+
+            const void *corrected_data = sqlite3_column_blob(stmt, 2);
+            size_t corrected_len = sqlite3_column_bytes(stmt, 2);
+            data->corrected.resize(corrected_data ? corrected_len / sizeof(f32) : 0);
+            if (!data->corrected.empty()) {
+                memcpy(data->corrected.data(), corrected_data, data->corrected.size() * sizeof(f32));
+            }
         }
-        {
-            using namespace std::chrono;
-            record.ts = local_seconds{seconds(sqlite3_column_int64(query_time_range_stmt, 2))};
+    }
+
+    for (auto &[i, pixels] : updated_pixels) {
+        DBResultData *data = &(*results)[i];
+        if (data->found) {
+            data->pixels = std::move(pixels);
         }
-        record.exposure_time_in_us = sqlite3_column_int(query_time_range_stmt, 3);
-        record.iterations = sqlite3_column_int(query_time_range_stmt, 4);
-        const char *note = (char *)sqlite3_column_text(query_time_range_stmt, 5);
-        if (note) {
-            record.note = note;
+    }
+}
+
+bool db_ccd_result_get_data(s64 row_id, std::vector<u32> *pixels, std::vector<f32> *corrected)
+{
+    std::vector<DBResultData> results;
+    db_ccd_result_get_data({&row_id, 1}, &results);
+    if (!results[0].found) {
+        LOG_ERROR("No ccd result with id [{}]", row_id);
+        return false;
+    }
+    *pixels = std::move(results[0].pixels);
+    *corrected = std::move(results[0].corrected);
+    return true;
+}
+
+void db_correction_frame_set(u32 integration_time, u32 iterations, CorrectionFrameKind kind, s64 result_id)
+{
+    queue_write({
+        .type = DBWrite::SetCorrectionFrame,
+        .row_id = result_id,
+        .integration_time = integration_time,
+        .iterations = iterations,
+        .correction_kind = kind,
+    });
+}
+
+void db_correction_frames_get(std::vector<DBCorrectionFrame> *frames)
+{
+    // Frames set since the last commit replace whatever the table has for them
+    std::vector<DBCorrectionFrame> uncommitted;
+    {
+        std::lock_guard lock(gWriter.mutex);
+        for_each_uncommitted_write([&](const DBWrite &write) {
+            if (write.type == DBWrite::SetCorrectionFrame) {
+                uncommitted.push_back({write.integration_time, write.iterations, write.correction_kind, write.row_id});
+            }
+        });
+    }
+
+    std::lock_guard lock(s_read_database_mutex);
+
+    sqlite3_stmt *stmt = prepared_stmt[(u32)PreparedStatements::CORRECTION_FRAME_GET_ALL];
+    _defer
+    {
+        sqlite3_reset(stmt);
+    };
+
+    frames->clear();
+    while (true) {
+        int result = sqlite3_step(stmt);
+        if (result == SQLITE_DONE) {
+            break;
+        }
+        if (result != SQLITE_ROW) {
+            LOG_ERROR("Query correction frames failed: [{}]", sqlite3_errstr(result));
+            return;
         }
+        frames->push_back({
+            (u32)sqlite3_column_int(stmt, 0),
+            (u32)sqlite3_column_int(stmt, 1),
+            (CorrectionFrameKind)sqlite3_column_int(stmt, 2),
+            sqlite3_column_int64(stmt, 3),
+        });
+    }
 
-        size_t blob_len = sqlite3_column_int64(query_time_range_stmt, 6);
-        const void *blob_data = sqlite3_column_blob(query_time_range_stmt, 7);
-        // TODO re-do this
-#if 0
-        if (blob_len > 0 && blob_data) {
-            s64 size = std::min(
-                blob_len, record.accumulated_values.size() * sizeof(decltype(record.accumulated_values)::value_type));
-            memcpy(record.accumulated_values.data(), blob_data, size);
+    for (const DBCorrectionFrame &frame : uncommitted) {
+        auto it = std::find_if(frames->begin(), frames->end(), [&](const DBCorrectionFrame &other) {
+            return other.integration_time == frame.integration_time && other.iterations == frame.iterations &&
+                   other.kind == frame.kind;
+        });
+        if (it != frames->end()) {
+            *it = frame;
+        } else {
+            frames->push_back(frame);
         }
-#else
-        u32 item_count = blob_len / sizeof(u32);
-        record.accumulated_values.reserve(item_count);
-        record.accumulated_values.insert(
-            record.accumulated_values.end(), (u32 *)blob_data, ((u32 *)blob_data) + item_count);
-#endif
     }
 }
 
 void db_close()
 {
+    if (gWriter.thread.joinable()) {
+        {
+            std::lock_guard lock(gWriter.mutex);
+            gWriter.running = false;
+        }
+        gWriter.work_ready.notify_one();
+        gWriter.thread.join();
+    }
+
     for (u32 i = 0; i < (u32)PreparedStatements::__COUNT; ++i) {
         sqlite3_stmt *stmt = prepared_stmt[i];
         sqlite3_finalize(stmt);
     }
 
+    if (s_read_database) {
+        sqlite3_close(s_read_database);
+        s_read_database = NULL;
+    }
     if (s_database) {
         sqlite3_close(s_database);
         s_database = NULL;
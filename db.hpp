@@ -5,20 +5,77 @@
 #include "app.hpp"
 
 #include <chrono>
+#include <span>
 #include <vector>
 
 bool db_open();
-s64 db_ccd_result_create(
-    std::chrono::seconds timestamp, u32 integration_time, u32 iterations, const void *result_data, s32 data_size);
+// Id of the device on `path`, adding it the first time the path is seen
+s64 db_device_get_id(std::string_view path);
+
+// Writes are queued for a writer thread that runs them in batched transactions. They copy what they're given and
+// return right away, so failures only show up in the log. Reads go through their own connection and never wait on
+// the writer, anything still queued comes out of the queue instead of the table
+//
+// The row is `id`, nothing comes back from the db to pick one. Hand them out with get_next_ccd_result_id.
+// `device_result_id` is whatever the device called the result, 0 when it doesn't matter. `pixels` isn't copied, the
+// write keeps a reference until it's committed. Its `corrected` is empty when there was no dark and reference to
+// correct the result with
+void db_ccd_result_create(s64 id,
+                          u32 device_id,
+                          u32 device_result_id,
+                          std::chrono::seconds timestamp,
+                          u32 integration_time,
+                          u32 iterations,
+                          CCDPixelsRef pixels);
 s64 get_next_ccd_result_id();
-bool db_ccd_result_update_name(s64 row_id, std::string_view name);
-bool db_ccd_result_update_notes(s64 row_id, std::string_view notes);
-bool db_ccd_result_update_data(s64 row_id, const void *result_data, s32 data_size);
+void db_ccd_result_update_name(s64 row_id, std::string_view name);
+void db_ccd_result_update_notes(s64 row_id, std::string_view notes);
+void db_ccd_result_update_data(s64 row_id, std::span<const u32> pixels);
+// Blocks until every write queued before the call is committed. Only for shutting down, reads don't need it
+void db_flush();
+
+struct DBWriterStats {
+    u32 queue_depth;
+    u32 max_queue_depth;
+    u64 writes;
+    u64 failed_writes;
+    u64 transactions;
+    u32 last_batch_size;
+    // Time spent in the last and the slowest transaction
+    f64 last_flush_ms;
+    f64 max_flush_ms;
+};
+
+DBWriterStats db_get_writer_stats();
+
+// Everything but the pixels, the stored rows only have their pixel counts. Get those with db_ccd_result_get_data
 void db_ccd_result_get_by_time_range(std::chrono::seconds start_time,
                                      std::chrono::seconds end_time,
-                                     std::vector<CCDOperation> *);
-inline void db_ccd_result_get_all(std::vector<CCDOperation> *operations)
-{
-    db_ccd_result_get_by_time_range(std::chrono::seconds(0), std::chrono::seconds(s64Max), operations);
-}
+                                     CCDOperationStore *);
+// The same for up to `max_count` of the results right before the one at `timestamp` with `id`, in the same order. For
+// paging in older results in front of what's loaded, fewer than `max_count` means there's nothing older left
+void db_ccd_result_get_before(std::chrono::seconds timestamp, u32 id, u32 max_count, CCDOperationStore *);
+// `corrected` comes back empty for results that were stored without it
+bool db_ccd_result_get_data(s64 row_id, std::vector<u32> *pixels, std::vector<f32> *corrected);
+struct DBResultData {
+    s64 row_id;
+    // False for rows the db doesn't have
+    bool found;
+    std::vector<u32> pixels;
+    std::vector<f32> corrected;
+};
+// The same for many rows at once, read with a handful of queries instead of one each. `results` has an entry for
+// every id in `row_ids`, in the same order
+void db_ccd_result_get_data(std::span<const s64> row_ids, std::vector<DBResultData> *results);
+
+// The dark and the reference results get corrected with, one of each per exposure time and iteration count
+void db_correction_frame_set(u32 integration_time, u32 iterations, CorrectionFrameKind kind, s64 result_id);
+struct DBCorrectionFrame {
+    u32 integration_time;
+    u32 iterations;
+    CorrectionFrameKind kind;
+    s64 result_id;
+};
+void db_correction_frames_get(std::vector<DBCorrectionFrame> *frames);
+// Writes whatever is still queued before closing
 void db_close();
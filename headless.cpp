@@ -0,0 +1,339 @@
+// Headless controller for unattended loggers, no window, OpenGL or ImGui.
+//
+// Runs the same Comms / handle_commands / db code the UI does from a console. Built with `HEADLESS=1 build.bat`, or
+// with `make` on POSIX.
+//
+// Usage:
+//   controller-headless --device PATH [--device PATH ...] [--plan STEPS] [--encoding E] [--capture FILE]
+//                       [--duration S]
+//   controller-headless --list [--from YYYY-MM-DD] [--to YYYY-MM-DD]
+//   controller-headless --ports
+//
+//   --device PATH   Com port to connect to, can be given more than once
+//   --plan STEPS    Acquisition plan to run on every device, steps separated by commas. A step is
+//                   exposure:iterations[:repeat[:delay_ms]], e.g. 1000:10:5,2000:10:5:100. Exits once every device
+//                   is done with it
+//   --encoding E    Pixel encoding to ask the devices for, absolute, delta or packed
+//   --capture FILE  Record a raw capture of every device, the device id gets appended to the name
+//   --duration S    Stop after S seconds. Without a plan or a duration it records until Ctrl+C
+//
+//   --list          Print the stored results in the date range (both days included) as CSV and exit
+//   --ports         Print the com ports that are there and exit
+
+#include "app.hpp"
+#include "db.hpp"
+#include "log.hpp"
+#include "protocol.hpp"
+#include "shorthand.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+
+// Ctrl+C only sets a flag, so the loop never sleeps longer than this
+static constexpr std::chrono::milliseconds kIdleTimeout(250);
+
+struct HeadlessOptions {
+    std::vector<std::string_view> devices;
+    std::vector<AcquisitionStep> plan;
+    bool set_encoding = false;
+    PixelEncoding encoding = {};
+    std::string capture_path;
+    f64 duration_s = 0;
+
+    bool list = false;
+    std::chrono::year_month_day list_from = std::chrono::year_month_day{std::chrono::sys_days()};
+    std::chrono::year_month_day list_to = std::chrono::year(9999) / 12 / 31;
+
+    bool ports = false;
+};
+
+static std::atomic<bool> gStop = false;
+
+// Same as the UI main loop: the first wake after the loop looked at the rings ends the wait, everything else that
+// arrives before the loop gets to it is handled by the same iteration
+static std::atomic<bool> gWakeArmed = false;
+static std::mutex gWakeMutex;
+static std::condition_variable gWakeCondition;
+static bool gWoken = false;
+
+void wake_main_loop()
+{
+    if (gWakeArmed.exchange(false)) {
+        std::lock_guard lock(gWakeMutex);
+        gWoken = true;
+        gWakeCondition.notify_one();
+    }
+}
+
+void set_window_title(std::string_view) {}
+
+static void print_usage()
+{
+    fprintf(stderr,
+            "usage: controller-headless --device PATH [--device PATH ...] [--plan STEPS] [--encoding E] "
+            "[--capture FILE] [--duration S]\n"
+            "       controller-headless --list [--from YYYY-MM-DD] [--to YYYY-MM-DD]\n"
+            "       controller-headless --ports\n");
+}
+
+static bool parse_plan(const char *text, std::vector<AcquisitionStep> *plan)
+{
+    while (*text) {
+        AcquisitionStep step = {0, 0, 1, 0};
+        if (sscanf(text, "%u:%u:%u:%u", &step.exposure, &step.iterations, &step.repeat, &step.delay_ms) < 2) {
+            return false;
+        }
+        plan->push_back(step);
+
+        const char *next = strchr(text, ',');
+        if (!next) {
+            break;
+        }
+        text = next + 1;
+    }
+    return !plan->empty();
+}
+
+static bool parse_date(const char *text, std::chrono::year_month_day *date)
+{
+    s32 y = 0;
+    u32 m = 0;
+    u32 d = 0;
+    if (sscanf(text, "%d-%u-%u", &y, &m, &d) != 3) {
+        return false;
+    }
+    *date = std::chrono::year(y) / std::chrono::month(m) / std::chrono::day(d);
+    return date->ok();
+}
+
+static bool parse_args(int argc, char **argv, HeadlessOptions *options)
+{
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : nullptr;
+        bool takes_value = true;
+
+        if (arg == "--list") {
+            options->list = true;
+            takes_value = false;
+        } else if (arg == "--ports") {
+            options->ports = true;
+            takes_value = false;
+        } else if (!value) {
+            fprintf(stderr, "Missing value for [%s]\n", argv[i]);
+            return false;
+        } else if (arg == "--device") {
+            options->devices.push_back(value);
+        } else if (arg == "--plan") {
+            if (!parse_plan(value, &options->plan)) {
+                fprintf(stderr, "Invalid plan [%s]\n", value);
+                return false;
+            }
+        } else if (arg == "--encoding") {
+            for (u8 e = 0; e <= (u8)PixelEncoding::MAX; ++e) {
+                if (strcmp(value, get_pixel_encoding_name((PixelEncoding)e)) == 0) {
+                    options->encoding = (PixelEncoding)e;
+                    options->set_encoding = true;
+                }
+            }
+            if (!options->set_encoding) {
+                fprintf(stderr, "Unknown pixel encoding [%s]\n", value);
+                return false;
+            }
+        } else if (arg == "--capture") {
+            options->capture_path = value;
+        } else if (arg == "--duration") {
+            options->duration_s = atof(value);
+        } else if (arg == "--from" || arg == "--to") {
+            if (!parse_date(value, arg == "--from" ? &options->list_from : &options->list_to)) {
+                fprintf(stderr, "Invalid date [%s]\n", value);
+                return false;
+            }
+        } else {
+            fprintf(stderr, "Unknown argument [%s]\n", argv[i]);
+            return false;
+        }
+
+        i += takes_value ? 1 : 0;
+    }
+
+    return options->list || options->ports || !options->devices.empty();
+}
+
+static void list_results(const HeadlessOptions *options)
+{
+    using namespace std::chrono;
+
+    // Timestamps are stored as local time, same as the UI filters them
+    auto start = time_point_cast<seconds>(local_days(options->list_from)).time_since_epoch();
+    auto end = time_point_cast<seconds>(local_days(options->list_to) + days(1)).time_since_epoch() - seconds(1);
+
+    CCDOperationStore ops;
+    db_ccd_result_get_by_time_range(start, end, &ops);
+
+    printf("id,device_id,timestamp,exposure_us,iterations,pixels,name,note\n");
+    for (u32 row = 0; row < ccd_store_size(&ops); ++row) {
+        auto line = std::format("{},{},{:%Y-%m-%d %H:%M:%S},{},{},{},\"{}\",\"{}\"\n",
+                                ops.ids[row],
+                                ops.device_ids[row],
+                                ops.timestamps[row],
+                                ops.exposures[row],
+                                ops.iterations[row],
+                                ops.pixel_counts[row],
+                                ops.names[row],
+                                ops.notes[row]);
+        fwrite(line.data(), 1, line.size(), stdout);
+    }
+}
+
+static bool is_acquisition_done(const Comms *comms)
+{
+    for (const DeviceConnection &conn : comms->connections) {
+        if (conn.acquisition.running || !conn.pending_commands.empty()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool are_all_devices_lost(const Comms *comms)
+{
+    for (const DeviceConnection &conn : comms->connections) {
+        if (!get_device_stats(&conn).lost) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int run_headless(const HeadlessOptions *options)
+{
+    using namespace std::chrono;
+
+    App app;
+    // Nothing here looks at pixels, the cache only has to hold the last result
+    app.ccd_pixels.budget_bytes = 0;
+    load_correction_frames(&app);
+    Comms comms;
+    comms.capture_path = options->capture_path;
+
+    for (std::string_view device : options->devices) {
+        queue_command({.type = AppCommand::ConnectToDevice, .data{.com_path = device}});
+    }
+    handle_commands(&app, &comms);
+    if (comms.connections.size() != options->devices.size()) {
+        LOG_ERROR("Connected to [{}] of [{}] devices", comms.connections.size(), options->devices.size());
+        close_com_connection(&comms);
+        return 1;
+    }
+
+    for (const DeviceConnection &conn : comms.connections) {
+        if (options->set_encoding) {
+            queue_command(
+                {.type = AppCommand::SetPixelEncoding, .data{.pixel_encoding = {conn.device_id, options->encoding}}});
+        }
+        if (!options->plan.empty()) {
+            queue_command({
+                .type = AppCommand::StartAcquisition,
+                .data{.acquisition = {conn.device_id, options->plan.data(), (u32)options->plan.size()}},
+            });
+        }
+    }
+
+    auto started_at = steady_clock::now();
+    auto stop_at = steady_clock::time_point::max();
+    if (options->duration_s > 0) {
+        stop_at = started_at + duration_cast<steady_clock::duration>(duration<f64>(options->duration_s));
+    }
+    u64 stored_results = 0;
+    int exit_code = 0;
+    bool first_tick = true;
+    while (!gStop.load()) {
+        if (!first_tick) {
+            auto wake_at = std::min({get_next_deadline(&comms), stop_at, steady_clock::now() + kIdleTimeout});
+            std::unique_lock lock(gWakeMutex);
+            gWakeCondition.wait_until(lock, wake_at, [] { return gWoken; });
+            gWoken = false;
+        }
+        first_tick = false;
+        gWakeArmed.store(true);
+
+        handle_incomming_data(&comms);
+        handle_commands(&app, &comms);
+        // Already on their way to the db and nothing here looks at them, keeping them would only grow
+        stored_results += ccd_store_size(&app.ccd_operations);
+        ccd_store_clear(&app.ccd_operations);
+
+        if (!options->plan.empty() && is_acquisition_done(&comms)) {
+            break;
+        }
+        if (steady_clock::now() >= stop_at) {
+            break;
+        }
+        if (are_all_devices_lost(&comms)) {
+            LOG_ERROR("Every device is gone, stopping");
+            exit_code = 1;
+            break;
+        }
+    }
+
+    for (const DeviceConnection &conn : comms.connections) {
+        DeviceStats stats = get_device_stats(&conn);
+        LOG_NORM("Device [{}] ([{}]): [{}] frames, [{}] crc errors, [{}] command timeouts",
+                 conn.device_id,
+                 conn.com_path,
+                 stats.rx_frames,
+                 stats.rx_crc_errors,
+                 stats.command_timeouts);
+    }
+    close_com_connection(&comms);
+
+    db_flush();
+    DBWriterStats db_stats = db_get_writer_stats();
+    LOG_NORM("Stored [{}] results in [{:.1f}] s, [{}] corrected, [{}] failed writes",
+             stored_results,
+             duration<f64>(steady_clock::now() - started_at).count(),
+             app.corrected_results,
+             db_stats.failed_writes);
+    return exit_code;
+}
+
+int main(int argc, char **argv)
+{
+    HeadlessOptions options;
+    if (!parse_args(argc, argv, &options)) {
+        print_usage();
+        return 1;
+    }
+
+    if (options.ports) {
+        std::vector<ComPort> ports;
+        enumerate_com_ports(&ports);
+        for (const ComPort &port : ports) {
+            printf("%s\t%s\n", port.com_path.c_str(), port.friendly_name.c_str());
+        }
+        return 0;
+    }
+
+    log_keep_lines(false);
+    if (!db_open()) {
+        return 1;
+    }
+    _defer
+    {
+        db_close();
+    };
+
+    if (options.list) {
+        list_results(&options);
+        return 0;
+    }
+
+    std::signal(SIGINT, [](int) { gStop.store(true); });
+    return run_headless(&options);
+}
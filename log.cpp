@@ -1,11 +1,24 @@
 #include "log.hpp"
 #include "shorthand.hpp"
 
+#include <algorithm>
+#include <mutex>
+
 static std::vector<LogEntry> s_logs;
+// The worker pool, the db writer and the pixel loader all log, any of them can grow the vector while the UI reads it
+static std::mutex s_logs_mutex;
+// Only read by log_impl, set before any other thread is around
+static bool s_keep_lines = true;
+
+void log_keep_lines(bool keep)
+{
+    s_keep_lines = keep;
+}
 
-const std::vector<LogEntry> &get_log_lines()
+void get_log_lines(std::vector<LogEntry> *lines)
 {
-    return s_logs;
+    std::lock_guard lock(s_logs_mutex);
+    lines->insert(lines->end(), s_logs.begin() + std::min(lines->size(), s_logs.size()), s_logs.end());
 }
 
 void log_impl(
@@ -13,7 +26,11 @@ void log_impl(
 {
     // TODO remove this line?
     fprintf(stderr, "[%.*s:%d] %s\n", (u32)func.size(), func.data(), line, msg.c_str());
+    if (!s_keep_lines) {
+        return;
+    }
 
+    std::lock_guard lock(s_logs_mutex);
     s_logs.emplace_back(std::string{file},
                         std::string{func},
                         line,
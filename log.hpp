@@ -3,6 +3,7 @@
 // TOCO this logger is ASS
 #include "shorthand.hpp"
 #include <chrono>
+#include <format>
 #include <string>
 #include <vector>
 
@@ -31,13 +32,19 @@ struct LogEntry {
     std::string msg;
 };
 
+// Thread safe
 void log_impl(
     LogContext ctx, std::string_view file, std::string_view func, int line, LogSeverity severity, std::string &&msg);
-const std::vector<LogEntry> &get_log_lines();
+// Copies the lines logged since the last call to the end of `lines`. Lines are never dropped, so handing it the same
+// vector every time keeps it a full copy without copying everything again
+void get_log_lines(std::vector<LogEntry> *lines);
+// Lines are always printed, keeping them is for the UI. Headless runs turn it off so a long run doesn't grow forever.
+// Call it before anything logs from another thread
+void log_keep_lines(bool keep);
 
 #define LOG_DEBUG(msg, ...) \
-    log_impl(LogContext::APP, __FILE__, __FUNCTION__, __LINE__, LogSeverity::DEBUG, std::format(msg, __VA_ARGS__));
+    log_impl(LogContext::APP, __FILE__, __FUNCTION__, __LINE__, LogSeverity::DEBUG, std::format(msg, ##__VA_ARGS__));
 #define LOG_NORM(msg, ...) \
-    log_impl(LogContext::APP, __FILE__, __FUNCTION__, __LINE__, LogSeverity::NORM, std::format(msg, __VA_ARGS__));
+    log_impl(LogContext::APP, __FILE__, __FUNCTION__, __LINE__, LogSeverity::NORM, std::format(msg, ##__VA_ARGS__));
 #define LOG_ERROR(msg, ...) \
-    log_impl(LogContext::APP, __FILE__, __FUNCTION__, __LINE__, LogSeverity::ERROR_, std::format(msg, __VA_ARGS__));
+    log_impl(LogContext::APP, __FILE__, __FUNCTION__, __LINE__, LogSeverity::ERROR_, std::format(msg, ##__VA_ARGS__));
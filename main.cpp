@@ -9,9 +9,13 @@
 #include "app.hpp"
 #include "db.hpp"
 
+#include <algorithm>
+#include <atomic>
 #include <cstdio>
 
+#if _WIN32
 #include "windows.h"
+#endif
 
 #include <GLFW/glfw3.h> // Will drag system OpenGL headers
 
@@ -24,6 +28,80 @@ static GLFWwindow *gWindow;
 static constexpr char kDefaultWindowName[] = "Controller App";
 void draw_ui(App *, Comms *);
 
+// ImGui only reacts to an input on the frame after it sees it and things like hovering or opening popups take another
+// one to settle, so every event keeps drawing for a few frames
+static constexpr u32 kFramesAfterEvent = 3;
+// Longest the main loop sleeps with nothing happening. A focused text field wakes up often enough to blink the cursor
+static constexpr f64 kIdleTimeout = 1.0;
+static constexpr f64 kCursorBlinkTimeout = 0.4;
+
+// Set once the main loop has looked at the rings and the command queue. The first wake after that posts an event,
+// everything else that arrives before the loop gets to it is handled by the same iteration
+static std::atomic<bool> gWakeArmed = false;
+// Resizes and exposes need a redraw but don't go through ImGui
+static bool gWindowDamaged = false;
+// Mouse, keyboard and focus events since the last loop iteration
+static bool gHadInput = false;
+static FrameStats gFrameStats;
+
+void wake_main_loop()
+{
+    if (gWakeArmed.exchange(false)) {
+        glfwPostEmptyEvent();
+    }
+}
+
+FrameStats get_frame_stats()
+{
+    return gFrameStats;
+}
+
+static void window_damaged_callback(GLFWwindow *)
+{
+    gWindowDamaged = true;
+}
+
+static void framebuffer_size_callback(GLFWwindow *, int, int)
+{
+    gWindowDamaged = true;
+}
+
+// Installed before ImGui's backend, which puts its own on top and calls these after it
+static void cursor_pos_callback(GLFWwindow *, double, double)
+{
+    gHadInput = true;
+}
+
+static void cursor_enter_callback(GLFWwindow *, int)
+{
+    gHadInput = true;
+}
+
+static void mouse_button_callback(GLFWwindow *, int, int, int)
+{
+    gHadInput = true;
+}
+
+static void scroll_callback(GLFWwindow *, double, double)
+{
+    gHadInput = true;
+}
+
+static void key_callback(GLFWwindow *, int, int, int, int)
+{
+    gHadInput = true;
+}
+
+static void char_callback(GLFWwindow *, unsigned int)
+{
+    gHadInput = true;
+}
+
+static void window_focus_callback(GLFWwindow *, int)
+{
+    gHadInput = true;
+}
+
 void set_window_title(std::string_view title)
 {
     auto new_title = std::format("{} - {}", kDefaultWindowName, title);
@@ -32,9 +110,11 @@ void set_window_title(std::string_view title)
 
 int app_main()
 {
+#if _WIN32
     AllocConsole();
     freopen("CONOUT$", "w", stdout);
     freopen("CONOUT$", "w", stderr);
+#endif
 
     if (!db_open()) {
         return -1;
@@ -58,6 +138,15 @@ int app_main()
 
     glfwMakeContextCurrent(gWindow);
     glfwSwapInterval(1); // Enable vsync
+    glfwSetWindowRefreshCallback(gWindow, window_damaged_callback);
+    glfwSetFramebufferSizeCallback(gWindow, framebuffer_size_callback);
+    glfwSetCursorPosCallback(gWindow, cursor_pos_callback);
+    glfwSetCursorEnterCallback(gWindow, cursor_enter_callback);
+    glfwSetMouseButtonCallback(gWindow, mouse_button_callback);
+    glfwSetScrollCallback(gWindow, scroll_callback);
+    glfwSetKeyCallback(gWindow, key_callback);
+    glfwSetCharCallback(gWindow, char_callback);
+    glfwSetWindowFocusCallback(gWindow, window_focus_callback);
 
     // Setup Dear ImGui context
     IMGUI_CHECKVERSION();
@@ -78,26 +167,58 @@ int app_main()
     Comms comms;
 
     enumerate_com_ports(&comms.enumerated_ports);
-    comms.read_data_buffer = (u8 *)calloc(1, Comms::kReadDataMaxSize);
 
-    db_ccd_result_get_all(&app.ccd_operations);
+    // Only the last few days, older results get paged in from the Results tab
+    load_recent_ccd_operations(&app);
+    load_correction_frames(&app);
 
+    u32 frames_to_draw = kFramesAfterEvent;
     while (!glfwWindowShouldClose(gWindow)) {
-        glfwPollEvents();
+        // Sleeps until there is input, data from a device or a command from another thread. Frames still owed to
+        // the last event don't wait
+        if (frames_to_draw == 0) {
+            f64 timeout = ImGui::GetIO().WantTextInput ? kCursorBlinkTimeout : kIdleTimeout;
+            // Delays and timeouts run out without anything waking the loop up
+            auto deadline = get_next_deadline(&comms);
+            if (deadline != std::chrono::steady_clock::time_point::max()) {
+                auto until = deadline - std::chrono::steady_clock::now();
+                timeout = std::min(std::chrono::duration<f64>(until).count(), timeout);
+            }
+            // glfw only takes positive timeouts
+            if (timeout > 0) {
+                glfwWaitEventsTimeout(timeout);
+            } else {
+                glfwPollEvents();
+            }
+        } else {
+            glfwPollEvents();
+        }
+        gWakeArmed.store(true);
+
+        // Devices keep being read while minimized, there is just nothing to draw
+        u32 new_bytes = handle_incomming_data(&comms);
+        u32 handled_commands = handle_commands(&app, &comms);
+
+        bool has_input = gHadInput || gWindowDamaged;
+        gHadInput = false;
+        gWindowDamaged = false;
+        if (has_input || new_bytes != 0 || handled_commands != 0) {
+            frames_to_draw = kFramesAfterEvent;
+        } else if (frames_to_draw == 0 && ImGui::GetIO().WantTextInput) {
+            frames_to_draw = 1;
+        }
 
-        if (glfwGetWindowAttrib(gWindow, GLFW_ICONIFIED) != 0) {
-            ImGui_ImplGlfw_Sleep(10);
+        if (frames_to_draw == 0 || glfwGetWindowAttrib(gWindow, GLFW_ICONIFIED) != 0) {
+            frames_to_draw = 0;
+            gFrameStats.frames_skipped++;
             continue;
         }
+        frames_to_draw--;
 
         ImGui_ImplOpenGL3_NewFrame();
         ImGui_ImplGlfw_NewFrame();
         ImGui::NewFrame();
 
-        comms.read_data_size += handle_incomming_data(
-            comms.com_connection, comms.read_data_buffer, comms.read_data_size, Comms::kReadDataMaxSize);
-
-        handle_commands(&app, &comms);
         draw_ui(&app, &comms);
 
         ImGui::Render();
@@ -109,8 +230,14 @@ int app_main()
         ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
 
         glfwSwapBuffers(gWindow);
+        gFrameStats.frames_rendered++;
     }
 
+    // Reader threads wake the main loop up, they have to be gone before glfw is
+    gWakeArmed.store(false);
+    close_com_connection(&comms);
+    pixel_loader_shutdown();
+
     ImPlot::DestroyContext();
 
     ImGui_ImplOpenGL3_Shutdown();
@@ -134,4 +261,8 @@ int WINAPI WinMain(HINSTANCE, HINSTANCE, PSTR, int)
     app_main();
 }
 #else
+int main()
+{
+    return app_main();
+}
 #endif
@@ -0,0 +1,127 @@
+#pragma once
+#include "shorthand.hpp"
+
+#include <atomic>
+#include <cstring>
+#include <new>
+#include <type_traits>
+
+// Bounded lock-free multi producer / single consumer queue.
+// Every slot has a sequence number that says whose turn it is: `pos` means free for the producer that reserves
+// position `pos`, `pos + 1` means that producer published it and the consumer can take it. The consumer hands the
+// slot back for the next lap by setting it to `pos + capacity`. Producers reserve positions with a CAS on
+// `write_pos`, the consumer is the only one moving `read_pos` so it doesn't need one.
+// Positions are free running u32 counters like in SPSCRing, so the capacity has to be a power of two.
+template <typename T>
+struct MPSCQueue {
+    static_assert(std::is_trivially_copyable_v<T>);
+
+    // Raw storage, T doesn't need a default constructor. Items are memcpy'd in, which is fine for trivially copyable
+    // types
+    struct Slot {
+        std::atomic<u32> sequence;
+        alignas(T) u8 value[sizeof(T)];
+    };
+
+    Slot *slots = nullptr;
+    u32 capacity = 0;
+
+    // Producers and the consumer each get their own cache line
+    alignas(64) std::atomic<u32> write_pos = 0;
+    // Times a producer lost the race for `write_pos` and had to retry, a measure of contention
+    std::atomic<u64> push_retries = 0;
+    alignas(64) u32 read_pos = 0;
+};
+
+template <typename T>
+inline bool mpsc_queue_init(MPSCQueue<T> *queue, u32 capacity)
+{
+    ASSERT((capacity & (capacity - 1)) == 0);
+    queue->slots = new (std::nothrow) typename MPSCQueue<T>::Slot[capacity];
+    if (!queue->slots) {
+        return false;
+    }
+    for (u32 i = 0; i < capacity; ++i) {
+        queue->slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    queue->capacity = capacity;
+    queue->write_pos.store(0, std::memory_order_relaxed);
+    queue->read_pos = 0;
+    return true;
+}
+
+template <typename T>
+inline void mpsc_queue_free(MPSCQueue<T> *queue)
+{
+    delete[] queue->slots;
+    queue->slots = nullptr;
+    queue->capacity = 0;
+}
+
+////////////////////////////////////////////////////////////////
+//// Producer side, any thread
+////////////////////////////////////////////////////////////////
+
+// Pushes all of `items` as one batch or nothing when there isn't room for all of them. A batch takes a single CAS
+// and always comes out in order without anything from other producers in between
+template <typename T>
+inline bool mpsc_queue_push(MPSCQueue<T> *queue, const T *items, u32 count)
+{
+    if (count == 0 || count > queue->capacity) {
+        return count == 0;
+    }
+
+    u32 pos = queue->write_pos.load(std::memory_order_relaxed);
+    while (true) {
+        // The consumer frees slots in order, so once the last slot of the batch is free for this lap all the ones
+        // before it are too
+        u32 last = pos + count - 1;
+        u32 sequence = queue->slots[last & (queue->capacity - 1)].sequence.load(std::memory_order_acquire);
+        s32 diff = (s32)(sequence - last);
+        if (diff < 0) {
+            // Still holds something from the previous lap
+            return false;
+        }
+        if (diff == 0 && queue->write_pos.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed)) {
+            break;
+        }
+        if (diff > 0) {
+            // Someone else already took these positions
+            pos = queue->write_pos.load(std::memory_order_relaxed);
+        }
+        queue->push_retries.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    for (u32 i = 0; i < count; ++i) {
+        typename MPSCQueue<T>::Slot *slot = &queue->slots[(pos + i) & (queue->capacity - 1)];
+        memcpy(slot->value, &items[i], sizeof(T));
+        slot->sequence.store(pos + i + 1, std::memory_order_release);
+    }
+    return true;
+}
+
+////////////////////////////////////////////////////////////////
+//// Consumer side, a single thread
+////////////////////////////////////////////////////////////////
+
+// Next item in place, nullptr when the queue is empty or when the next item was reserved but isn't published yet.
+// Everything behind it waits for it, so batches and the order of each producer are kept
+template <typename T>
+inline const T *mpsc_queue_peek(MPSCQueue<T> *queue)
+{
+    u32 pos = queue->read_pos;
+    typename MPSCQueue<T>::Slot *slot = &queue->slots[pos & (queue->capacity - 1)];
+    if (slot->sequence.load(std::memory_order_acquire) != pos + 1) {
+        return nullptr;
+    }
+    return (const T *)slot->value;
+}
+
+// Hands the slot returned by mpsc_queue_peek back to the producers
+template <typename T>
+inline void mpsc_queue_release(MPSCQueue<T> *queue)
+{
+    u32 pos = queue->read_pos;
+    queue->slots[pos & (queue->capacity - 1)].sequence.store(pos + queue->capacity, std::memory_order_release);
+    queue->read_pos = pos + 1;
+}
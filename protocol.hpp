@@ -0,0 +1,885 @@
+#pragma once
+#include "shorthand.hpp"
+
+#include "cobs.hpp"
+#include "crc.hpp"
+#include "varint.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <span>
+#include <tuple>
+#include <type_traits>
+
+// Wire protocol shared by the controller and the device simulator.
+// Every message is a varint serialized Payload, COBS encoded and terminated by a 0x00 delimiter.
+// Device to host payloads end with the CRC-32 of everything before it (see append_frame_crc) once the device said it
+// adds one in its Info. Host to device commands have a CRC-16/CCITT of the fields before it as their last field.
+
+enum class HostToDeviceCommand : u8 {
+    GetInfo,
+    CCDSensor,
+    // Picks how the device sends pixels from now on, followed by a PixelEncoding
+    SetPixelEncoding,
+};
+
+enum class PixelEncoding : u8 {
+    Absolute, // CCDResult
+    Delta,    // CCDResultDelta
+    Packed,   // CCDResultPacked
+
+    MAX = Packed,
+};
+
+inline const char *get_pixel_encoding_name(PixelEncoding encoding)
+{
+    switch (encoding) {
+        case PixelEncoding::Absolute:
+            return "absolute";
+        case PixelEncoding::Delta:
+            return "delta";
+        case PixelEncoding::Packed:
+            return "packed";
+    }
+    return "unknown";
+}
+
+// Largest CCD the device can have attached
+inline constexpr u32 kMaxPixelCount = 5000;
+// Payload::len is a u16
+inline constexpr u32 kMaxPayloadSize = u16Max;
+
+enum class DeviceToHostResponse : u8 {
+    CCDResult,
+    Log,
+    // Same fields as CCDResult, but every pixel is the signed (zig-zag) varint of its difference to the previous one.
+    // Neighbouring pixels are close so most of them fit in a single byte
+    CCDResultDelta,
+    // Pixels as a PackedArray<u32>. Twice the bytes of a varint for 12 bit values, but the host doesn't decode them
+    // at all, meant for links where bandwidth isn't the problem
+    CCDResultPacked,
+    // Answer to GetInfo, see InfoMessage
+    Info,
+};
+
+// Optional parts of the protocol, InfoMessage::capabilities has a bit for each. Firmware that doesn't answer GetInfo
+// has none of them
+enum class DeviceCapability : u32 {
+    // Understands SetPixelEncoding
+    PixelEncoding = 1 << 0,
+    // Every frame after its first Info ends with the append_frame_crc trailer
+    FrameCrc = 1 << 1,
+};
+
+inline bool has_capability(u32 capabilities, DeviceCapability capability)
+{
+    return (capabilities & (u32)capability) != 0;
+}
+
+inline constexpr u32 get_cobs_overhead(u32 len)
+{
+    return 1 + (len + 253) / 254;
+}
+
+inline constexpr u32 get_max_encoded_size(u32 payload_len)
+{
+    u32 cmd_size = 1                        // type
+                   + 2 * (payload_len != 0) // payload_Len
+                   + payload_len            // payload
+                   + 2;                     // crc
+
+    return cmd_size + get_cobs_overhead(cmd_size) + 2 /*frame markers*/;
+}
+
+// Scalar reference implementations, one byte per step. The block versions below have to produce the exact same output
+inline u32 cobs_decode_scalar(const u8 *data, u32 data_len, u8 *output, u32 output_len)
+{
+    u8 *output_it = output;
+
+    u8 distance_to_next_0 = 1;
+    bool is_delimiter = true;
+
+    const u8 *data_it = data;
+    while (data_it != data + data_len) {
+        if (output_it >= output + output_len) {
+            return -1;
+        }
+
+        if (distance_to_next_0 == 1) {
+            if (!is_delimiter) {
+                *output_it++ = 0;
+            }
+            distance_to_next_0 = *data_it;
+            is_delimiter = distance_to_next_0 == 0xFF;
+        } else {
+            *output_it = *data_it;
+            output_it++;
+            distance_to_next_0--;
+        }
+
+        data_it++;
+    }
+
+    return output_it - output;
+}
+
+struct CobsCtx {
+    u8 *output_buffer = nullptr;
+    u8 *output_it = nullptr;
+    u8 *code_byte = nullptr;
+    u8 distance_to_last_0;
+    u32 output_len;
+};
+
+inline CobsCtx cobs_encode_init(u8 *output_buffer, u32 output_len)
+{
+    return {output_buffer, output_buffer + 1, output_buffer, 1, output_len};
+};
+
+inline u32 cobs_encode_end(CobsCtx *ctx)
+{
+    *ctx->code_byte = ctx->distance_to_last_0;
+    if ((u32)(ctx->output_it - ctx->output_buffer) >= ctx->output_len) {
+        return u32Max;
+    }
+
+    *ctx->output_it = '\0';
+    ctx->output_it++;
+
+    return ctx->output_it - ctx->output_buffer;
+}
+
+inline bool cobs_encode_scalar(CobsCtx *ctx, const void *data, u32 data_len)
+{
+    u8 *data_it = (u8 *)data;
+    while (data_it != (u8 *)data + data_len) {
+        if ((u32)(ctx->output_it - ctx->output_buffer) >= ctx->output_len) {
+            return false;
+        }
+
+        // A full block has to be closed before looking at the byte, otherwise a 0 right after 254 non zero bytes gets
+        // swallowed by the 0xFF code, which doesn't stand for a zero
+        if (ctx->distance_to_last_0 == 0xFF) {
+            *ctx->code_byte = ctx->distance_to_last_0;
+            ctx->distance_to_last_0 = 1;
+            ctx->code_byte = ctx->output_it;
+        } else if (*data_it == 0) {
+            *ctx->code_byte = ctx->distance_to_last_0;
+            ctx->distance_to_last_0 = 1;
+            ctx->code_byte = ctx->output_it;
+            data_it++;
+        } else {
+            *ctx->output_it = *data_it;
+            ctx->distance_to_last_0++;
+            data_it++;
+        }
+
+        ctx->output_it++;
+    }
+
+    return true;
+}
+
+// Works a whole block at a time: each code byte says how many literal bytes follow, and those get copied in one go
+inline u32 cobs_decode(const u8 *data, u32 data_len, u8 *output, u32 output_len)
+{
+    const u8 *data_it = data;
+    const u8 *data_end = data + data_len;
+    u8 *output_it = output;
+    u8 *output_end = output + output_len;
+
+    // The zero a code byte stands for only shows up if another block follows it
+    bool pending_zero = false;
+    while (data_it != data_end) {
+        if (output_it >= output_end) {
+            return -1;
+        }
+        if (pending_zero) {
+            *output_it++ = 0;
+        }
+
+        u8 code = *data_it++;
+        // A 0 code can only come from garbage, the reference treats it as a 255 byte run so do the same
+        u32 run = std::min<u32>((u8)(code - 1), (u32)(data_end - data_it));
+        if (run > (u32)(output_end - output_it)) {
+            return -1;
+        }
+        memcpy(output_it, data_it, run);
+        output_it += run;
+        data_it += run;
+        pending_zero = code != 0xFF;
+    }
+
+    return output_it - output;
+}
+
+// Scans for the next zero with SSE2 and copies everything up to it in one go. Same output as cobs_encode_scalar, and
+// like it, it can be called several times on the same context to encode a message made of several pieces
+inline bool cobs_encode(CobsCtx *ctx, const void *data, u32 data_len)
+{
+    const u8 *data_it = (const u8 *)data;
+    const u8 *data_end = data_it + data_len;
+    u8 *output_end = ctx->output_buffer + ctx->output_len;
+
+    while (data_it != data_end) {
+        if (ctx->distance_to_last_0 == 0xFF) {
+            // Block is full, a new one only starts when there is more data
+            if (ctx->output_it >= output_end) {
+                return false;
+            }
+            *ctx->code_byte = 0xFF;
+            ctx->distance_to_last_0 = 1;
+            ctx->code_byte = ctx->output_it++;
+            continue;
+        }
+
+        u32 run = std::min<u32>(0xFF - ctx->distance_to_last_0, (u32)(data_end - data_it));
+        u32 literal = cobs_find_zero(data_it, run);
+        bool found_zero = literal < run;
+        if (literal + found_zero > (u32)(output_end - ctx->output_it)) {
+            return false;
+        }
+
+        memcpy(ctx->output_it, data_it, literal);
+        ctx->output_it += literal;
+        data_it += literal;
+        ctx->distance_to_last_0 += literal;
+
+        if (found_zero) {
+            *ctx->code_byte = ctx->distance_to_last_0;
+            ctx->distance_to_last_0 = 1;
+            ctx->code_byte = ctx->output_it++;
+            data_it++;
+        }
+    }
+
+    return true;
+}
+
+// Incremental decoder for a byte stream of delimited frames. Bytes can be fed in whatever pieces they arrive in, the
+// state of the block being decoded carries over between calls, and every byte is looked at once: the zero scan that
+// finds the delimiter is the same pass that moves the literals to the output.
+struct CobsDecodeCtx {
+    u8 *output_buffer = nullptr;
+    u8 *output_it = nullptr;
+    u32 output_len = 0;
+    // Literal bytes left in the current block, 0 means the next byte is a code byte (or the delimiter)
+    u8 block_left = 0;
+    // The block being decoded stands for a trailing zero, which is only written if another block follows
+    bool pending_zero = false;
+    // The frame didn't fit in the output. Everything up to the delimiter gets dropped
+    bool overflow = false;
+};
+
+inline CobsDecodeCtx cobs_decode_init(u8 *output_buffer, u32 output_len)
+{
+    return {output_buffer, output_buffer, output_len};
+}
+
+// Gets the context ready for the next frame once the caller is done with the output of the previous one
+inline void cobs_decode_reset(CobsDecodeCtx *ctx)
+{
+    ctx->output_it = ctx->output_buffer;
+    ctx->block_left = 0;
+    ctx->pending_zero = false;
+    ctx->overflow = false;
+}
+
+inline u32 cobs_decoded_size(const CobsDecodeCtx *ctx)
+{
+    return ctx->output_it - ctx->output_buffer;
+}
+
+// Decodes `data` until it runs out or a delimiter shows up and returns the amount of bytes consumed. On a delimiter
+// `frame_done` is set and the output holds the whole frame (unless `overflow` is set), exactly what cobs_decode
+// would give for the bytes before the delimiter. The caller has to call cobs_decode_reset before feeding the rest.
+// The output can be the input itself, or start a few bytes before it: it never gets ahead of what was read, the code
+// byte of every block is consumed before its literals get written one byte further back
+inline u32 cobs_decode_stream(CobsDecodeCtx *ctx, const u8 *data, u32 len, bool *frame_done)
+{
+    const u8 *data_it = data;
+    const u8 *data_end = data + len;
+    u8 *output_end = ctx->output_buffer + ctx->output_len;
+    *frame_done = false;
+
+    while (data_it != data_end) {
+        if (ctx->block_left == 0) {
+            u8 code = *data_it++;
+            if (code == 0) {
+                *frame_done = true;
+                break;
+            }
+            if (ctx->pending_zero) {
+                if (ctx->output_it < output_end) {
+                    *ctx->output_it++ = 0;
+                } else {
+                    ctx->overflow = true;
+                }
+            }
+            ctx->block_left = code - 1;
+            ctx->pending_zero = code != 0xFF;
+            continue;
+        }
+
+        u32 available = std::min<u32>(ctx->block_left, (u32)(data_end - data_it));
+        u32 literal = cobs_find_zero(data_it, available);
+        u32 room = (u32)(output_end - ctx->output_it);
+        if (literal > room) {
+            ctx->overflow = true;
+        }
+        u32 copy = std::min(literal, room);
+        memmove(ctx->output_it, data_it, copy);
+        ctx->output_it += copy;
+        data_it += literal;
+        ctx->block_left -= literal;
+
+        // A delimiter in the middle of a block means the frame was cut short. It still ends here, same as when the
+        // frame gets split on delimiters first and then decoded
+        if (literal < available) {
+            data_it++;
+            *frame_done = true;
+            break;
+        }
+    }
+
+    return data_it - data;
+}
+
+struct Payload {
+    u8 *data;
+    u8 *cursor;
+    u16 len;
+};
+
+inline constexpr u32 kFrameCrcSize = 4;
+
+inline u16 get_size(Payload *payload)
+{
+    u16 size = payload->data < payload->cursor ? payload->cursor - payload->data : payload->data - payload->cursor;
+    return size;
+}
+
+inline bool reached_end(Payload *payload)
+{
+    return payload->data + payload->len == payload->cursor;
+}
+
+inline bool ensure_capacity(Payload *payload, u32 desired_cap)
+{
+    u16 used = get_size(payload);
+    u16 left = payload->len - used;
+    return left >= desired_cap;
+}
+
+// Bytes left to read
+inline u32 get_remaining(Payload *payload)
+{
+    return (u32)(payload->data + payload->len - payload->cursor);
+}
+
+// Most bytes a varint of T can take, 5 for 32 bit and 10 for 64 bit
+template <typename T>
+inline constexpr u32 kMaxVarintSize = (sizeof(T) * 8 + 6) / 7;
+
+template <typename T>
+typename std::enable_if_t<std::is_unsigned_v<T>> serialize_varint(Payload *payload, T number)
+{
+    do {
+        *payload->cursor = ((u8)number & 0b0111'1111) | (u8)((!!(number >> 7)) << 7);
+        payload->cursor++;
+        number >>= 7;
+    } while (number);
+}
+
+template <typename T>
+typename std::enable_if_t<std::is_signed_v<T>> serialize_varint(Payload *payload, T number)
+{
+    std::make_unsigned_t<T> zig_zag = (number >> (sizeof(number) * 8 - 1)) ^ (number << 1);
+    serialize_varint(payload, zig_zag);
+}
+
+template <typename T>
+typename std::enable_if_t<std::is_integral_v<T>, bool> serialize(Payload *payload, T number)
+{
+    if (!ensure_capacity(payload, kMaxVarintSize<T>)) {
+        return false;
+    }
+    // ensure_capacity(payload, 1 /*Tag*/ + kMaxVarintSize<T>))
+    // serialize(payload, SerializedFieldTag::VarInt);
+    serialize_varint(payload, number);
+    return true;
+}
+
+template <typename T>
+typename std::enable_if_t<std::is_enum_v<T>, bool> serialize(Payload *payload, T number)
+{
+    return serialize(payload, static_cast<std::underlying_type_t<T>>(number));
+}
+
+inline bool serialize(Payload *payload, const byte *data, u32 len)
+{
+    // ensure_capacity(payload, 1 /*Tag*/ + 5 /*Worst case for u32 Len*/);
+    if (!ensure_capacity(payload, 5 + len)) {
+        return false;
+    }
+    // serialize(payload, SerializedFieldTag::DataWithLen);
+    serialize_varint(payload, len);
+    memcpy(payload->cursor, data, len);
+    payload->cursor += len;
+    return true;
+}
+
+template <typename T>
+typename std::enable_if_t<std::is_unsigned_v<T>, bool> deserialize_varint(Payload *payload, T *number)
+{
+    if (reached_end(payload)) {
+        return false;
+    }
+
+    *number = *payload->cursor & 0b0111'1111;
+    for (u32 i = 7; *payload->cursor & 0b1000'0000; i += 7) {
+        payload->cursor++;
+        // Corrupted frames can have a continuation bit on the last byte or more groups than fit in T
+        if (reached_end(payload) || i >= sizeof(T) * 8) {
+            return false;
+        }
+        *number |= (T)(*(payload->cursor) & 0b0111'1111) << i;
+    }
+    payload->cursor++;
+    return true;
+}
+
+template <typename T>
+typename std::enable_if_t<std::is_signed_v<T>, bool> deserialize_varint(Payload *payload, T *number)
+{
+    // Undone on the unsigned value, an arithmetic shift would smear the top bit for the most negative numbers
+    std::make_unsigned_t<T> zig_zag;
+    if (deserialize_varint(payload, &zig_zag)) {
+        *number = (T)((zig_zag >> 1) ^ (0 - (zig_zag & 1)));
+        return true;
+    }
+    return false;
+}
+
+// Same as deserialize_varint without looking for the end of the payload, the caller has to know there are at least
+// kMaxVarintSize<T> bytes left. Still fails on varints with more groups than fit in T
+template <typename T>
+inline bool deserialize_varint_unchecked(Payload *payload, T *number)
+{
+    using U = std::make_unsigned_t<T>;
+    U value = 0;
+    for (u32 shift = 0; shift < sizeof(T) * 8; shift += 7) {
+        u8 byte = *payload->cursor++;
+        value |= (U)(byte & 0b0111'1111) << shift;
+        if (!(byte & 0b1000'0000)) {
+            if constexpr (std::is_signed_v<T>) {
+                *number = (T)((value >> 1) ^ (0 - (value & 1)));
+            } else {
+                *number = value;
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+template <typename T>
+typename std::enable_if_t<std::is_integral_v<T>, bool> deserialize(Payload *payload, T *number)
+{
+    // if (read_tag(payload) != SerializedFieldTag::VarInt) {
+    //     return false;
+    // }
+
+    return deserialize_varint(payload, number);
+}
+
+inline bool deserialize(Payload *payload, const u8 **data, u32 *len)
+{
+    if (reached_end(payload)) {
+        return false;
+    }
+
+    if (deserialize(payload, len) && *len <= (u32)(payload->data + payload->len - payload->cursor)) {
+        *data = payload->cursor;
+        payload->cursor += *len;
+        return true;
+    }
+
+    return false;
+}
+
+template <typename T>
+typename std::enable_if_t<std::is_enum_v<T>, bool> deserialize(Payload *payload, T *number)
+{
+    return deserialize(payload, (std::underlying_type_t<T> *)(number));
+}
+
+// `count` varints in a row, same as calling deserialize for each one but decoded in bulk
+inline bool deserialize_array(Payload *payload, u32 *values, u32 count)
+{
+    u32 consumed;
+    if (!decode_varint_u32s(payload->cursor, get_remaining(payload), values, count, &consumed)) {
+        return false;
+    }
+    payload->cursor += consumed;
+    return true;
+}
+
+// Pixels of a CCDResultDelta, each one as the difference to the previous one (the first one to 0)
+inline bool serialize_delta_array(Payload *payload, const u32 *values, u32 count)
+{
+    u32 previous = 0;
+    for (u32 i = 0; i < count; ++i) {
+        // Wraps around the same way the prefix sum on the other side does, so any u32 round trips
+        if (!serialize(payload, (s32)(values[i] - previous))) {
+            return false;
+        }
+        previous = values[i];
+    }
+    return true;
+}
+
+inline bool deserialize_delta_array(Payload *payload, u32 *values, u32 count)
+{
+    if (!deserialize_array(payload, values, count)) {
+        return false;
+    }
+    zigzag_prefix_sum(values, count);
+    return true;
+}
+
+// Appends the CRC-32 of what was serialized so far as 4 raw little endian bytes. Goes last, right before encoding
+inline bool append_frame_crc(Payload *payload)
+{
+    if (!ensure_capacity(payload, kFrameCrcSize)) {
+        return false;
+    }
+    u32 crc = crc32(payload->data, get_size(payload));
+    for (u32 i = 0; i < kFrameCrcSize; ++i) {
+        *payload->cursor++ = (u8)(crc >> (i * 8));
+    }
+    return true;
+}
+
+// Checks the trailer added by append_frame_crc and takes it off `len`
+inline bool check_frame_crc(const u8 *data, u32 *len)
+{
+    if (*len < kFrameCrcSize) {
+        return false;
+    }
+    u32 body_len = *len - kFrameCrcSize;
+    const u8 *trailer = data + body_len;
+    u32 expected = (u32)trailer[0] | (u32)trailer[1] << 8 | (u32)trailer[2] << 16 | (u32)trailer[3] << 24;
+    if (crc32(data, body_len) != expected) {
+        return false;
+    }
+    *len = body_len;
+    return true;
+}
+
+////////////////////////////////////////////////////////////////
+//// Messages
+////////////////////////////////////////////////////////////////
+
+// Every message is a struct with its tag in `kTag` and its fields, in wire order, listed by `fields()`. The encoder,
+// the decoder and the worst case size all come from that list so both sides can't drift apart, and adding a message
+// is just adding a struct. Fields are integers (varint, zig-zag when signed), enums or Bytes.
+// `fields()` is a function so the member pointers are only formed once the struct is complete
+
+// Length prefixed raw bytes. Points into the payload after decoding
+struct Bytes {
+    const u8 *data;
+    u32 len;
+};
+
+// Varint element count, zero padding up to the next multiple of sizeof(T) from the start of the payload and then
+// the values as little endian T. After decoding `values` points straight into the payload, so the payload buffer has
+// to be aligned to T (anything from new/malloc is) and outlive the span
+template <typename T>
+struct PackedArray {
+    static_assert(std::is_same_v<T, u16> || std::is_same_v<T, u32>);
+    std::span<const T> values;
+};
+
+template <typename T>
+inline constexpr bool kIsPackedArray = false;
+
+template <typename T>
+inline constexpr bool kIsPackedArray<PackedArray<T>> = true;
+
+struct GetInfoCommand {
+    static constexpr HostToDeviceCommand kTag = HostToDeviceCommand::GetInfo;
+    static constexpr auto fields()
+    {
+        return std::tuple{};
+    }
+};
+
+struct CCDSensorCommand {
+    static constexpr HostToDeviceCommand kTag = HostToDeviceCommand::CCDSensor;
+    u32 id;
+    u32 iterations;
+    u32 exposure;
+    static constexpr auto fields()
+    {
+        return std::tuple{&CCDSensorCommand::id, &CCDSensorCommand::iterations, &CCDSensorCommand::exposure};
+    }
+};
+
+struct SetPixelEncodingCommand {
+    static constexpr HostToDeviceCommand kTag = HostToDeviceCommand::SetPixelEncoding;
+    PixelEncoding encoding;
+    static constexpr auto fields()
+    {
+        return std::tuple{&SetPixelEncodingCommand::encoding};
+    }
+};
+
+// Followed by `pixel_count` varint pixels, see deserialize_array
+struct CCDResultMessage {
+    static constexpr DeviceToHostResponse kTag = DeviceToHostResponse::CCDResult;
+    u32 id;
+    u32 iterations;
+    u32 exposure;
+    u32 pixel_count;
+    static constexpr auto fields()
+    {
+        return std::tuple{&CCDResultMessage::id,
+                          &CCDResultMessage::iterations,
+                          &CCDResultMessage::exposure,
+                          &CCDResultMessage::pixel_count};
+    }
+};
+
+// Same header, followed by delta pixels, see deserialize_delta_array
+struct CCDResultDeltaMessage : CCDResultMessage {
+    static constexpr DeviceToHostResponse kTag = DeviceToHostResponse::CCDResultDelta;
+};
+
+struct CCDResultPackedMessage {
+    static constexpr DeviceToHostResponse kTag = DeviceToHostResponse::CCDResultPacked;
+    u32 id;
+    u32 iterations;
+    u32 exposure;
+    PackedArray<u32> pixels;
+    static constexpr auto fields()
+    {
+        return std::tuple{&CCDResultPackedMessage::id,
+                          &CCDResultPackedMessage::iterations,
+                          &CCDResultPackedMessage::exposure,
+                          &CCDResultPackedMessage::pixels};
+    }
+};
+
+// Answer to GetInfo. Has a crc trailer only when the frames before it did, with FrameCrc every frame after the first
+// Info has one. A host that connects to a device already adding it gets an Info with a trailer it doesn't check yet,
+// which parses just the same
+struct InfoMessage {
+    static constexpr DeviceToHostResponse kTag = DeviceToHostResponse::Info;
+    u32 capabilities; // DeviceCapability bits
+    static constexpr auto fields()
+    {
+        return std::tuple{&InfoMessage::capabilities};
+    }
+};
+
+struct LogMessage {
+    static constexpr DeviceToHostResponse kTag = DeviceToHostResponse::Log;
+    u8 severity; // LogSeverity
+    u32 line;
+    Bytes function;
+    Bytes msg;
+    static constexpr auto fields()
+    {
+        return std::tuple{&LogMessage::severity, &LogMessage::line, &LogMessage::function, &LogMessage::msg};
+    }
+};
+
+template <typename T>
+struct MemberType;
+
+template <typename C, typename T>
+struct MemberType<T C::*> {
+    using type = T;
+};
+
+template <typename Field>
+using FieldType = typename MemberType<Field>::type;
+
+// Bytes and PackedArray fields only count the length, the rest depends on the message
+template <typename T>
+inline constexpr u32 get_max_field_size()
+{
+    if constexpr (std::is_same_v<T, Bytes> || kIsPackedArray<T>) {
+        return kMaxVarintSize<u32>;
+    } else if constexpr (std::is_enum_v<T>) {
+        return kMaxVarintSize<std::underlying_type_t<T>>;
+    } else {
+        return kMaxVarintSize<T>;
+    }
+}
+
+template <typename Msg>
+inline constexpr u32 get_max_fields_size()
+{
+    return std::apply([](auto... fields) { return (0 + ... + get_max_field_size<FieldType<decltype(fields)>>()); },
+                      Msg::fields());
+}
+
+template <typename T>
+inline constexpr bool kIsVariableField = std::is_same_v<T, Bytes> || kIsPackedArray<T>;
+
+template <typename Msg>
+inline constexpr bool has_variable_fields()
+{
+    return std::apply([](auto... fields) { return (false || ... || kIsVariableField<FieldType<decltype(fields)>>); },
+                      Msg::fields());
+}
+
+// Worst case size of the tag and fields, not counting the contents of Bytes and PackedArray fields
+template <typename Msg>
+inline constexpr u32 get_max_message_size()
+{
+    return get_max_field_size<std::remove_cv_t<decltype(Msg::kTag)>>() + get_max_fields_size<Msg>();
+}
+
+// Worst case size of this particular message
+template <typename Msg>
+inline u32 get_message_size_bound(const Msg &msg)
+{
+    u32 size = get_max_message_size<Msg>();
+    std::apply(
+        [&](auto... fields) {
+            // Unused for messages without fields, like GetInfoCommand
+            [[maybe_unused]] auto contents_size = [](const auto &value) -> u32 {
+                using T = std::remove_cvref_t<decltype(value)>;
+                if constexpr (std::is_same_v<T, Bytes>) {
+                    return value.len;
+                } else if constexpr (kIsPackedArray<T>) {
+                    // Plus the worst case padding
+                    return (u32)(value.values.size_bytes() + sizeof(value.values[0]) - 1);
+                } else {
+                    return 0;
+                }
+            };
+            size += (0 + ... + contents_size(msg.*fields));
+        },
+        Msg::fields());
+    return size;
+}
+
+// Padding that puts a PackedArray<T> starting at the cursor at a multiple of sizeof(T) from the start of the payload
+template <typename T>
+inline u32 get_packed_padding(Payload *payload)
+{
+    return (sizeof(T) - get_size(payload) % sizeof(T)) % sizeof(T);
+}
+
+// Packed arrays are memcpy'd as is, so they are only little endian on little endian machines
+static_assert(std::endian::native == std::endian::little);
+
+// No capacity checks, serialize_message does a single one for the whole message
+template <typename T>
+inline void write_field(Payload *payload, const T &value)
+{
+    if constexpr (std::is_same_v<T, Bytes>) {
+        serialize_varint(payload, value.len);
+        memcpy(payload->cursor, value.data, value.len);
+        payload->cursor += value.len;
+    } else if constexpr (kIsPackedArray<T>) {
+        using Elem = typename decltype(value.values)::value_type;
+        serialize_varint(payload, (u32)value.values.size());
+        u32 padding = get_packed_padding<Elem>(payload);
+        memset(payload->cursor, 0, padding);
+        payload->cursor += padding;
+        // An empty span can have a null data()
+        if (!value.values.empty()) {
+            memcpy(payload->cursor, value.values.data(), value.values.size_bytes());
+            payload->cursor += value.values.size_bytes();
+        }
+    } else if constexpr (std::is_enum_v<T>) {
+        serialize_varint(payload, static_cast<std::underlying_type_t<T>>(value));
+    } else {
+        serialize_varint(payload, value);
+    }
+}
+
+template <bool Checked, typename T>
+inline bool read_field(Payload *payload, T *value)
+{
+    if constexpr (std::is_same_v<T, Bytes>) {
+        return deserialize(payload, &value->data, &value->len);
+    } else if constexpr (kIsPackedArray<T>) {
+        using Elem = typename decltype(value->values)::value_type;
+        u32 count;
+        if (!deserialize_varint(payload, &count)) {
+            return false;
+        }
+        u32 padding = get_packed_padding<Elem>(payload);
+        if (get_remaining(payload) < padding || (get_remaining(payload) - padding) / sizeof(Elem) < count) {
+            return false;
+        }
+        payload->cursor += padding;
+        // Only misaligned when the payload buffer itself is
+        if ((uintptr_t)payload->cursor % alignof(Elem) != 0) {
+            return false;
+        }
+        value->values = {(const Elem *)payload->cursor, count};
+        payload->cursor += count * sizeof(Elem);
+        return true;
+    } else if constexpr (std::is_enum_v<T>) {
+        return read_field<Checked>(payload, (std::underlying_type_t<T> *)value);
+    } else if constexpr (Checked) {
+        return deserialize_varint(payload, value);
+    } else {
+        return deserialize_varint_unchecked(payload, value);
+    }
+}
+
+template <typename Msg>
+inline bool serialize_message(Payload *payload, const Msg &msg)
+{
+    if (!ensure_capacity(payload, get_message_size_bound(msg))) {
+        return false;
+    }
+    write_field(payload, Msg::kTag);
+    std::apply([&](auto... fields) { (write_field(payload, msg.*fields), ...); }, Msg::fields());
+    return true;
+}
+
+// The tag was already read to pick `Msg`. When there's room for the largest encoding of every field, none of the
+// reads have to look for the end of the payload
+template <typename Msg>
+inline bool deserialize_message(Payload *payload, Msg *msg)
+{
+    return std::apply(
+        [&](auto... fields) {
+            if (!has_variable_fields<Msg>() && get_remaining(payload) >= get_max_fields_size<Msg>()) {
+                return (true && ... && read_field<false>(payload, &(msg->*fields)));
+            }
+            return (true && ... && read_field<true>(payload, &(msg->*fields)));
+        },
+        Msg::fields());
+}
+
+// Host to device commands end with the CRC-16/CCITT of everything before it
+template <typename Msg>
+inline constexpr u32 get_max_command_size()
+{
+    return get_max_message_size<Msg>() + kMaxVarintSize<u16>;
+}
+
+template <typename Msg>
+inline bool serialize_command(Payload *payload, const Msg &msg)
+{
+    return serialize_message(payload, msg) && serialize(payload, crc16_ccitt(payload->data, get_size(payload)));
+}
+
+// Goes right after deserialize_message
+inline bool check_command_crc(Payload *payload)
+{
+    u16 expected = crc16_ccitt(payload->data, get_size(payload));
+    u16 crc;
+    return deserialize(payload, &crc) && crc == expected;
+}
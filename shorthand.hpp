@@ -88,12 +88,12 @@ void assert_impl(const char *line, const char *func, const char *file, const cha
 #define VALIDATE(expr) expr
 #endif
 
-constexpr u64 operator""_KB(u64 i)
+constexpr u64 operator""_KB(unsigned long long i)
 {
     return i << 10;
 }
 
-constexpr u64 operator""_MB(u64 i)
+constexpr u64 operator""_MB(unsigned long long i)
 {
     return i << 20;
 }
@@ -0,0 +1,1618 @@
+// Device simulator for load testing the controller without the instrument attached.
+//
+// Opens a pseudo-terminal, prints the path the controller has to connect to and speaks the same protocol the
+// firmware does: it decodes HostToDeviceCommand frames with the shared COBS/varint code from protocol.hpp and answers
+// with synthetic DeviceToHostResponse::CCDResult (or CCDResultDelta/CCDResultPacked) spectra and Log messages.
+//
+// Build (POSIX only, it needs a pty), `make` builds it into build/ next to controller-headless:
+//   c++ -std=c++20 -O2 simulator.cpp cobs.cpp crc.cpp varint.cpp correction.cpp cpu_features.cpp -o simulator
+//
+// Usage:
+//   simulator [--pixels N] [--rate HZ] [--log-rate HZ] [--corrupt P] [--instant] [--legacy] [--encoding E]
+//             [--link PATH]
+//   simulator --measure CAPTURE [--baud N]
+//   simulator --bench [--pixels N] [--baud N]
+//   simulator --self-check [--pty-rate MBS] [--pty-seconds S]
+//
+//   --pixels N      Pixels per CCD result (default 3648, max 5000)
+//   --rate HZ       Also stream unsolicited results at this rate, 0 only answers commands (default 0)
+//   --log-rate HZ   Device log messages per second (default 0)
+//   --corrupt P     Probability [0, 1] of flipping a random byte in each sent frame (default 0)
+//   --instant       Answer CCD commands right away instead of waiting exposure * iterations
+//   --legacy        Act like firmware from before GetInfo: no Info answer, no frame crc and no SetPixelEncoding
+//   --encoding E    Pixel encoding to start with, absolute, delta or packed (default absolute). The controller can
+//                   also switch it with SetPixelEncoding
+//   --link PATH     Create a symlink to the pty at PATH so the controller can always use the same path
+//
+//   --measure FILE  Don't simulate anything, take the CCD results out of a capture recorded by the controller and
+//                   compare the size on the wire and host decode time of both pixel encodings
+//   --baud N        Line speed used for the transfer times of --measure and the line rate numbers of --bench
+//                   (default 115200, what the controller uses)
+//
+//   --bench         Don't simulate anything, time the host side decode of synthetic CCD result frames in every
+//                   encoding: COBS decode, frame crc and pixel parsing, and how much of it is the crc. Also the
+//                   COBS zero scan with every implementation the cpu can run, the crc of a command, and decoding
+//                   in place in the rx ring against copying out into the old memmove compacted buffer, and the
+//                   column store the controller keeps results in against the vector of results it replaced
+//   --self-check    Don't simulate anything, check the SIMD code against its scalar reference on random data and
+//                   edge lengths, and hammer the controller's command queue from several threads. Then stream a
+//                   known byte sequence over a pty into a reader thread and ring like the controller's and check
+//                   nothing got dropped. Exits with 1 when anything doesn't match
+//   --pty-rate MBS  Bytes per second of the pty check in MB/s (default 2, twice what USB full speed can do)
+//   --pty-seconds S How long the pty check keeps that rate up (default 2)
+//
+// Results streamed with --rate continue the ids from the last command the controller sent, so sending one command
+// first keeps the ids in sync with the controller database.
+
+#include "capture.hpp"
+#include "ccd_store.hpp"
+#include "correction.hpp"
+#include "mpsc_queue.hpp"
+#include "protocol.hpp"
+#include "shorthand.hpp"
+#include "spsc_ring.hpp"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+// CCDResult header plus the largest pixels there can be
+static constexpr u32 kMaxResultPayload =
+    get_max_message_size<CCDResultMessage>() + kMaxPixelCount * kMaxVarintSize<u32> + kFrameCrcSize;
+// Don't let unsolicited traffic pile up without bound if the controller isn't reading
+static constexpr u32 kMaxPendingTx = 4_MB;
+
+struct SimConfig {
+    u32 pixels = 3648;
+    f64 result_rate = 0;
+    f64 log_rate = 0;
+    f64 corrupt_probability = 0;
+    bool instant = false;
+    bool legacy = false;
+    PixelEncoding pixel_encoding = PixelEncoding::Absolute;
+    const char *link_path = nullptr;
+
+    const char *measure_path = nullptr;
+    u32 baud = 115200;
+    bool bench = false;
+    bool self_check = false;
+    f64 pty_rate = 2;
+    f64 pty_seconds = 2;
+};
+
+struct PendingResult {
+    Clock::time_point ready_at;
+    u32 id;
+    u32 iterations;
+    u32 exposure;
+};
+
+struct SimStats {
+    u64 commands = 0;
+    u64 bad_commands = 0;
+    u64 crc_errors = 0;
+    u64 results = 0;
+    u64 logs = 0;
+    u64 corrupted = 0;
+    u64 dropped = 0;
+    u64 bytes_sent = 0;
+};
+
+struct Simulator {
+    SimConfig config;
+    int master_fd = -1;
+    int slave_fd = -1;
+
+    // Host commands are tiny, anything bigger than this is garbage
+    u8 rx_payload[256];
+    CobsDecodeCtx rx_decoder = cobs_decode_init(rx_payload, sizeof(rx_payload));
+    std::vector<u8> tx;
+    u32 tx_offset = 0;
+
+    std::deque<PendingResult> pending;
+    u32 next_stream_id = 1;
+    PixelEncoding pixel_encoding = PixelEncoding::Absolute;
+    // Frames only get a crc trailer after the first Info, like on the real device
+    bool frame_crc = false;
+
+    std::mt19937 rng{1234};
+    SimStats stats;
+};
+
+static bool open_pty(Simulator *sim)
+{
+    sim->master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (sim->master_fd < 0 || grantpt(sim->master_fd) != 0 || unlockpt(sim->master_fd) != 0) {
+        perror("posix_openpt");
+        return false;
+    }
+
+    const char *slave_path = ptsname(sim->master_fd);
+    // Keep our own handle to the slave. Without it the master reports POLLHUP until the controller connects, and
+    // the line settings below would be lost when the last slave handle closes
+    sim->slave_fd = open(slave_path, O_RDWR | O_NOCTTY);
+    if (sim->slave_fd < 0) {
+        perror("open slave");
+        return false;
+    }
+
+    // No echo or newline translation, the controller puts it in raw mode too but only once it connects
+    termios tty;
+    tcgetattr(sim->slave_fd, &tty);
+    cfmakeraw(&tty);
+    tcsetattr(sim->slave_fd, TCSANOW, &tty);
+
+    fcntl(sim->master_fd, F_SETFL, fcntl(sim->master_fd, F_GETFL) | O_NONBLOCK);
+
+    printf("Simulated device on [%s]\n", slave_path);
+    if (sim->config.link_path) {
+        unlink(sim->config.link_path);
+        if (symlink(slave_path, sim->config.link_path) != 0) {
+            perror("symlink");
+        } else {
+            printf("Linked as [%s]\n", sim->config.link_path);
+        }
+    }
+    return true;
+}
+
+////////////////////////////////////////////////////////////////
+//// Sending
+////////////////////////////////////////////////////////////////
+
+static void send_payload(Simulator *sim, Payload *payload)
+{
+    if (sim->tx.size() - sim->tx_offset > kMaxPendingTx || (sim->frame_crc && !append_frame_crc(payload))) {
+        sim->stats.dropped++;
+        return;
+    }
+    u32 payload_len = get_size(payload);
+
+    size_t frame_start = sim->tx.size();
+    sim->tx.resize(frame_start + get_max_encoded_size(payload_len));
+    CobsCtx ctx = cobs_encode_init(sim->tx.data() + frame_start, (u32)(sim->tx.size() - frame_start));
+    if (!cobs_encode(&ctx, payload->data, payload_len)) {
+        sim->tx.resize(frame_start);
+        sim->stats.dropped++;
+        return;
+    }
+    u32 frame_len = cobs_encode_end(&ctx);
+    sim->tx.resize(frame_start + frame_len);
+
+    std::uniform_real_distribution<f64> chance(0, 1);
+    if (sim->config.corrupt_probability > 0 && chance(sim->rng) < sim->config.corrupt_probability) {
+        // Anything but the delimiter, a flipped byte may still turn into a 0 and split the frame which is also
+        // something the controller has to survive
+        std::uniform_int_distribution<u32> which(0, frame_len - 2);
+        sim->tx[frame_start + which(sim->rng)] ^= (u8)(1 << (sim->rng() % 8));
+        sim->stats.corrupted++;
+    }
+}
+
+static void flush_tx(Simulator *sim)
+{
+    while (sim->tx_offset < sim->tx.size()) {
+        ssize_t n = write(sim->master_fd, sim->tx.data() + sim->tx_offset, sim->tx.size() - sim->tx_offset);
+        if (n <= 0) {
+            break;
+        }
+        sim->tx_offset += (u32)n;
+        sim->stats.bytes_sent += (u64)n;
+    }
+
+    if (sim->tx_offset == sim->tx.size()) {
+        sim->tx.clear();
+        sim->tx_offset = 0;
+    }
+}
+
+// Header and pixels of a CCDResult, CCDResultDelta or CCDResultPacked, without the frame crc
+static void serialize_ccd_result(Payload *payload, PixelEncoding encoding, u32 id, u32 iterations, u32 exposure,
+                                 const u32 *pixels, u32 pixel_count)
+{
+    CCDResultMessage header = {id, iterations, exposure, pixel_count};
+    switch (encoding) {
+        case PixelEncoding::Absolute: {
+            serialize_message(payload, header);
+            for (u32 i = 0; i < pixel_count; ++i) {
+                serialize(payload, pixels[i]);
+            }
+            break;
+        }
+        case PixelEncoding::Delta: {
+            serialize_message(payload, CCDResultDeltaMessage{header});
+            serialize_delta_array(payload, pixels, pixel_count);
+            break;
+        }
+        case PixelEncoding::Packed: {
+            serialize_message(payload, CCDResultPackedMessage{id, iterations, exposure, {{pixels, pixel_count}}});
+            break;
+        }
+    }
+}
+
+// A couple of gaussian emission lines on top of a dark level, scaled by how much light was integrated and clamped to
+// the 12 bit ADC range of each iteration
+static void make_spectrum(std::mt19937 *rng, u32 exposure, u32 iterations, u32 *pixels, u32 pixel_count)
+{
+    f64 light = std::min(1.0, exposure / 10000.0);
+    std::normal_distribution<f64> noise(0, 8);
+    for (u32 i = 0; i < pixel_count; ++i) {
+        f64 x = (f64)i / pixel_count;
+        f64 signal = 300 + 2500 * std::exp(-std::pow((x - 0.3) / 0.02, 2))
+                     + 1500 * std::exp(-std::pow((x - 0.7) / 0.05, 2));
+        f64 value = std::clamp(200 + signal * light + noise(*rng), 0.0, 4095.0);
+        pixels[i] = (u32)(value * std::max(iterations, 1u));
+    }
+}
+
+static void send_ccd_result(Simulator *sim, const PendingResult &request)
+{
+    static u32 pixels[kMaxPixelCount];
+    make_spectrum(&sim->rng, request.exposure, request.iterations, pixels, sim->config.pixels);
+
+    static u8 buffer[kMaxResultPayload];
+    Payload payload = {buffer, buffer, sizeof(buffer)};
+    serialize_ccd_result(&payload,
+                         sim->pixel_encoding,
+                         request.id,
+                         request.iterations,
+                         request.exposure,
+                         pixels,
+                         sim->config.pixels);
+    send_payload(sim, &payload);
+    sim->stats.results++;
+}
+
+static void send_log(Simulator *sim, const char *msg)
+{
+    u8 buffer[256];
+    Payload payload = {buffer, buffer, sizeof(buffer)};
+
+    static constexpr char kFunc[] = "simulator";
+    LogMessage log = {
+        .severity = 1 /*NORM*/,
+        .line = __LINE__,
+        .function = {(const u8 *)kFunc, (u32)strlen(kFunc)},
+        .msg = {(const u8 *)msg, (u32)strlen(msg)},
+    };
+    serialize_message(&payload, log);
+
+    send_payload(sim, &payload);
+    sim->stats.logs++;
+}
+
+////////////////////////////////////////////////////////////////
+//// Receiving
+////////////////////////////////////////////////////////////////
+
+static void handle_host_payload(Simulator *sim, u8 *decoded, u32 len)
+{
+    Payload payload = {decoded, decoded, (u16)len};
+    HostToDeviceCommand cmd;
+    if (!deserialize(&payload, &cmd)) {
+        sim->stats.bad_commands++;
+        return;
+    }
+
+    switch (cmd) {
+        case HostToDeviceCommand::CCDSensor: {
+            CCDSensorCommand command;
+            if (!deserialize_message(&payload, &command)) {
+                sim->stats.bad_commands++;
+                return;
+            }
+            if (!check_command_crc(&payload)) {
+                sim->stats.crc_errors++;
+                return;
+            }
+
+            PendingResult request = {{}, command.id, command.iterations, command.exposure};
+
+            // Commands queue up on the device, each one starts once the previous exposure is done
+            Clock::time_point start = sim->pending.empty() ? Clock::now() : sim->pending.back().ready_at;
+            auto duration = std::chrono::microseconds((u64)request.exposure * std::max(request.iterations, 1u));
+            request.ready_at = sim->config.instant ? Clock::now() : start + duration;
+            sim->pending.push_back(request);
+            sim->next_stream_id = request.id + 1;
+            sim->stats.commands++;
+            break;
+        }
+        case HostToDeviceCommand::GetInfo: {
+            GetInfoCommand command;
+            if (!deserialize_message(&payload, &command) || !check_command_crc(&payload)) {
+                sim->stats.crc_errors++;
+                return;
+            }
+            send_log(sim, "ecofisiometro simulator");
+            if (!sim->config.legacy) {
+                u8 buffer[get_max_message_size<InfoMessage>() + kFrameCrcSize];
+                Payload info = {buffer, buffer, sizeof(buffer)};
+                serialize_message(
+                    &info, InfoMessage{(u32)DeviceCapability::PixelEncoding | (u32)DeviceCapability::FrameCrc});
+                send_payload(sim, &info);
+                sim->frame_crc = true;
+            }
+            sim->stats.commands++;
+            break;
+        }
+        case HostToDeviceCommand::SetPixelEncoding: {
+            SetPixelEncodingCommand command;
+            if (sim->config.legacy || !deserialize_message(&payload, &command)
+                || command.encoding > PixelEncoding::MAX) {
+                sim->stats.bad_commands++;
+                return;
+            }
+            if (!check_command_crc(&payload)) {
+                sim->stats.crc_errors++;
+                return;
+            }
+
+            sim->pixel_encoding = command.encoding;
+            char msg[64];
+            snprintf(msg, sizeof(msg), "Sending %s pixels", get_pixel_encoding_name(command.encoding));
+            send_log(sim, msg);
+            sim->stats.commands++;
+            break;
+        }
+        default: {
+            sim->stats.bad_commands++;
+            break;
+        }
+    }
+}
+
+static void read_host(Simulator *sim)
+{
+    u8 buffer[4096];
+    ssize_t n;
+    while ((n = read(sim->master_fd, buffer, sizeof(buffer))) > 0) {
+        const u8 *data = buffer;
+        u32 len = (u32)n;
+        while (len != 0) {
+            bool frame_done;
+            u32 consumed = cobs_decode_stream(&sim->rx_decoder, data, len, &frame_done);
+            data += consumed;
+            len -= consumed;
+            if (!frame_done) {
+                break;
+            }
+
+            u32 decoded_len = cobs_decoded_size(&sim->rx_decoder);
+            if (sim->rx_decoder.overflow || decoded_len == 0) {
+                sim->stats.bad_commands++;
+            } else {
+                handle_host_payload(sim, sim->rx_payload, decoded_len);
+            }
+            cobs_decode_reset(&sim->rx_decoder);
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////
+//// Pixel encoding measurements
+////////////////////////////////////////////////////////////////
+
+struct RecordedResult {
+    u32 id;
+    u32 iterations;
+    u32 exposure;
+    std::vector<u32> pixels;
+};
+
+// What the controller does to get a CCD result out of a payload, in any of the pixel encodings
+static bool parse_ccd_result(Payload *payload, RecordedResult *result)
+{
+    DeviceToHostResponse cmd;
+    if (!deserialize(payload, &cmd)) {
+        return false;
+    }
+
+    if (cmd == DeviceToHostResponse::CCDResultPacked) {
+        CCDResultPackedMessage msg;
+        if (!deserialize_message(payload, &msg) || msg.pixels.values.size() > kMaxPixelCount) {
+            return false;
+        }
+        result->id = msg.id;
+        result->iterations = msg.iterations;
+        result->exposure = msg.exposure;
+        result->pixels.assign(msg.pixels.values.begin(), msg.pixels.values.end());
+        return true;
+    }
+
+    CCDResultMessage header;
+    if ((cmd != DeviceToHostResponse::CCDResult && cmd != DeviceToHostResponse::CCDResultDelta)
+        || !deserialize_message(payload, &header) || header.pixel_count > kMaxPixelCount) {
+        return false;
+    }
+    result->id = header.id;
+    result->iterations = header.iterations;
+    result->exposure = header.exposure;
+    result->pixels.resize(header.pixel_count);
+    return cmd == DeviceToHostResponse::CCDResultDelta
+               ? deserialize_delta_array(payload, result->pixels.data(), header.pixel_count)
+               : deserialize_array(payload, result->pixels.data(), header.pixel_count);
+}
+
+// Pulls the CCD results out of a capture. Only needs the file layout from capture.hpp, capture.cpp logs through the
+// controller log so it isn't linked in here
+static bool read_capture_results(const char *path, std::vector<RecordedResult> *results)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        perror("fopen");
+        return false;
+    }
+    _defer
+    {
+        fclose(file);
+    };
+
+    CaptureFileHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, kCaptureMagic, sizeof(kCaptureMagic)) != 0
+        || header.version != kCaptureVersion) {
+        fprintf(stderr, "[%s] is not a version %u capture file\n", path, kCaptureVersion);
+        return false;
+    }
+
+    std::vector<u8> frame(kMaxPayloadSize);
+    CobsDecodeCtx decoder = cobs_decode_init(frame.data(), (u32)frame.size());
+    bool frame_crc = false;
+    std::vector<u8> chunk;
+    CaptureChunkHeader chunk_header;
+    while (fread(&chunk_header, sizeof(chunk_header), 1, file) == 1) {
+        chunk.resize(chunk_header.len);
+        if (fread(chunk.data(), 1, chunk.size(), file) != chunk.size()) {
+            break;
+        }
+
+        const u8 *data = chunk.data();
+        u32 len = (u32)chunk.size();
+        while (len != 0) {
+            bool frame_done;
+            u32 consumed = cobs_decode_stream(&decoder, data, len, &frame_done);
+            data += consumed;
+            len -= consumed;
+            if (!frame_done) {
+                break;
+            }
+
+            u32 frame_len = cobs_decoded_size(&decoder);
+            bool frame_ok = !decoder.overflow && (!frame_crc || check_frame_crc(frame.data(), &frame_len));
+            cobs_decode_reset(&decoder);
+            if (!frame_ok) {
+                continue;
+            }
+
+            // Frames only have a crc after the device said so, same as the controller reads them
+            Payload payload = {frame.data(), frame.data(), (u16)frame_len};
+            Payload info_payload = payload;
+            DeviceToHostResponse cmd;
+            InfoMessage info;
+            if (deserialize(&info_payload, &cmd) && cmd == DeviceToHostResponse::Info
+                && deserialize_message(&info_payload, &info)) {
+                frame_crc = has_capability(info.capabilities, DeviceCapability::FrameCrc);
+                continue;
+            }
+            RecordedResult result;
+            if (parse_ccd_result(&payload, &result)) {
+                results->push_back(std::move(result));
+            }
+        }
+    }
+    return true;
+}
+
+// Re-encodes every recorded result in every encoding. Wire time is the COBS framed size at 10 bits per byte (8N1),
+// decode time is what the host spends getting the pixels back out of the payload
+static int measure_pixel_encodings(const SimConfig &config)
+{
+    std::vector<RecordedResult> results;
+    if (!read_capture_results(config.measure_path, &results)) {
+        return 1;
+    }
+    if (results.empty()) {
+        fprintf(stderr, "No CCD results in [%s]\n", config.measure_path);
+        return 1;
+    }
+
+    u64 pixel_total = 0;
+    for (const RecordedResult &result : results) {
+        pixel_total += result.pixels.size();
+    }
+    printf("%zu results, %llu pixels\n", results.size(), (unsigned long long)pixel_total);
+
+    static u8 buffer[kMaxResultPayload];
+    std::vector<u8> encoded(get_max_encoded_size(kMaxResultPayload));
+    RecordedResult decoded;
+    decoded.pixels.reserve(kMaxPixelCount);
+    u64 absolute_bytes = 0;
+    for (u8 e = 0; e <= (u8)PixelEncoding::MAX; ++e) {
+        PixelEncoding encoding = (PixelEncoding)e;
+
+        // Frames as they would go over the wire, kept around for the decode timing
+        std::vector<std::vector<u8>> payloads;
+        u64 wire_bytes = 0;
+        for (const RecordedResult &result : results) {
+            Payload payload = {buffer, buffer, sizeof(buffer)};
+            serialize_ccd_result(&payload,
+                                 encoding,
+                                 result.id,
+                                 result.iterations,
+                                 result.exposure,
+                                 result.pixels.data(),
+                                 (u32)result.pixels.size());
+            append_frame_crc(&payload);
+            CobsCtx ctx = cobs_encode_init(encoded.data(), (u32)encoded.size());
+            cobs_encode(&ctx, buffer, get_size(&payload));
+            wire_bytes += cobs_encode_end(&ctx);
+            payloads.emplace_back(buffer, buffer + get_size(&payload) - kFrameCrcSize);
+        }
+
+        // Enough rounds to get out of the timer noise
+        u32 rounds = (u32)std::max<u64>(1, 50'000'000 / pixel_total);
+        bool decoded_ok = true;
+        auto start = Clock::now();
+        for (u32 round = 0; round < rounds; ++round) {
+            for (size_t i = 0; i < payloads.size(); ++i) {
+                Payload payload = {payloads[i].data(), payloads[i].data(), (u16)payloads[i].size()};
+                decoded_ok &= parse_ccd_result(&payload, &decoded);
+                if (round == 0) {
+                    decoded_ok &= decoded.pixels == results[i].pixels;
+                }
+            }
+        }
+        f64 decode_us = std::chrono::duration<f64, std::micro>(Clock::now() - start).count() / rounds / results.size();
+
+        f64 wire_ms = wire_bytes * 10.0 / config.baud * 1000.0 / results.size();
+        if (encoding == PixelEncoding::Absolute) {
+            absolute_bytes = wire_bytes;
+        }
+        printf("%-8s  %.2f bytes/pixel  %.1f%% of absolute  wire %.2f ms/result @ %u baud  decode %.2f us/result  "
+               "%.2f GB pixels/s%s\n",
+               get_pixel_encoding_name(encoding),
+               (f64)wire_bytes / pixel_total,
+               100.0 * wire_bytes / absolute_bytes,
+               wire_ms,
+               config.baud,
+               decode_us,
+               pixel_total * sizeof(u32) / (decode_us * results.size()) / 1e3,
+               decoded_ok ? "" : "  MISMATCH");
+    }
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////
+//// Decode benchmark
+////////////////////////////////////////////////////////////////
+
+// What the controller does with the bytes its reader thread puts in the ring, minus the parsing: today's in place
+// decode inside the ring against the old way of copying everything out into a linear buffer, decoding the complete
+// frames from there and memmoving the partial one at the end back to the front. Both get the same stream of absolute
+// frames in reads of 4 KB and are drained every so many bytes, like the main loop getting to it once a frame
+static void run_rx_buffer_benchmark(const SimConfig &config)
+{
+    // Same as the controller's kReaderRingSize, kRxFrameAlign and the old Comms::kReadDataMaxSize
+    static constexpr u32 kRingSize = 4_MB;
+    static constexpr u32 kFrameAlign = 8;
+    static constexpr u32 kLinearSize = 1_MB;
+    static constexpr u32 kReadSize = 4_KB;
+    static constexpr u32 kFrames = 64;
+
+    std::mt19937 rng{1234};
+    std::vector<u32> pixels(config.pixels);
+    static u8 buffer[kMaxResultPayload];
+    std::vector<u8> stream;
+    for (u32 i = 0; i < kFrames; ++i) {
+        make_spectrum(&rng, 1000 * (i % 10 + 1), i % 3 + 1, pixels.data(), config.pixels);
+        Payload payload = {buffer, buffer, sizeof(buffer)};
+        serialize_ccd_result(&payload, PixelEncoding::Absolute, i + 1, 1, 1000, pixels.data(), config.pixels);
+        size_t frame_start = stream.size();
+        stream.resize(frame_start + get_max_encoded_size(get_size(&payload)));
+        CobsCtx ctx = cobs_encode_init(stream.data() + frame_start, (u32)(stream.size() - frame_start));
+        cobs_encode(&ctx, buffer, get_size(&payload));
+        stream.resize(frame_start + cobs_encode_end(&ctx));
+    }
+    u32 rounds = (u32)std::max<size_t>(1, 200_MB / stream.size());
+
+    std::vector<u8> linear(kLinearSize);
+    std::vector<u8> decoded(kMaxPayloadSize);
+
+    for (u32 drain_every : {kReadSize, (u32)64_KB, (u32)512_KB}) {
+        // Each way gets its own ring, the in place one with the overrun the controller allocates
+        SPSCRing ring;
+        SPSCRing linear_ring;
+        spsc_ring_init(&ring, kRingSize, kMaxPayloadSize);
+        spsc_ring_init(&linear_ring, kRingSize);
+        _defer
+        {
+            spsc_ring_free(&ring);
+            spsc_ring_free(&linear_ring);
+        };
+
+        // decode_incomming_data without the parsing
+        CobsDecodeCtx decoder = cobs_decode_init(spsc_ring_at(&ring, 0), kMaxPayloadSize);
+        u32 frame_start = 0;
+        u32 decoded_pos = 0;
+        u64 in_place_frames = 0;
+        auto drain_in_place = [&] {
+            u32 end = spsc_ring_write_pos(&ring);
+            RingRange range = spsc_ring_peek(&ring, decoded_pos, end - decoded_pos);
+            u32 pos = decoded_pos;
+            for (RingSpan span : {range.first, range.second}) {
+                while (span.len != 0) {
+                    bool frame_done;
+                    u32 consumed = cobs_decode_stream(&decoder, span.data, span.len, &frame_done);
+                    span.data += consumed;
+                    span.len -= consumed;
+                    pos += consumed;
+                    if (!frame_done) {
+                        break;
+                    }
+                    in_place_frames += cobs_decoded_size(&decoder) != 0;
+                    frame_start = pos & ~(kFrameAlign - 1);
+                    decoder = cobs_decode_init(spsc_ring_at(&ring, frame_start), kMaxPayloadSize);
+                }
+            }
+            spsc_ring_release(&ring, frame_start);
+            decoded_pos = end;
+        };
+
+        // The old handle_incomming_data and the compaction in handle_commands
+        u32 linear_size = 0;
+        u64 linear_frames = 0;
+        auto drain_linear = [&] {
+            linear_size += spsc_ring_read(&linear_ring, linear.data() + linear_size, kLinearSize - linear_size);
+            u32 start = 0;
+            while (true) {
+                u32 end = start + cobs_find_zero(linear.data() + start, linear_size - start);
+                if (end == linear_size) {
+                    break;
+                }
+                linear_frames += cobs_decode(linear.data() + start, end - start, decoded.data(), kMaxPayloadSize) != 0;
+                start = end + 1;
+            }
+            linear_size -= start;
+            if (linear_size != 0) {
+                memmove(linear.data(), linear.data() + start, linear_size);
+            }
+        };
+
+        auto run = [&](SPSCRing *to, auto drain) {
+            auto start = Clock::now();
+            for (u32 round = 0; round < rounds; ++round) {
+                u32 since_drain = 0;
+                for (u32 offset = 0; offset < stream.size(); offset += kReadSize) {
+                    u32 len = std::min<u32>(kReadSize, (u32)stream.size() - offset);
+                    spsc_ring_write(to, stream.data() + offset, len);
+                    since_drain += len;
+                    if (since_drain >= drain_every) {
+                        drain();
+                        since_drain = 0;
+                    }
+                }
+                drain();
+            }
+            return stream.size() * (u64)rounds / std::chrono::duration<f64>(Clock::now() - start).count() / 1e6;
+        };
+        f64 in_place_mbs = run(&ring, drain_in_place);
+        f64 linear_mbs = run(&linear_ring, drain_linear);
+        bool ok = in_place_frames == (u64)kFrames * rounds && linear_frames == (u64)kFrames * rounds;
+        printf("rx buffer drained every %3u KB  in place in the ring %.0f MB/s  copy out and memmove %.0f MB/s%s\n",
+               (u32)(drain_every / 1_KB),
+               in_place_mbs,
+               linear_mbs,
+               ok ? "" : "  FAILED");
+    }
+}
+
+// The controller's CCDOperationStore against the std::vector<CCDOperation> it replaced, where every result owned its
+// pixels, name and note. Filling both with the same results, walking one column the way the Results tab filters on
+// the date, walking every pixel, and looking results up by id like the commands from the UI do
+static void run_ccd_store_benchmark(const SimConfig &config)
+{
+    struct OldCCDOperation {
+        u32 id;
+        std::chrono::local_seconds ts;
+        u32 exposure_time_in_us;
+        u32 iterations;
+        std::vector<u32> accumulated_values;
+        std::string name;
+        std::string note;
+    };
+    static constexpr u32 kRows = 2000;
+    static constexpr u32 kLookups = 100'000;
+    static constexpr u32 kRounds = 5;
+    using std::chrono::local_seconds;
+    using std::chrono::seconds;
+
+    std::mt19937 rng{1234};
+    std::vector<u32> pixels(config.pixels);
+    make_spectrum(&rng, 1000, 1, pixels.data(), config.pixels);
+    std::vector<u32> lookups(kLookups);
+    for (u32 &id : lookups) {
+        id = rng() % kRows + 1;
+    }
+    auto get_op = [](u32 row) {
+        return CCDOperation{row + 1, 0, local_seconds{seconds(row * 60)}, 1000 * (row % 10 + 1), 1};
+    };
+    auto in_range = [](local_seconds ts) {
+        return ts >= local_seconds{seconds(kRows * 15)} && ts < local_seconds{seconds(kRows * 45)};
+    };
+    auto ms_since = [](Clock::time_point from) {
+        return std::chrono::duration<f64, std::milli>(Clock::now() - from).count();
+    };
+
+    // The old vector first, then the store. Both are kept across rounds and cleared like the controller does with its
+    // stores, the first round is the cold fill with all the growing
+    std::vector<OldCCDOperation> old_ops;
+    CCDOperationStore store;
+    f64 cold_fill_ms[2] = {};
+    f64 fill_ms[2] = {};
+    f64 column_ms[2] = {};
+    f64 pixels_ms[2] = {};
+    f64 find_ms[2] = {};
+    u64 sinks[2] = {};
+    for (u32 round = 0; round < kRounds; ++round) {
+        auto start = Clock::now();
+        old_ops.clear();
+        for (u32 row = 0; row < kRows; ++row) {
+            CCDOperation op = get_op(row);
+            old_ops.push_back({op.id, op.ts, op.exposure_time_in_us, op.iterations, pixels, {}, {}});
+        }
+        (round == 0 ? cold_fill_ms : fill_ms)[0] += ms_since(start);
+
+        start = Clock::now();
+        for (const OldCCDOperation &op : old_ops) {
+            sinks[0] += in_range(op.ts) ? op.exposure_time_in_us : 0;
+        }
+        column_ms[0] += ms_since(start);
+
+        start = Clock::now();
+        for (const OldCCDOperation &op : old_ops) {
+            for (u32 value : op.accumulated_values) {
+                sinks[0] += value;
+            }
+        }
+        pixels_ms[0] += ms_since(start);
+
+        start = Clock::now();
+        for (u32 id : lookups) {
+            auto it = std::find_if(old_ops.begin(), old_ops.end(), [id](const auto &op) { return op.id == id; });
+            sinks[0] += it - old_ops.begin();
+        }
+        find_ms[0] += ms_since(start);
+
+        start = Clock::now();
+        ccd_store_clear(&store);
+        for (u32 row = 0; row < kRows; ++row) {
+            ccd_store_push(&store, get_op(row), pixels);
+        }
+        (round == 0 ? cold_fill_ms : fill_ms)[1] += ms_since(start);
+
+        start = Clock::now();
+        for (u32 row = 0; row < kRows; ++row) {
+            sinks[1] += in_range(store.timestamps[row]) ? store.exposures[row] : 0;
+        }
+        column_ms[1] += ms_since(start);
+
+        start = Clock::now();
+        for (u32 value : store.pixels) {
+            sinks[1] += value;
+        }
+        pixels_ms[1] += ms_since(start);
+
+        start = Clock::now();
+        for (u32 id : lookups) {
+            sinks[1] += ccd_store_find(&store, id);
+        }
+        find_ms[1] += ms_since(start);
+    }
+
+    printf("%u results of %u pixels  vector of results against the column store\n", kRows, config.pixels);
+    printf("  first fill          %8.3f ms  %8.3f ms\n", cold_fill_ms[0], cold_fill_ms[1]);
+    printf("  fill again          %8.3f ms  %8.3f ms\n", fill_ms[0] / (kRounds - 1), fill_ms[1] / (kRounds - 1));
+    printf("  date filter column  %8.3f ms  %8.3f ms\n", column_ms[0] / kRounds, column_ms[1] / kRounds);
+    printf("  walk every pixel    %8.3f ms  %8.3f ms\n", pixels_ms[0] / kRounds, pixels_ms[1] / kRounds);
+    printf("  %uk finds by id    %8.3f ms  %8.3f ms%s\n",
+           kLookups / 1000,
+           find_ms[0] / kRounds,
+           find_ms[1] / kRounds,
+           sinks[0] == sinks[1] ? "" : "  FAILED");
+}
+
+// Host side cost of a CCD result frame in every encoding, split into what decode_incomming_data and
+// parse_device_response do with it: the COBS decode, the frame crc check and getting the pixels out. Each step runs
+// over all the frames at once so the timer isn't in the way
+static int run_decode_benchmark(const SimConfig &config)
+{
+    static constexpr u32 kFrames = 64;
+
+    std::mt19937 rng{1234};
+    std::vector<std::vector<u32>> spectra(kFrames, std::vector<u32>(config.pixels));
+    for (u32 i = 0; i < kFrames; ++i) {
+        make_spectrum(&rng, 1000 * (i % 10 + 1), i % 3 + 1, spectra[i].data(), config.pixels);
+    }
+    printf("%u results of %u pixels\n", kFrames, config.pixels);
+
+    static u8 buffer[kMaxResultPayload];
+    std::vector<u8> decoded(kMaxPayloadSize);
+    RecordedResult result;
+    result.pixels.reserve(kMaxPixelCount);
+    for (u8 e = 0; e <= (u8)PixelEncoding::MAX; ++e) {
+        PixelEncoding encoding = (PixelEncoding)e;
+
+        std::vector<std::vector<u8>> frames;
+        std::vector<std::vector<u8>> payloads;
+        for (u32 i = 0; i < kFrames; ++i) {
+            Payload payload = {buffer, buffer, sizeof(buffer)};
+            serialize_ccd_result(&payload, encoding, i + 1, 1, 1000, spectra[i].data(), config.pixels);
+            append_frame_crc(&payload);
+            payloads.emplace_back(buffer, buffer + get_size(&payload));
+
+            std::vector<u8> frame(get_max_encoded_size(get_size(&payload)));
+            CobsCtx ctx = cobs_encode_init(frame.data(), (u32)frame.size());
+            cobs_encode(&ctx, buffer, get_size(&payload));
+            frame.resize(cobs_encode_end(&ctx));
+            frames.push_back(std::move(frame));
+        }
+
+        u32 rounds = (u32)std::max<u64>(1, 20'000'000 / ((u64)kFrames * config.pixels));
+        bool ok = true;
+        u64 sink = 0;
+
+        auto start = Clock::now();
+        for (u32 round = 0; round < rounds; ++round) {
+            for (const std::vector<u8> &frame : frames) {
+                CobsDecodeCtx decoder = cobs_decode_init(decoded.data(), (u32)decoded.size());
+                bool frame_done;
+                cobs_decode_stream(&decoder, frame.data(), (u32)frame.size(), &frame_done);
+                sink += cobs_decoded_size(&decoder);
+            }
+        }
+        auto cobs_done = Clock::now();
+        for (u32 round = 0; round < rounds; ++round) {
+            for (const std::vector<u8> &payload : payloads) {
+                u32 len = (u32)payload.size();
+                ok &= check_frame_crc(payload.data(), &len);
+            }
+        }
+        auto crc_done = Clock::now();
+        for (u32 round = 0; round < rounds; ++round) {
+            for (std::vector<u8> &payload : payloads) {
+                Payload parse = {payload.data(), payload.data(), (u16)(payload.size() - kFrameCrcSize)};
+                ok &= parse_ccd_result(&parse, &result);
+                sink += result.pixels.back();
+            }
+        }
+        auto parse_done = Clock::now();
+
+        auto per_frame_us = [rounds](Clock::time_point from, Clock::time_point to) {
+            return std::chrono::duration<f64, std::micro>(to - from).count() / rounds / kFrames;
+        };
+        f64 cobs_us = per_frame_us(start, cobs_done);
+        f64 crc_us = per_frame_us(cobs_done, crc_done);
+        f64 parse_us = per_frame_us(crc_done, parse_done);
+        f64 frame_bytes = (f64)(payloads[0].size());
+        printf("%-8s  %.0f bytes  cobs %.3f us  crc %.3f us (%.1f GB/s)  parse %.3f us  crc is %.1f%% of the frame%s\n",
+               get_pixel_encoding_name(encoding),
+               frame_bytes,
+               cobs_us,
+               crc_us,
+               frame_bytes / crc_us / 1e3,
+               parse_us,
+               100.0 * crc_us / (cobs_us + crc_us + parse_us),
+               ok && sink != 0 ? "" : "  FAILED");
+        // What the share above means for a link sending nothing but these frames, at 10 bits per byte (8N1)
+        f64 frames_per_s = config.baud / 10.0 / frames[0].size();
+        printf("          crc at %u baud %.5f%% of a core\n", config.baud, frames_per_s * crc_us * 1e-4);
+
+        // The zero scan the decoder does over the literals of every COBS block, with every implementation and without
+        // the kCobsShortRun cutoff, so short blocks show what the cutoff is for
+        for (const CobsFindZeroImpl &impl : get_cobs_find_zero_impls()) {
+            auto scan_start = Clock::now();
+            for (u32 round = 0; round < rounds; ++round) {
+                for (const std::vector<u8> &frame : frames) {
+                    u32 size = (u32)frame.size();
+                    for (u32 pos = 0; pos < size;) {
+                        u32 literal = std::min<u32>(frame[pos] - 1, size - pos - 1);
+                        pos += 1 + impl.fn(frame.data() + pos + 1, literal);
+                    }
+                }
+            }
+            f64 scan_us = per_frame_us(scan_start, Clock::now());
+            printf("          zero scan %-6s %.3f us (%.1f GB/s)\n",
+                   impl.name,
+                   scan_us,
+                   frames[0].size() / scan_us / 1e3);
+        }
+    }
+
+    // Commands are a handful of bytes, way under the 64 the carry-less multiply folding needs, so crc16_ccitt only
+    // has slice by 8. This is what the device and the controller pay for one
+    u8 command[get_max_command_size<CCDSensorCommand>()];
+    Payload payload = {command, command, sizeof(command)};
+    serialize_message(&payload, CCDSensorCommand{1234, 10, 100000});
+    u32 command_len = get_size(&payload);
+    static constexpr u32 kCommandRounds = 10'000'000;
+    u16 crc = 0xFFFF;
+    auto crc16_start = Clock::now();
+    for (u32 round = 0; round < kCommandRounds; ++round) {
+        crc = crc16_ccitt(command, command_len, crc);
+    }
+    f64 crc16_ns = std::chrono::duration<f64, std::nano>(Clock::now() - crc16_start).count() / kCommandRounds;
+    printf("crc16 of a %u byte CCDSensor command %.1f ns (%04x)\n", command_len, crc16_ns, crc);
+
+    run_rx_buffer_benchmark(config);
+    run_ccd_store_benchmark(config);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////
+//// SIMD self check
+////////////////////////////////////////////////////////////////
+
+struct SelfCheck {
+    // Byte rate in MB/s and length of the pty check
+    f64 pty_rate = 2;
+    f64 pty_seconds = 2;
+    std::mt19937 rng{4321};
+    u64 cases = 0;
+    u64 failures = 0;
+};
+
+static void expect(SelfCheck *check, bool ok, const char *what, u32 len)
+{
+    check->cases++;
+    if (!ok && check->failures++ < 20) {
+        fprintf(stderr, "FAILED %s, length %u\n", what, len);
+    }
+}
+
+// Every length around the vector widths, block sizes and unroll factors the kernels care about, then random ones
+static std::vector<u32> get_check_lengths(SelfCheck *check, u32 max_len)
+{
+    std::vector<u32> lengths;
+    for (u32 len = 0; len <= 80; ++len) {
+        lengths.push_back(len);
+    }
+    for (u32 edge : {127u, 128u, 254u, 255u, 256u, 509u, 1024u, 4096u}) {
+        for (u32 len = edge - 2; len <= edge + 2; ++len) {
+            lengths.push_back(len);
+        }
+    }
+    std::uniform_int_distribution<u32> random_len(0, max_len);
+    for (u32 i = 0; i < 200; ++i) {
+        lengths.push_back(random_len(check->rng));
+    }
+    std::erase_if(lengths, [max_len](u32 len) { return len > max_len; });
+    return lengths;
+}
+
+// Random bytes where about `zero_percent` of them are 0x00, the byte COBS and the zero scans care about
+static void fill_random(SelfCheck *check, u8 *data, u32 len, u32 zero_percent)
+{
+    std::uniform_int_distribution<u32> byte(1, 255);
+    std::uniform_int_distribution<u32> percent(0, 99);
+    for (u32 i = 0; i < len; ++i) {
+        data[i] = percent(check->rng) < zero_percent ? 0 : (u8)byte(check->rng);
+    }
+}
+
+// Every zero scan the cpu can run and the block encoder / decoders against the byte at a time versions
+static void check_cobs(SelfCheck *check)
+{
+    static constexpr u32 kMaxLen = 8192;
+    std::vector<u8> data(kMaxLen);
+    std::vector<u8> encoded(get_max_encoded_size(kMaxLen));
+    std::vector<u8> encoded_scalar(encoded.size());
+    std::vector<u8> decoded(kMaxLen);
+    std::vector<u8> decoded_scalar(kMaxLen);
+    std::uniform_int_distribution<u32> piece(1, 300);
+
+    for (u32 zero_percent : {0u, 1u, 30u, 100u}) {
+        for (u32 len : get_check_lengths(check, kMaxLen)) {
+            fill_random(check, data.data(), len, zero_percent);
+
+            u32 first_zero = 0;
+            while (first_zero < len && data[first_zero] != 0) {
+                first_zero++;
+            }
+            for (const CobsFindZeroImpl &impl : get_cobs_find_zero_impls()) {
+                std::string what = std::string("cobs_find_zero ") + impl.name;
+                expect(check, impl.fn(data.data(), len) == first_zero, what.c_str(), len);
+                // Off by one from however the vector was allocated
+                const u8 *from = data.data() + (len != 0);
+                u32 from_len = len - (len != 0);
+                expect(check, impl.fn(from, from_len) == cobs_find_zero_scalar(from, from_len), what.c_str(), len);
+            }
+
+            CobsCtx ctx = cobs_encode_init(encoded.data(), (u32)encoded.size());
+            CobsCtx ctx_scalar = cobs_encode_init(encoded_scalar.data(), (u32)encoded_scalar.size());
+            // Split in two to go through a context that already has a block open
+            u32 split = len / 3;
+            bool encoded_ok = cobs_encode(&ctx, data.data(), split)
+                              && cobs_encode(&ctx, data.data() + split, len - split);
+            bool encoded_scalar_ok = cobs_encode_scalar(&ctx_scalar, data.data(), split)
+                                     && cobs_encode_scalar(&ctx_scalar, data.data() + split, len - split);
+            u32 encoded_len = cobs_encode_end(&ctx);
+            u32 encoded_scalar_len = cobs_encode_end(&ctx_scalar);
+            expect(check,
+                   encoded_ok && encoded_scalar_ok && encoded_len == encoded_scalar_len
+                       && memcmp(encoded.data(), encoded_scalar.data(), encoded_len) == 0,
+                   "cobs_encode",
+                   len);
+
+            // Without the delimiter, the way the frame decoders see it
+            u32 frame_len = encoded_len - 1;
+            u32 decoded_len = cobs_decode(encoded.data(), frame_len, decoded.data(), kMaxLen);
+            u32 decoded_scalar_len = cobs_decode_scalar(encoded.data(), frame_len, decoded_scalar.data(), kMaxLen);
+            expect(check,
+                   decoded_len == decoded_scalar_len && decoded_len == len
+                       && memcmp(decoded.data(), decoded_scalar.data(), len) == 0
+                       && memcmp(decoded.data(), data.data(), len) == 0,
+                   "cobs_decode",
+                   len);
+
+            // Fed in random pieces, like reads off the serial port
+            CobsDecodeCtx decoder = cobs_decode_init(decoded.data(), kMaxLen);
+            const u8 *it = encoded.data();
+            u32 left = encoded_len;
+            bool frame_done = false;
+            while (left != 0 && !frame_done) {
+                u32 consumed = cobs_decode_stream(&decoder, it, std::min(left, piece(check->rng)), &frame_done);
+                it += consumed;
+                left -= consumed;
+            }
+            expect(check,
+                   frame_done && left == 0 && !decoder.overflow && cobs_decoded_size(&decoder) == len
+                       && memcmp(decoded.data(), data.data(), len) == 0,
+                   "cobs_decode_stream",
+                   len);
+        }
+    }
+}
+
+// Every crc32 the cpu can run and the slice by 8 crc16 against the bit at a time versions. Starts anywhere in the
+// buffer so the unaligned loads get their turn, and keeps going from a random crc like a frame read in pieces does
+static void check_crc(SelfCheck *check)
+{
+    static constexpr u32 kMaxLen = 20000;
+    static constexpr u32 kMaxOffset = 63;
+    std::vector<u8> data(kMaxLen + kMaxOffset);
+    fill_random(check, data.data(), (u32)data.size(), 1);
+    std::uniform_int_distribution<u32> offset(0, kMaxOffset);
+
+    for (const Crc32Impl &impl : get_crc32_impls()) {
+        std::string what = std::string("crc32 ") + impl.name;
+        for (u32 len : get_check_lengths(check, kMaxLen)) {
+            const u8 *start = data.data() + offset(check->rng);
+            u32 seed = len % 2 ? check->rng() : 0;
+            expect(check, impl.fn(start, len, seed) == crc32_bitwise(start, len, seed), what.c_str(), len);
+        }
+    }
+
+    for (u32 len : get_check_lengths(check, kMaxLen)) {
+        const u8 *start = data.data() + offset(check->rng);
+        u16 seed = len % 2 ? (u16)check->rng() : 0xFFFF;
+        expect(check, crc16_ccitt(start, len, seed) == crc16_ccitt_bitwise(start, len, seed), "crc16_ccitt", len);
+    }
+}
+
+// Every varint decoder the cpu can run against the scalar one, on values of every encoded length mixed in different
+// proportions. Also with the data cut short, a varint too long for a u32 and fewer values asked for than there are.
+// zigzag_prefix_sum's SSE2 loop against its scalar version
+static void check_varint(SelfCheck *check)
+{
+    static constexpr u32 kMaxCount = 5000;
+    static u8 buffer[kMaxCount * (kMaxVarintSize<u32> + 1)];
+    std::vector<u32> values(kMaxCount);
+    std::vector<u32> decoded(kMaxCount);
+    std::vector<u32> decoded_scalar(kMaxCount);
+
+    auto decode_matches = [&](const DecodeVarintsImpl &impl, u32 len, u32 count) {
+        u32 consumed = 0;
+        u32 consumed_scalar = 0;
+        bool ok = impl.fn(buffer, len, decoded.data(), count, &consumed);
+        bool ok_scalar = decode_varint_u32s_scalar(buffer, len, decoded_scalar.data(), count, &consumed_scalar);
+        return ok == ok_scalar
+               && (!ok || (consumed == consumed_scalar && memcmp(decoded.data(), values.data(), count * 4) == 0));
+    };
+
+    for (const DecodeVarintsImpl &impl : get_decode_varints_impls()) {
+        std::string what = std::string("decode_varint_u32s ") + impl.name;
+        for (u32 max_bytes : {1u, 2u, 3u, 5u}) {
+            std::uniform_int_distribution<u32> bytes(1, max_bytes);
+            for (u32 count : get_check_lengths(check, kMaxCount)) {
+                Payload payload = {buffer, buffer, (u16)sizeof(buffer)};
+                for (u32 i = 0; i < count; ++i) {
+                    // Something that takes exactly that many bytes
+                    u32 b = bytes(check->rng);
+                    u32 low = b == 1 ? 0 : 1u << (7 * (b - 1));
+                    u32 high = b == 5 ? u32Max : (1u << (7 * b)) - 1;
+                    values[i] = std::uniform_int_distribution<u32>(low, high)(check->rng);
+                    serialize_varint(&payload, values[i]);
+                }
+                u32 len = get_size(&payload);
+
+                expect(check, decode_matches(impl, len, count), what.c_str(), count);
+                expect(check, decode_matches(impl, len, count / 2), (what + " partial").c_str(), count);
+                if (count == 0) {
+                    continue;
+                }
+                u32 cut = std::uniform_int_distribution<u32>(0, len - 1)(check->rng);
+                expect(check, decode_matches(impl, cut, count), (what + " cut short").c_str(), count);
+
+                // Six groups, one more than a u32 has room for
+                u32 at = std::uniform_int_distribution<u32>(0, len - 1)(check->rng);
+                u8 saved[6];
+                u32 overlong = std::min(6u, (u32)sizeof(buffer) - at);
+                memcpy(saved, buffer + at, overlong);
+                memset(buffer + at, 0xFF, overlong);
+                expect(check, decode_matches(impl, len, count), (what + " overlong").c_str(), count);
+                memcpy(buffer + at, saved, overlong);
+            }
+        }
+    }
+
+    for (u32 count : get_check_lengths(check, kMaxCount)) {
+        for (u32 i = 0; i < count; ++i) {
+            decoded[i] = decoded_scalar[i] = check->rng();
+        }
+        zigzag_prefix_sum(decoded.data(), count);
+        zigzag_prefix_sum_scalar(decoded_scalar.data(), count);
+        expect(check, memcmp(decoded.data(), decoded_scalar.data(), count * 4) == 0, "zigzag_prefix_sum", count);
+    }
+}
+
+// Every dark / reference correction the cpu can run against the scalar one, bit for bit. Besides plain spectra there
+// are references at or below the dark, which have to come out as 0, and counts up to the 31 bits they're allowed
+static void check_correction(SelfCheck *check)
+{
+    static constexpr u32 kMaxCount = 5000;
+    std::vector<u32> signal(kMaxCount);
+    std::vector<u32> dark(kMaxCount);
+    std::vector<u32> reference(kMaxCount);
+    std::vector<f32> out(kMaxCount);
+    std::vector<f32> out_scalar(kMaxCount);
+
+    for (const CorrectSpectrumImpl &impl : get_correct_spectrum_impls()) {
+        std::string what = std::string("correct_spectrum ") + impl.name;
+        for (u32 max_count : {4095u * 4, (u32)s32Max}) {
+            std::uniform_int_distribution<u32> counts(0, max_count);
+            for (u32 count : get_check_lengths(check, kMaxCount)) {
+                for (u32 i = 0; i < count; ++i) {
+                    signal[i] = counts(check->rng);
+                    dark[i] = counts(check->rng) / 8;
+                    // Every fourth pixel is dead or saturated, at the dark level or under it
+                    u32 below_dark = std::min(dark[i], (u32)(check->rng() % 2));
+                    reference[i] = i % 4 == 3 ? dark[i] - below_dark : counts(check->rng);
+                }
+                impl.fn(signal.data(), dark.data(), reference.data(), out.data(), count);
+                correct_spectrum_scalar(signal.data(), dark.data(), reference.data(), out_scalar.data(), count);
+                expect(check, memcmp(out.data(), out_scalar.data(), count * sizeof(f32)) == 0, what.c_str(), count);
+            }
+        }
+    }
+}
+
+// The controller's command queue with producers pushing single items and batches as fast as they can into a queue
+// small enough to be full most of the time. Every item has to come out exactly once, each producer's in the order
+// it pushed them and every batch in one piece
+static void check_mpsc_queue(SelfCheck *check)
+{
+    static constexpr u32 kProducers = 4;
+    static constexpr u32 kItemsPerProducer = 200'000;
+    static constexpr u32 kMaxBatch = 8;
+
+    struct Item {
+        u32 producer;
+        u32 seq;
+        // Items of the same batch still to come after this one
+        u32 batch_left;
+    };
+    MPSCQueue<Item> queue;
+    if (!mpsc_queue_init(&queue, 64)) {
+        expect(check, false, "mpsc_queue_init", 64);
+        return;
+    }
+
+    // Lets the producers give up when the consumer does, instead of spinning on a full queue forever
+    std::atomic<bool> stop = false;
+    std::vector<std::thread> producers;
+    for (u32 p = 0; p < kProducers; ++p) {
+        producers.emplace_back([&queue, &stop, p] {
+            std::mt19937 rng{p};
+            Item batch[kMaxBatch];
+            for (u32 seq = 0; seq < kItemsPerProducer;) {
+                // Every other producer only pushes one at a time
+                u32 count = p % 2 ? 1 : std::min<u32>(rng() % kMaxBatch + 1, kItemsPerProducer - seq);
+                for (u32 i = 0; i < count; ++i) {
+                    batch[i] = {p, seq + i, count - 1 - i};
+                }
+                while (!mpsc_queue_push(&queue, batch, count)) {
+                    if (stop.load(std::memory_order_relaxed)) {
+                        return;
+                    }
+                    std::this_thread::yield();
+                }
+                seq += count;
+            }
+        });
+    }
+
+    u32 next_seq[kProducers] = {};
+    u64 received = 0;
+    // Last item when it was part of a batch with more to come, those have to follow it right away
+    bool in_batch = false;
+    Item last = {};
+    bool order_ok = true;
+    bool batches_ok = true;
+    auto last_progress = Clock::now();
+    while (received < (u64)kProducers * kItemsPerProducer) {
+        const Item *item = mpsc_queue_peek(&queue);
+        if (!item) {
+            // A stuck producer or a lost item would otherwise hang the check
+            if (Clock::now() - last_progress > std::chrono::seconds(10)) {
+                break;
+            }
+            std::this_thread::yield();
+            continue;
+        }
+        last_progress = Clock::now();
+
+        Item value = *item;
+        mpsc_queue_release(&queue);
+        received++;
+        if (value.producer >= kProducers || value.seq != next_seq[value.producer]) {
+            order_ok = false;
+            continue;
+        }
+        next_seq[value.producer]++;
+        if (in_batch && (value.producer != last.producer || value.batch_left != last.batch_left - 1)) {
+            batches_ok = false;
+        }
+        in_batch = value.batch_left != 0;
+        last = value;
+    }
+    stop.store(true, std::memory_order_relaxed);
+    for (std::thread &producer : producers) {
+        producer.join();
+    }
+
+    expect(check, received == (u64)kProducers * kItemsPerProducer, "mpsc_queue every item arrived", kProducers);
+    expect(check, order_ok, "mpsc_queue producer order", kProducers);
+    expect(check, batches_ok, "mpsc_queue batches in one piece", kProducers);
+    expect(check, mpsc_queue_peek(&queue) == nullptr, "mpsc_queue empty at the end", kProducers);
+    for (u32 p = 0; p < kProducers; ++p) {
+        expect(check, next_seq[p] == kItemsPerProducer, "mpsc_queue nothing missing", p);
+    }
+    mpsc_queue_free(&queue);
+}
+
+// Bytes of the stream the pty check sends. An LCG, so a dropped or repeated byte shows up right where it happened
+static u8 next_stream_byte(u32 *state)
+{
+    *state = *state * 1664525 + 1013904223;
+    return (u8)(*state >> 24);
+}
+
+// The controller's read path over a real pty at a sustained rate. This end writes a known byte stream at `pty_rate`,
+// a reader thread drains the other end into an SPSCRing the way the controller's reader_thread does, and a consumer
+// that only looks at the ring once per 16 ms frame checks that every byte made it, in order
+static void check_pty_throughput(SelfCheck *check)
+{
+    // Same as the controller's kReaderRingSize
+    static constexpr u32 kRingSize = 4_MB;
+    static constexpr u32 kChunk = 4_KB;
+    static constexpr u32 kSeed = 1234;
+
+    Simulator sim;
+    if (!open_pty(&sim)) {
+        expect(check, false, "pty open", 0);
+        return;
+    }
+    // Opened like the controller opens a serial port
+    int fd = open(ptsname(sim.master_fd), O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    SPSCRing ring;
+    _defer
+    {
+        close(fd);
+        close(sim.slave_fd);
+        close(sim.master_fd);
+        spsc_ring_free(&ring);
+    };
+    if (fd < 0 || !spsc_ring_init(&ring, kRingSize)) {
+        expect(check, false, "pty open", 0);
+        return;
+    }
+    termios tty;
+    tcgetattr(fd, &tty);
+    cfmakeraw(&tty);
+    tty.c_cc[VMIN] = 1;
+    tty.c_cc[VTIME] = 0;
+    tcsetattr(fd, TCSANOW, &tty);
+
+    std::atomic<bool> running = true;
+    std::atomic<u32> stalls = 0;
+    std::thread reader([&] {
+        using namespace std::chrono_literals;
+        while (running.load(std::memory_order_relaxed)) {
+            RingSpan span = spsc_ring_write_span(&ring);
+            if (span.len == 0) {
+                stalls.fetch_add(1, std::memory_order_relaxed);
+                std::this_thread::sleep_for(1ms);
+                continue;
+            }
+            pollfd pfd = {fd, POLLIN, 0};
+            if (poll(&pfd, 1, 50) <= 0) {
+                continue;
+            }
+            ssize_t n = read(fd, span.data, span.len);
+            if (n > 0) {
+                spsc_ring_commit(&ring, (u32)n);
+            }
+        }
+    });
+
+    std::atomic<u64> received = 0;
+    std::atomic<u64> mismatches = 0;
+    std::thread consumer([&] {
+        using namespace std::chrono_literals;
+        u32 state = kSeed;
+        while (running.load(std::memory_order_relaxed)) {
+            u32 start = spsc_ring_read_pos(&ring);
+            u32 end = spsc_ring_write_pos(&ring);
+            RingRange range = spsc_ring_peek(&ring, start, end - start);
+            u64 bad = 0;
+            for (RingSpan span : {range.first, range.second}) {
+                for (u32 i = 0; i < span.len; ++i) {
+                    bad += span.data[i] != next_stream_byte(&state);
+                }
+            }
+            spsc_ring_release(&ring, end);
+            mismatches.fetch_add(bad, std::memory_order_relaxed);
+            received.fetch_add(end - start, std::memory_order_release);
+            std::this_thread::sleep_for(16ms);
+        }
+    });
+
+    // Paced off the clock so the rate holds on average, in chunks about the size of a USB transfer
+    u64 total = (u64)(check->pty_rate * 1e6 * check->pty_seconds);
+    u64 sent = 0;
+    u32 state = kSeed;
+    std::vector<u8> chunk(kChunk);
+    auto start = Clock::now();
+    while (sent < total) {
+        f64 elapsed = std::chrono::duration<f64>(Clock::now() - start).count();
+        u64 due = std::min(total, (u64)(check->pty_rate * 1e6 * elapsed));
+        if (due <= sent) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+        u32 len = (u32)std::min<u64>(kChunk, due - sent);
+        for (u32 i = 0; i < len; ++i) {
+            chunk[i] = next_stream_byte(&state);
+        }
+        for (u32 written = 0; written < len;) {
+            ssize_t n = write(sim.master_fd, chunk.data() + written, len - written);
+            if (n > 0) {
+                written += (u32)n;
+                continue;
+            }
+            // The pty only takes a few KB at a time, the reader has to keep up
+            pollfd pfd = {sim.master_fd, POLLOUT, 0};
+            poll(&pfd, 1, 100);
+        }
+        sent += len;
+    }
+    f64 send_seconds = std::chrono::duration<f64>(Clock::now() - start).count();
+
+    auto give_up_at = Clock::now() + std::chrono::seconds(5);
+    while (received.load(std::memory_order_acquire) < sent && Clock::now() < give_up_at) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    running.store(false, std::memory_order_relaxed);
+    reader.join();
+    consumer.join();
+
+    expect(check, received.load() == sent, "pty every byte arrived", (u32)(sent / 1_KB));
+    expect(check, mismatches.load() == 0, "pty bytes in order", (u32)(sent / 1_KB));
+    printf("pty      %.1f MB in %.2f s (%.2f MB/s), %llu received, reader stalled %u times\n",
+           sent / 1e6,
+           send_seconds,
+           sent / 1e6 / send_seconds,
+           (unsigned long long)received.load(),
+           stalls.load());
+}
+
+// Runs the vector code against the scalar references it has to match exactly, on random data and on every length
+// around the widths the kernels work in. Then the command queue under contention and the read path over a pty
+static int run_self_check(const SimConfig &config)
+{
+    SelfCheck check;
+    check.pty_rate = config.pty_rate;
+    check.pty_seconds = config.pty_seconds;
+    struct {
+        const char *name;
+        void (*run)(SelfCheck *);
+    } checks[] = {
+        {"cobs", check_cobs},
+        {"crc", check_crc},
+        {"varint", check_varint},
+        {"correct", check_correction},
+        {"mpsc", check_mpsc_queue},
+        {"pty", check_pty_throughput},
+    };
+
+    for (const auto &entry : checks) {
+        u64 cases = check.cases;
+        u64 failures = check.failures;
+        entry.run(&check);
+        printf("%-8s %llu cases, %llu failed\n",
+               entry.name,
+               (unsigned long long)(check.cases - cases),
+               (unsigned long long)(check.failures - failures));
+    }
+    printf("%s\n", check.failures == 0 ? "All good" : "FAILED");
+    return check.failures == 0 ? 0 : 1;
+}
+
+////////////////////////////////////////////////////////////////
+//// Main loop
+////////////////////////////////////////////////////////////////
+
+static bool parse_args(int argc, char **argv, SimConfig *config)
+{
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--pixels" && has_value) {
+            config->pixels = std::min((u32)atoi(argv[++i]), kMaxPixelCount);
+        } else if (arg == "--rate" && has_value) {
+            config->result_rate = atof(argv[++i]);
+        } else if (arg == "--log-rate" && has_value) {
+            config->log_rate = atof(argv[++i]);
+        } else if (arg == "--corrupt" && has_value) {
+            config->corrupt_probability = atof(argv[++i]);
+        } else if (arg == "--link" && has_value) {
+            config->link_path = argv[++i];
+        } else if (arg == "--instant") {
+            config->instant = true;
+        } else if (arg == "--legacy") {
+            config->legacy = true;
+        } else if (arg == "--encoding" && has_value) {
+            std::string name = argv[++i];
+            u8 encoding = 0;
+            while (encoding <= (u8)PixelEncoding::MAX && name != get_pixel_encoding_name((PixelEncoding)encoding)) {
+                encoding++;
+            }
+            if (encoding > (u8)PixelEncoding::MAX) {
+                fprintf(stderr, "Unknown pixel encoding [%s]\n", name.c_str());
+                return false;
+            }
+            config->pixel_encoding = (PixelEncoding)encoding;
+        } else if (arg == "--measure" && has_value) {
+            config->measure_path = argv[++i];
+        } else if (arg == "--baud" && has_value) {
+            config->baud = std::max(atoi(argv[++i]), 1);
+        } else if (arg == "--bench") {
+            config->bench = true;
+        } else if (arg == "--self-check") {
+            config->self_check = true;
+        } else if (arg == "--pty-rate" && has_value) {
+            config->pty_rate = std::max(atof(argv[++i]), 0.001);
+        } else if (arg == "--pty-seconds" && has_value) {
+            config->pty_seconds = std::max(atof(argv[++i]), 0.0);
+        } else {
+            fprintf(stderr, "Unknown argument [%s]\n", arg.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    Simulator sim;
+    if (!parse_args(argc, argv, &sim.config)) {
+        return 1;
+    }
+    if (sim.config.measure_path) {
+        return measure_pixel_encodings(sim.config);
+    }
+    if (sim.config.bench) {
+        return run_decode_benchmark(sim.config);
+    }
+    if (sim.config.self_check) {
+        return run_self_check(sim.config);
+    }
+    if (!open_pty(&sim)) {
+        return 1;
+    }
+    sim.pixel_encoding = sim.config.pixel_encoding;
+
+    using namespace std::chrono;
+    auto result_period = duration_cast<Clock::duration>(duration<f64>(1.0 / std::max(sim.config.result_rate, 1e-9)));
+    auto log_period = duration_cast<Clock::duration>(duration<f64>(1.0 / std::max(sim.config.log_rate, 1e-9)));
+    auto next_result = Clock::now();
+    auto next_log = Clock::now();
+    auto next_report = Clock::now() + 1s;
+    SimStats last_stats;
+
+    while (true) {
+        auto now = Clock::now();
+
+        while (!sim.pending.empty() && sim.pending.front().ready_at <= now) {
+            send_ccd_result(&sim, sim.pending.front());
+            sim.pending.pop_front();
+        }
+        if (sim.config.result_rate > 0) {
+            for (; next_result <= now; next_result += result_period) {
+                send_ccd_result(&sim, {now, sim.next_stream_id++, 1, 1000});
+            }
+        }
+        if (sim.config.log_rate > 0) {
+            for (; next_log <= now; next_log += log_period) {
+                char msg[64];
+                snprintf(msg, sizeof(msg), "Simulated log line %llu", (unsigned long long)sim.stats.logs);
+                send_log(&sim, msg);
+            }
+        }
+        flush_tx(&sim);
+
+        if (now >= next_report) {
+            next_report += 1s;
+            printf("results %llu/s  logs %llu/s  %.2f MB/s  commands %llu  bad %llu  crc errors %llu  corrupted %llu  "
+                   "dropped %llu\n",
+                   (unsigned long long)(sim.stats.results - last_stats.results),
+                   (unsigned long long)(sim.stats.logs - last_stats.logs),
+                   (sim.stats.bytes_sent - last_stats.bytes_sent) / 1e6,
+                   (unsigned long long)sim.stats.commands,
+                   (unsigned long long)sim.stats.bad_commands,
+                   (unsigned long long)sim.stats.crc_errors,
+                   (unsigned long long)sim.stats.corrupted,
+                   (unsigned long long)sim.stats.dropped);
+            fflush(stdout);
+            last_stats = sim.stats;
+        }
+
+        // Sleep until the next thing we have to do, or until the controller sends something
+        auto wake_at = next_report;
+        if (!sim.pending.empty()) {
+            wake_at = std::min(wake_at, sim.pending.front().ready_at);
+        }
+        if (sim.config.result_rate > 0) {
+            wake_at = std::min(wake_at, next_result);
+        }
+        if (sim.config.log_rate > 0) {
+            wake_at = std::min(wake_at, next_log);
+        }
+
+        pollfd pfd = {sim.master_fd, POLLIN, 0};
+        if (!sim.tx.empty()) {
+            pfd.events |= POLLOUT;
+        }
+        auto timeout = duration_cast<milliseconds>(wake_at - Clock::now()).count();
+        poll(&pfd, 1, (int)std::max<s64>(timeout, 0));
+        if (pfd.revents & POLLIN) {
+            read_host(&sim);
+        }
+    }
+}
@@ -0,0 +1,151 @@
+#pragma once
+#include "shorthand.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+
+// Lock-free single producer / single consumer byte ring.
+// Positions are free running counters and the index into `data` is `pos & (capacity - 1)`, so the capacity has to
+// be a power of two and `write_pos - read_pos` is always the amount of bytes in flight, even after the u32 wraps.
+// Only the producer stores `write_pos` and only the consumer stores `read_pos`.
+struct SPSCRing {
+    u8 *data = nullptr;
+    u32 capacity = 0;
+    // Bytes allocated past the end that only the consumer writes to, see spsc_ring_init
+    u32 overrun = 0;
+
+    // Each side gets its own cache line so the reader thread and the UI thread don't false share
+    alignas(64) std::atomic<u32> write_pos = 0;
+    alignas(64) std::atomic<u32> read_pos = 0;
+};
+
+struct RingSpan {
+    u8 *data;
+    u32 len;
+};
+
+// `overrun` extra bytes go after the end. The producer never touches them, so a consumer rewriting what it read in
+// place can keep going in a straight line past the end instead of wrapping
+inline bool spsc_ring_init(SPSCRing *ring, u32 capacity, u32 overrun = 0)
+{
+    ASSERT((capacity & (capacity - 1)) == 0);
+    ring->data = (u8 *)calloc(1, capacity + overrun);
+    ring->capacity = capacity;
+    ring->overrun = overrun;
+    ring->write_pos.store(0, std::memory_order_relaxed);
+    ring->read_pos.store(0, std::memory_order_relaxed);
+    return ring->data != nullptr;
+}
+
+inline void spsc_ring_free(SPSCRing *ring)
+{
+    free(ring->data);
+    ring->data = nullptr;
+    ring->capacity = 0;
+    ring->overrun = 0;
+}
+
+////////////////////////////////////////////////////////////////
+//// Producer side
+////////////////////////////////////////////////////////////////
+
+// Largest contiguous free region starting at the write position. Fill it and then call `spsc_ring_commit`.
+inline RingSpan spsc_ring_write_span(SPSCRing *ring)
+{
+    u32 write = ring->write_pos.load(std::memory_order_relaxed);
+    u32 read = ring->read_pos.load(std::memory_order_acquire);
+    u32 free_space = ring->capacity - (write - read);
+    u32 index = write & (ring->capacity - 1);
+    return {ring->data + index, std::min(free_space, ring->capacity - index)};
+}
+
+inline void spsc_ring_commit(SPSCRing *ring, u32 len)
+{
+    u32 write = ring->write_pos.load(std::memory_order_relaxed);
+    ring->write_pos.store(write + len, std::memory_order_release);
+}
+
+// Copies as much of `data` as fits, returns the amount of bytes written
+inline u32 spsc_ring_write(SPSCRing *ring, const void *data, u32 len)
+{
+    u32 written = 0;
+    while (written < len) {
+        RingSpan span = spsc_ring_write_span(ring);
+        if (span.len == 0) {
+            break;
+        }
+        u32 n = std::min(span.len, len - written);
+        memcpy(span.data, (const u8 *)data + written, n);
+        spsc_ring_commit(ring, n);
+        written += n;
+    }
+    return written;
+}
+
+////////////////////////////////////////////////////////////////
+//// Consumer side
+////////////////////////////////////////////////////////////////
+
+inline u32 spsc_ring_readable(SPSCRing *ring)
+{
+    u32 read = ring->read_pos.load(std::memory_order_relaxed);
+    return ring->write_pos.load(std::memory_order_acquire) - read;
+}
+
+// Position the producer has published up to. Everything in [read_pos, write_pos) can be looked at in place
+inline u32 spsc_ring_write_pos(SPSCRing *ring)
+{
+    return ring->write_pos.load(std::memory_order_acquire);
+}
+
+inline u32 spsc_ring_read_pos(SPSCRing *ring)
+{
+    return ring->read_pos.load(std::memory_order_relaxed);
+}
+
+// In place view of [pos, pos + len), which has to be inside the readable range. When the range crosses the end of
+// the buffer `second` holds the part that wrapped around to the start, otherwise its len is 0
+struct RingRange {
+    RingSpan first;
+    RingSpan second;
+};
+
+inline RingRange spsc_ring_peek(SPSCRing *ring, u32 pos, u32 len)
+{
+    u32 index = pos & (ring->capacity - 1);
+    u32 first = std::min(len, ring->capacity - index);
+    return {
+        {ring->data + index, first},
+        {ring->data, len - first},
+    };
+}
+
+// Where `pos` is in the buffer. From there on up to `overrun` bytes past the end are in a straight line
+inline u8 *spsc_ring_at(SPSCRing *ring, u32 pos)
+{
+    return ring->data + (pos & (ring->capacity - 1));
+}
+
+// Hands everything before `pos` back to the producer
+inline void spsc_ring_release(SPSCRing *ring, u32 pos)
+{
+    ring->read_pos.store(pos, std::memory_order_release);
+}
+
+// Copies up to `len` bytes out of the ring and releases them to the producer
+inline u32 spsc_ring_read(SPSCRing *ring, void *out, u32 len)
+{
+    u32 read = ring->read_pos.load(std::memory_order_relaxed);
+    u32 available = ring->write_pos.load(std::memory_order_acquire) - read;
+    u32 n = std::min(available, len);
+
+    u32 index = read & (ring->capacity - 1);
+    u32 first = std::min(n, ring->capacity - index);
+    memcpy(out, ring->data + index, first);
+    memcpy((u8 *)out + first, ring->data, n - first);
+
+    ring->read_pos.store(read + n, std::memory_order_release);
+    return n;
+}
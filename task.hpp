@@ -0,0 +1,54 @@
+#pragma once
+#include "shorthand.hpp"
+
+#include <coroutine>
+#include <exception>
+#include <vector>
+
+// Fire and forget coroutine. It starts running right away and frees itself once it's done, nobody holds on to it.
+// Whatever it co_awaits has to hand it to a TaskExecutor to get it going again
+struct Task {
+    struct promise_type {
+        Task get_return_object()
+        {
+            return {};
+        }
+        std::suspend_never initial_suspend() noexcept
+        {
+            return {};
+        }
+        std::suspend_never final_suspend() noexcept
+        {
+            return {};
+        }
+        void return_void() {}
+        void unhandled_exception()
+        {
+            std::terminate();
+        }
+    };
+};
+
+// Single threaded executor for Tasks. Awaitables schedule the coroutines they complete and the owner resumes them
+// with `task_executor_run`, so a coroutine never runs in the middle of whatever completed it
+struct TaskExecutor {
+    std::vector<std::coroutine_handle<>> ready;
+    std::vector<std::coroutine_handle<>> running;
+};
+
+inline void task_executor_schedule(TaskExecutor *executor, std::coroutine_handle<> handle)
+{
+    executor->ready.push_back(handle);
+}
+
+// Resumes everything scheduled so far, returns how many. Coroutines scheduled while these run wait for the next call
+inline u32 task_executor_run(TaskExecutor *executor)
+{
+    executor->running.swap(executor->ready);
+    for (std::coroutine_handle<> handle : executor->running) {
+        handle.resume();
+    }
+    u32 count = (u32)executor->running.size();
+    executor->running.clear();
+    return count;
+}
@@ -4,12 +4,24 @@
 #include "implot.h"
 
 #include "app.hpp"
+#include "db.hpp"
 #include "log.hpp"
+#include "protocol.hpp"
 
 static struct UIState {
     s32 selected_com_port = -1;
+    // Device CCD commands go to
+    u32 selected_device = 0;
+    // Id of the result that gets plotted, rows move when older results get paged in. 0 is no result
+    u32 selected_operation = 0;
 } gUIState;
 
+// Row in App::ccd_operations, -1 when nothing is selected
+static s64 get_selected_operation(App *app)
+{
+    return ccd_store_find(&app->ccd_operations, gUIState.selected_operation);
+}
+
 static bool date_picker_widget(const char *id, std::chrono::year_month_day *ymd)
 {
     using namespace std::chrono;
@@ -84,7 +96,8 @@ static bool date_picker_widget(const char *id, std::chrono::year_month_day *ymd)
     return changed;
 }
 
-static void draw_plot(CCDOperation *op)
+// `row` is -1 when there's nothing to plot
+static void draw_plot(App *app, s64 row)
 {
 #if 0
     if (app->operation_selection_changed) {
@@ -94,24 +107,34 @@ static void draw_plot(CCDOperation *op)
 #endif
 
     if (ImPlot::BeginPlot("Averaged values", ImVec2(-1, -1))) {
-        if (op) {
-            auto date = [op] { return std::format("{:%d-%m-%Y %H:%M:%OS}", op->ts); };
+        if (row >= 0) {
+            const std::string &name = app->ccd_operations.names[row];
+            auto date = [&] { return std::format("{:%d-%m-%Y %H:%M:%OS}", app->ccd_operations.timestamps[row]); };
+            const CCDPixels &pixels = get_ccd_operation_pixels(app, (u32)row);
+            // Reflectance is around 0 - 1 and the counts go to the thousands, it gets an axis of its own
+            if (!pixels.corrected.empty()) {
+                ImPlot::SetupAxis(ImAxis_Y2, "Reflectance", ImPlotAxisFlags_AuxDefault);
+            }
             // ImPlot::SetupAxisFormat(ImAxis_Y1, "%u");
-            ImPlot::PlotLine(op->name.empty() ? date().c_str() : op->name.c_str(),
-                             op->accumulated_values.data(),
-                             (int)op->accumulated_values.size());
+            ImPlot::PlotLine(name.empty() ? date().c_str() : name.c_str(), pixels.raw.data(), (int)pixels.raw.size());
+            if (!pixels.corrected.empty()) {
+                ImPlot::SetAxes(ImAxis_X1, ImAxis_Y2);
+                ImPlot::PlotLine("Reflectance", pixels.corrected.data(), (int)pixels.corrected.size());
+            }
         }
         ImPlot::EndPlot();
     }
 }
 
-static void draw_com_port_selector(Comms *comms)
+static void draw_connection_controls(Comms *comms)
 {
     static s32 selected_com_port = 0;
     static char com_port_path[256];
+    static bool record_capture = false;
+    static char capture_path[256] = "capture.ecap";
+    static bool replay_realtime = false;
+    static char replay_path[256];
 
-    ImGui::SetNextWindowSize(ImVec2(500, -1), ImGuiCond_Appearing);
-    ImGui::Begin("Device Connection");
     bool has_enumerated_ports = !comms->enumerated_ports.empty();
     if (has_enumerated_ports) {
         auto getter = [](void *d, int indx) {
@@ -132,8 +155,15 @@ static void draw_com_port_selector(Comms *comms)
         ImGui::InputText("Com port", com_port_path, sizeof(com_port_path));
     }
 
+    ImGui::Checkbox("Record raw capture", &record_capture);
+    if (record_capture) {
+        ImGui::SameLine();
+        ImGui::InputText("##capture_path", capture_path, sizeof(capture_path));
+    }
+
     ImGui::BeginDisabled(!has_enumerated_ports && strlen(com_port_path) == 0);
     if (ImGui::Button("Connect to device")) {
+        comms->capture_path = record_capture ? capture_path : "";
         queue_command({
             .type = AppCommand::ConnectToDevice,
             .data{
@@ -148,31 +178,349 @@ static void draw_com_port_selector(Comms *comms)
         ImGui::SameLine();
         ImGui::Text("Connection error");
     }
+
+    ImGui::SeparatorText("Replay");
+    ImGui::InputText("Capture file", replay_path, sizeof(replay_path));
+    ImGui::Checkbox("Real time", &replay_realtime);
+    ImGui::BeginDisabled(strlen(replay_path) == 0);
+    if (ImGui::Button("Replay capture")) {
+        queue_command({
+            .type = AppCommand::ReplayCapture,
+            .data{.replay = {{replay_path, strlen(replay_path)}, replay_realtime}},
+        });
+    }
+    ImGui::EndDisabled();
+}
+
+static void draw_com_port_selector(Comms *comms)
+{
+    ImGui::SetNextWindowSize(ImVec2(500, -1), ImGuiCond_Appearing);
+    ImGui::Begin("Device Connection");
+    draw_connection_controls(comms);
     ImGui::End();
 }
 
-static void draw_controls(App *app)
+static void draw_devices(Comms *comms)
+{
+    constexpr ImGuiTableFlags table_flags =
+        ImGuiTableFlags_RowBg | ImGuiTableFlags_BordersOuter | ImGuiTableFlags_BordersV | ImGuiTableFlags_Resizable;
+
+    if (ImGui::BeginTable("devices", 13, table_flags)) {
+        ImGui::TableSetupColumn("Id", ImGuiTableColumnFlags_WidthFixed);
+        ImGui::TableSetupColumn("Path", ImGuiTableColumnFlags_WidthStretch);
+        ImGui::TableSetupColumn("State", ImGuiTableColumnFlags_WidthFixed);
+        ImGui::TableSetupColumn("Received (MB)", ImGuiTableColumnFlags_WidthFixed);
+        ImGui::TableSetupColumn("Frames", ImGuiTableColumnFlags_WidthFixed);
+        ImGui::TableSetupColumn("CRC errors", ImGuiTableColumnFlags_WidthFixed);
+        ImGui::TableSetupColumn("Oversized frames", ImGuiTableColumnFlags_WidthFixed);
+        ImGui::TableSetupColumn("Ring full stalls", ImGuiTableColumnFlags_WidthFixed);
+        ImGui::TableSetupColumn("Commands / writes", ImGuiTableColumnFlags_WidthFixed);
+        ImGui::TableSetupColumn("In flight / timeouts", ImGuiTableColumnFlags_WidthFixed);
+        ImGui::TableSetupColumn("Latency avg / max (ms)", ImGuiTableColumnFlags_WidthFixed);
+        ImGui::TableSetupColumn("Pixel encoding", ImGuiTableColumnFlags_WidthFixed);
+        ImGui::TableSetupColumn("##disconnect", ImGuiTableColumnFlags_WidthFixed);
+        ImGui::TableHeadersRow();
+
+        for (const DeviceConnection &conn : comms->connections) {
+            ImGui::PushID((int)conn.device_id);
+            _defer
+            {
+                ImGui::PopID();
+            };
+
+            DeviceStats stats = get_device_stats(&conn);
+            ImGui::TableNextRow();
+            ImGui::TableNextColumn();
+            ImGui::Text("%u", conn.device_id);
+            ImGui::TableNextColumn();
+            ImGui::TextUnformatted(conn.com_path.c_str());
+            ImGui::TableNextColumn();
+            if (stats.lost) {
+                ImGui::TextColored(ImVec4(1, 0, 0, 1), "Lost");
+            } else {
+                ImGui::TextUnformatted(stats.is_replay ? "Replay" : "Connected");
+            }
+            ImGui::TableNextColumn();
+            ImGui::Text("%.2f", stats.rx_bytes / (f64)1_MB);
+            ImGui::TableNextColumn();
+            ImGui::Text("%llu", (unsigned long long)stats.rx_frames);
+            ImGui::TableNextColumn();
+            ImGui::Text("%llu", (unsigned long long)stats.rx_crc_errors);
+            ImGui::TableNextColumn();
+            ImGui::Text("%llu", (unsigned long long)stats.rx_oversized_frames);
+            ImGui::TableNextColumn();
+            ImGui::Text("%u", stats.rx_full_stalls);
+            ImGui::TableNextColumn();
+            ImGui::Text("%llu / %llu", (unsigned long long)stats.tx_commands, (unsigned long long)stats.tx_writes);
+            ImGui::TableNextColumn();
+            ImGui::Text("%u / %llu", stats.commands_in_flight, (unsigned long long)stats.command_timeouts);
+            ImGui::TableNextColumn();
+            ImGui::Text("%.1f / %.1f", stats.avg_command_latency_ms, stats.max_command_latency_ms);
+            ImGui::TableNextColumn();
+            // Delta is the smallest on the wire, packed the cheapest to decode. The device has to support them, one
+            // picked before its info is in waits for it
+            bool can_switch = !conn.has_info || has_capability(conn.capabilities, DeviceCapability::PixelEncoding);
+            ImGui::BeginDisabled(stats.is_replay || !can_switch);
+            ImGui::SetNextItemWidth(ImGui::CalcTextSize("absolute").x + ImGui::GetFrameHeight() * 2);
+            if (ImGui::BeginCombo("##encoding", get_pixel_encoding_name(conn.pixel_encoding))) {
+                for (u8 i = 0; i <= (u8)PixelEncoding::MAX; ++i) {
+                    PixelEncoding encoding = (PixelEncoding)i;
+                    if (ImGui::Selectable(get_pixel_encoding_name(encoding), encoding == conn.pixel_encoding)) {
+                        queue_command({.type = AppCommand::SetPixelEncoding,
+                                       .data{.pixel_encoding = {conn.device_id, encoding}}});
+                    }
+                }
+                ImGui::EndCombo();
+            }
+            ImGui::EndDisabled();
+            ImGui::TableNextColumn();
+            if (ImGui::SmallButton("Disconnect")) {
+                queue_command({.type = AppCommand::DisconnectDevice, .data{.device_id = conn.device_id}});
+            }
+        }
+
+        ImGui::EndTable();
+    }
+
+    // Results are written in the background, a queue that keeps growing means the disk can't keep up
+    DBWriterStats db_stats = db_get_writer_stats();
+    ImGui::Text("DB queue: %u (max %u), %llu writes in %llu transactions, %llu failed",
+                db_stats.queue_depth,
+                db_stats.max_queue_depth,
+                (unsigned long long)db_stats.writes,
+                (unsigned long long)db_stats.transactions,
+                (unsigned long long)db_stats.failed_writes);
+    ImGui::Text("DB flush: last %.2f ms for %u writes, max %.2f ms",
+                db_stats.last_flush_ms,
+                db_stats.last_batch_size,
+                db_stats.max_flush_ms);
+    // The main loop only draws when something changed, skipped frames are wake ups that didn't need one
+    FrameStats frame_stats = get_frame_stats();
+    ImGui::Text("Frames: %llu rendered, %llu skipped",
+                (unsigned long long)frame_stats.frames_rendered,
+                (unsigned long long)frame_stats.frames_skipped);
+
+    ImGui::Spacing();
+    ImGui::SeparatorText("Add device");
+    draw_connection_controls(comms);
+}
+
+static void draw_acquisition_plan(const DeviceConnection *device)
+{
+    // StartAcquisition copies the steps when it runs, which is before the next draw can change them
+    static std::vector<AcquisitionStep> plan = {{1000, 1, 1, 0}};
+
+    const AcquisitionRun *run = device ? &device->acquisition : nullptr;
+    bool running = run && run->running;
+
+    constexpr ImGuiTableFlags table_flags =
+        ImGuiTableFlags_RowBg | ImGuiTableFlags_BordersOuter | ImGuiTableFlags_BordersV;
+
+    ImGui::BeginDisabled(running);
+    if (ImGui::BeginTable("plan", 5, table_flags)) {
+        ImGui::TableSetupColumn("Exposure (us)");
+        ImGui::TableSetupColumn("Iterations");
+        ImGui::TableSetupColumn("Repeat");
+        ImGui::TableSetupColumn("Delay (ms)");
+        ImGui::TableSetupColumn("##remove", ImGuiTableColumnFlags_WidthFixed);
+        ImGui::TableHeadersRow();
+
+        for (u32 i = 0; i < plan.size(); ++i) {
+            ImGui::PushID((int)i);
+            _defer
+            {
+                ImGui::PopID();
+            };
+
+            AcquisitionStep &step = plan[i];
+            ImGui::TableNextRow();
+            u32 *fields[] = {&step.exposure, &step.iterations, &step.repeat, &step.delay_ms};
+            for (u32 f = 0; f < 4; ++f) {
+                ImGui::TableNextColumn();
+                ImGui::PushID((int)f);
+                ImGui::SetNextItemWidth(-FLT_MIN);
+                ImGui::InputScalar("##field", ImGuiDataType_U32, fields[f], NULL, NULL, "%u");
+                ImGui::PopID();
+            }
+            ImGui::TableNextColumn();
+            if (ImGui::SmallButton("Remove")) {
+                plan.erase(plan.begin() + i);
+                break;
+            }
+        }
+
+        ImGui::EndTable();
+    }
+    if (ImGui::Button("Add step")) {
+        plan.push_back(plan.empty() ? AcquisitionStep{1000, 1, 1, 0} : plan.back());
+    }
+    ImGui::EndDisabled();
+
+    ImGui::SameLine();
+    if (running) {
+        if (ImGui::Button("Stop plan")) {
+            queue_command({.type = AppCommand::StopAcquisition, .data{.device_id = device->device_id}});
+        }
+    } else {
+        ImGui::BeginDisabled(!device || plan.empty());
+        if (ImGui::Button("Run plan")) {
+            queue_command({
+                .type = AppCommand::StartAcquisition,
+                .data{.acquisition = {device->device_id, plan.data(), (u32)plan.size()}},
+            });
+        }
+        ImGui::EndDisabled();
+    }
+
+    if (!run || run->total == 0) {
+        return;
+    }
+
+    // Progress of the running plan or the last one that ran on this device
+    static char progress[64];
+    auto r = std::format_to_n(progress, sizeof(progress) - 1, "{}/{}", run->done, run->total);
+    *r.out = 0;
+    ImGui::ProgressBar(run->done / (f32)run->total, ImVec2(-FLT_MIN, 0), progress);
+
+    // Time the sensor spent exposing over the time the plan took, what pipelining is there for
+    f64 exposed_ms = 0;
+    for (u32 i = 0; i < run->steps.size(); ++i) {
+        exposed_ms += run->stats[i].done * (f64)run->steps[i].exposure * run->steps[i].iterations / 1000.0;
+    }
+    f64 elapsed_ms = std::chrono::duration<f64, std::milli>(run->last_result_at - run->started_at).count();
+    ImGui::Text("Sensor busy: %.1f%%", elapsed_ms > 0 ? 100.0 * exposed_ms / elapsed_ms : 0.0);
+
+    if (ImGui::BeginTable("plan-stats", 5, table_flags)) {
+        ImGui::TableSetupColumn("Step");
+        ImGui::TableSetupColumn("Done");
+        ImGui::TableSetupColumn("Latency (ms)");
+        ImGui::TableSetupColumn("Max (ms)");
+        ImGui::TableSetupColumn("Interval (ms)");
+        ImGui::TableHeadersRow();
+
+        for (u32 i = 0; i < run->steps.size(); ++i) {
+            const AcquisitionStepStats &stats = run->stats[i];
+            ImGui::TableNextRow();
+            ImGui::TableNextColumn();
+            ImGui::Text("%u", i);
+            ImGui::TableNextColumn();
+            ImGui::Text("%u/%u", stats.done, run->steps[i].repeat);
+            if (stats.done == 0) {
+                continue;
+            }
+            ImGui::TableNextColumn();
+            ImGui::Text("%.1f", stats.total_latency_ms / stats.done);
+            ImGui::TableNextColumn();
+            ImGui::Text("%.1f", stats.max_latency_ms);
+            ImGui::TableNextColumn();
+            ImGui::Text("%.1f", stats.total_interval_ms / stats.done);
+        }
+
+        ImGui::EndTable();
+    }
+}
+
+static void draw_controls(App *app, Comms *comms)
 {
     static uint32_t exposure_time = 0;
     static uint32_t iterations = 0;
+
+    // The selected device might have been disconnected since last frame
+    const DeviceConnection *device = find_connection(comms, gUIState.selected_device);
+    if (!device && !comms->connections.empty()) {
+        device = &comms->connections[0];
+        gUIState.selected_device = device->device_id;
+    }
+
+    static char device_label[1_KB];
+    auto label = [](const DeviceConnection *conn) {
+        auto r = std::format_to_n(device_label, 1_KB - 1, "[{}] {}", conn->device_id, conn->com_path);
+        *r.out = 0;
+        return device_label;
+    };
+    if (ImGui::BeginCombo("Device", device ? label(device) : "(none)")) {
+        for (const DeviceConnection &conn : comms->connections) {
+            if (ImGui::Selectable(label(&conn), conn.device_id == gUIState.selected_device)) {
+                gUIState.selected_device = conn.device_id;
+            }
+        }
+        ImGui::EndCombo();
+    }
+
     ImGui::InputScalar("Exposure Time (us)", ImGuiDataType_U32, &exposure_time, NULL, NULL, "%u");
     ImGui::InputScalar("Iterations", ImGuiDataType_U32, &iterations, NULL, NULL, "%u");
 
-    ImGui::BeginDisabled(iterations == 0 || exposure_time == 0);
+    ImGui::BeginDisabled(!device || iterations == 0 || exposure_time == 0);
     if (ImGui::Button("Send Command")) {
         queue_command({
             .type = AppCommand::StartCCDOperation,
-            .data{.ccd_op = {exposure_time, iterations}},
+            .data{.ccd_op = {gUIState.selected_device, exposure_time, iterations}},
+        });
+    }
+    ImGui::EndDisabled();
+
+    ImGui::Spacing();
+    ImGui::SeparatorText("Acquisition plan");
+    draw_acquisition_plan(device);
+}
+
+static void draw_correction(App *app)
+{
+    s64 row = get_selected_operation(app);
+    const CCDOperationStore *ops = &app->ccd_operations;
+
+    // The selected result becomes the frame for its own exposure time and iterations
+    ImGui::BeginDisabled(row < 0);
+    if (ImGui::Button("Use selected as dark")) {
+        queue_command({
+            .type = AppCommand::SetCorrectionFrame,
+            .data{.correction_frame = {ops->ids[row], CorrectionFrameKind::Dark}},
+        });
+    }
+    ImGui::SameLine();
+    if (ImGui::Button("Use selected as reference")) {
+        queue_command({
+            .type = AppCommand::SetCorrectionFrame,
+            .data{.correction_frame = {ops->ids[row], CorrectionFrameKind::Reference}},
         });
     }
     ImGui::EndDisabled();
+
+    constexpr ImGuiTableFlags table_flags =
+        ImGuiTableFlags_RowBg | ImGuiTableFlags_BordersOuter | ImGuiTableFlags_BordersV;
+    if (!app->corrections.empty() && ImGui::BeginTable("corrections", 4, table_flags)) {
+        ImGui::TableSetupColumn("Exposure (us)");
+        ImGui::TableSetupColumn("Iterations");
+        ImGui::TableSetupColumn("Dark");
+        ImGui::TableSetupColumn("Reference");
+        ImGui::TableHeadersRow();
+
+        for (const auto &[key, frames] : app->corrections) {
+            ImGui::TableNextRow();
+            ImGui::TableNextColumn();
+            ImGui::Text("%u", (u32)(key >> 32));
+            ImGui::TableNextColumn();
+            ImGui::Text("%u", (u32)key);
+            for (u32 id : {frames.dark_id, frames.reference_id}) {
+                ImGui::TableNextColumn();
+                if (id != 0) {
+                    ImGui::Text("%u", id);
+                } else {
+                    ImGui::TextDisabled("(none)");
+                }
+            }
+        }
+
+        ImGui::EndTable();
+    }
+    ImGui::Text("Corrected results: %llu", (unsigned long long)app->corrected_results);
 }
 
 namespace ImGui {
 int TableGetHoveredRow();
 } // namespace ImGui
 
-static u32 draw_results(App *app)
+static void draw_results(App *app)
 {
     auto resize_cb = [](ImGuiInputTextCallbackData *data) {
         if (data->EventFlag == ImGuiInputTextFlags_CallbackResize) {
@@ -191,7 +539,8 @@ static u32 draw_results(App *app)
         using namespace std::chrono;
         static year_month_day end_date{
             time_point_cast<days>(current_zone()->to_local(system_clock::now()))}; // Current date
-        static year_month_day start_date{sys_days()};                              // Start of epoch
+        // Whatever got loaded last, starting with the recent results main loads and moving back with every page
+        year_month_day start_date{floor<days>(local_seconds(app->ccd_operations_since))};
         auto w = ImGui::GetContentRegionAvail().x * 0.25f;
         ImGui::SetNextItemWidth(w);
         bool changed = date_picker_widget("Start Date", &start_date);
@@ -200,21 +549,30 @@ static u32 draw_results(App *app)
         changed |= date_picker_widget("End Date", &end_date);
         if (changed) {
             auto start = time_point_cast<seconds>(local_days(start_date)).time_since_epoch();
-            auto end = time_point_cast<seconds>(local_days(end_date)).time_since_epoch();
+            // Up to the end of the last day
+            auto end = time_point_cast<seconds>(local_days(end_date) + days(1)).time_since_epoch() - seconds(1);
             queue_command({
-                .type = AppCommand::CCDOperationLoad, .data{.start_date = start, .end_date = end}
+                .type = AppCommand::CCDOperationLoad, .data{.load_range = {start, end}}
             });
         }
     }
 
-    static u32 selected_operation;
+    const CCDPixelCache *cache = &app->ccd_pixels;
+    ImGui::Text("Pixel cache: %.1f / %.1f MB, %zu results, %llu hits, %llu misses, %llu evicted",
+                cache->bytes / (f64)1_MB,
+                cache->budget_bytes / (f64)1_MB,
+                cache->entries.size(),
+                (unsigned long long)cache->hits,
+                (unsigned long long)cache->misses,
+                (unsigned long long)cache->evictions);
 
     constexpr ImGuiTableFlags table_flags = ImGuiTableFlags_ScrollY | ImGuiTableFlags_RowBg
                                             | ImGuiTableFlags_BordersOuter | ImGuiTableFlags_BordersV
                                             | ImGuiTableFlags_Resizable | ImGuiTableFlags_Hideable;
 
-    if (ImGui::BeginTable("completed-reads", 5, table_flags)) {
+    if (ImGui::BeginTable("completed-reads", 6, table_flags)) {
         ImGui::TableSetupColumn("Name", ImGuiTableColumnFlags_WidthFixed);
+        ImGui::TableSetupColumn("Device", ImGuiTableColumnFlags_WidthFixed);
         ImGui::TableSetupColumn("Timestamp", ImGuiTableColumnFlags_WidthFixed);
         ImGui::TableSetupColumn("Exposure time (us)", ImGuiTableColumnFlags_WidthFixed);
         ImGui::TableSetupColumn("Iterations", ImGuiTableColumnFlags_WidthFixed);
@@ -222,22 +580,25 @@ static u32 draw_results(App *app)
         ImGui::TableHeadersRow();
 
         // NOTE - Is an error to change this to be an unsigned type because on 0 size it will underflow
-        for (s32 i = (s32)app->ccd_operations.size() - 1; i >= 0; --i) {
+        CCDOperationStore *ops = &app->ccd_operations;
+        for (s32 i = (s32)ccd_store_size(ops) - 1; i >= 0; --i) {
             ImGui::PushID((int)i);
             _defer
             {
                 ImGui::PopID();
             };
-            CCDOperation const &op = app->ccd_operations[i];
+            u32 id = ops->ids[i];
+            std::string &op_name = ops->names[i];
+            std::string &op_note = ops->notes[i];
 
             static char id_buffer[1_KB];
-            auto temp_name = [&op] {
-                auto s = std::format_to_n(id_buffer, 1_KB - 1, "ccd_result({})", op.id);
+            auto temp_name = [id] {
+                auto s = std::format_to_n(id_buffer, 1_KB - 1, "ccd_result({})", id);
                 *s.out = 0;
                 return id_buffer;
             };
 
-            const char *name = op.name.empty() ? temp_name() : op.name.c_str();
+            const char *name = op_name.empty() ? temp_name() : op_name.c_str();
             if (!filter.PassFilter(name)) {
                 continue;
             }
@@ -247,15 +608,15 @@ static u32 draw_results(App *app)
             if (ImGui::TableNextColumn()) {
 
                 if (ImGui::Selectable(name,
-                                      i == selected_operation,
+                                      id == gUIState.selected_operation,
                                       ImGuiSelectableFlags_SpanAllColumns | ImGuiSelectableFlags_AllowOverlap)) {
-                    selected_operation = i;
+                    gUIState.selected_operation = id;
                     // This is so the graph resizes and re-center when we are re-selecting a new result
                     // TODO remove this from here as its super obscure to what's happening
                     ImPlot::SetNextAxesToFit();
                 }
 
-                if (ImGui::TableGetHoveredRow() == app->ccd_operations.size() - i
+                if (ImGui::TableGetHoveredRow() == ccd_store_size(ops) - i
                     && ImGui::TableGetColumnFlags(-1) & ImGuiTableColumnFlags_IsHovered && ImGui::IsMouseReleased(1)) {
                     ImGui::OpenPopup("Edit Name");
                 }
@@ -265,16 +626,16 @@ static u32 draw_results(App *app)
                         ImGui::SetKeyboardFocusHere();
                     }
                     ImGui::InputText("##name",
-                                     (char *)op.name.c_str(),
-                                     std::min(op.name.capacity(), kMaxNameLen),
+                                     op_name.data(),
+                                     std::min(op_name.capacity(), kMaxNameLen),
                                      ImGuiInputTextFlags_CallbackResize,
                                      resize_cb,
-                                     (void *)&op.name);
+                                     (void *)&op_name);
                     if (ImGui::IsItemDeactivated() || ImGui::Button("Done")) {
                         // TODO this should be done by App and not directly here
-                        if (!op.name.empty()) {
+                        if (!op_name.empty()) {
                             queue_command(
-                                {.type = AppCommand::CCDOperationUpdateNote, .data{.operation_to_update = op.id}});
+                                {.type = AppCommand::CCDOperationUpdateName, .data{.operation_to_update = id}});
                         }
                         ImGui::CloseCurrentPopup();
                     }
@@ -284,24 +645,28 @@ static u32 draw_results(App *app)
                 break;
             }
             ImGui::TableNextColumn();
+            {
+                ImGui::Text("%u", ops->device_ids[i]);
+            }
+            ImGui::TableNextColumn();
             {
                 static char date_buffer[1_KB];
-                std::format_to_n(date_buffer, 1_KB, "{:%d-%m-%Y %H:%M:%OS}", op.ts);
+                std::format_to_n(date_buffer, 1_KB, "{:%d-%m-%Y %H:%M:%OS}", ops->timestamps[i]);
                 ImGui::Text(date_buffer);
             }
             ImGui::TableNextColumn();
             {
-                ImGui::Text("%u", op.exposure_time_in_us);
+                ImGui::Text("%u", ops->exposures[i]);
             }
             ImGui::TableNextColumn();
             {
-                ImGui::Text("%u", op.iterations);
+                ImGui::Text("%u", ops->iterations[i]);
             }
             ImGui::TableNextColumn();
             {
-                ImGui::Text(op.note.empty() ? "(empty)" : op.note.c_str());
+                ImGui::Text(op_note.empty() ? "(empty)" : op_note.c_str());
 
-                if (ImGui::TableGetHoveredRow() == app->ccd_operations.size() - i
+                if (ImGui::TableGetHoveredRow() == ccd_store_size(ops) - i
                     && ImGui::TableGetColumnFlags(-1) & ImGuiTableColumnFlags_IsHovered && ImGui::IsMouseReleased(1)) {
                     ImGui::OpenPopup("Edit Note");
                 }
@@ -311,17 +676,17 @@ static u32 draw_results(App *app)
                         ImGui::SetKeyboardFocusHere();
                     }
                     ImGui::InputTextMultiline("##notes",
-                                              (char *)op.note.c_str(),
-                                              std::min(op.note.capacity(), kMaxNoteLen),
+                                              op_note.data(),
+                                              std::min(op_note.capacity(), kMaxNoteLen),
                                               ImVec2(0, 0),
                                               ImGuiInputTextFlags_CallbackResize,
                                               resize_cb,
-                                              (void *)&op.note);
+                                              (void *)&op_note);
                     if (ImGui::IsItemDeactivatedAfterEdit() || ImGui::Button("Done")) {
                         // TODO this should be done by App and not directly here
-                        if (!op.note.empty()) {
+                        if (!op_note.empty()) {
                             queue_command(
-                                {.type = AppCommand::CCDOperationUpdateNote, .data{.operation_to_update = op.id}});
+                                {.type = AppCommand::CCDOperationUpdateNote, .data{.operation_to_update = id}});
                         }
                         ImGui::CloseCurrentPopup();
                     }
@@ -330,10 +695,17 @@ static u32 draw_results(App *app)
             }
         }
 
+        // Newest first, so older results get paged in at the bottom
+        if (app->has_older_ccd_operations) {
+            ImGui::TableNextRow();
+            ImGui::TableNextColumn();
+            if (ImGui::SmallButton("Load older")) {
+                queue_command({.type = AppCommand::CCDOperationLoadOlder});
+            }
+        }
+
         ImGui::EndTable();
     }
-
-    return selected_operation;
 }
 
 static void draw_log()
@@ -366,7 +738,9 @@ static void draw_log()
         ImGui::TableSetupColumn("Message", ImGuiTableColumnFlags_WidthStretch);
         ImGui::TableHeadersRow();
 
-        const auto &logs = get_log_lines();
+        // Other threads log too, this is a copy that only gets what's new added to it
+        static std::vector<LogEntry> logs;
+        get_log_lines(&logs);
         for (const LogEntry &log : logs) {
             if ((s32)log.severity < level) {
                 continue;
@@ -431,7 +805,7 @@ void draw_ui(App *app, Comms *comms)
 
     ImGui::Begin("Main Window", NULL, flags);
 
-    if (comms->com_connection == nullptr) {
+    if (comms->connections.empty()) {
         draw_com_port_selector(comms);
     } else {
         if (ImGui::BeginTabBar("##tabs")) {
@@ -439,22 +813,29 @@ void draw_ui(App *app, Comms *comms)
                 ImGui::BeginChild(
                     "Controls", ImVec2(ImGui::GetContentRegionAvail().x * 0.3f, -FLT_MIN), ImGuiChildFlags_ResizeX);
 
-                draw_controls(app);
+                draw_controls(app, comms);
+
+                ImGui::Spacing();
+                ImGui::SeparatorText("Correction");
+                ImGui::Spacing();
+
+                draw_correction(app);
 
                 ImGui::Spacing();
                 ImGui::SeparatorText("Results");
                 ImGui::Spacing();
 
-                u32 selected = draw_results(app);
+                draw_results(app);
 
                 ImGui::EndChild();
 
                 ImGui::SameLine();
-                CCDOperation *op = nullptr;
-                if (!app->ccd_operations.empty() && selected < app->ccd_operations.size()) {
-                    op = &app->ccd_operations[selected];
-                }
-                draw_plot(op);
+                draw_plot(app, get_selected_operation(app));
+                ImGui::EndTabItem();
+            }
+
+            if (ImGui::BeginTabItem("Devices")) {
+                draw_devices(comms);
                 ImGui::EndTabItem();
             }
 
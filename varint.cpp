@@ -0,0 +1,242 @@
+#include "varint.hpp"
+
+#include "cpu_features.hpp"
+
+#include <cstring>
+#include <vector>
+
+#if SIMD_X86
+#include <immintrin.h>
+#endif
+
+static inline bool decode_one(const u8 **it, const u8 *end, u32 *out)
+{
+    const u8 *p = *it;
+    if (p == end) {
+        return false;
+    }
+
+    u32 value = *p & 0x7F;
+    for (u32 shift = 7; *p & 0x80; shift += 7) {
+        p++;
+        if (p == end || shift >= 32) {
+            return false;
+        }
+        value |= (u32)(*p & 0x7F) << shift;
+    }
+    *out = value;
+    *it = p + 1;
+    return true;
+}
+
+bool decode_varint_u32s_scalar(const u8 *data, u32 len, u32 *out, u32 count, u32 *consumed)
+{
+    const u8 *it = data;
+    const u8 *end = data + len;
+    for (u32 i = 0; i < count; ++i) {
+        if (!decode_one(&it, end, &out[i])) {
+            return false;
+        }
+    }
+    *consumed = (u32)(it - data);
+    return true;
+}
+
+#if SIMD_X86
+// Masked-VByte style. The continuation bits of the next 12 bytes say where the varints starting there end. With all of
+// them at most 2 bytes long they get shuffled into 16 bit lanes (up to 8 at once), with 3 byte ones into 32 bit lanes
+// (up to 4 at once), whichever decodes more. A varint longer than 3 bytes at the front goes through decode_one.
+// Most masks share a shuffle since only the bits of the varints being decoded matter, so the 4096 entry table only
+// holds an index into the 500 distinct shuffles, about 17KB in total
+struct VarintShuffle {
+    u8 shuffle[16];
+    u8 count;
+    u8 lane_bytes; // 2, 4 or 0 when the first varint is too long for the table
+};
+
+static constexpr u32 kShuffleMaskBits = 12;
+static constexpr u32 kMaxShuffles = 512;
+
+struct VarintTables {
+    // Bytes consumed in the low 4 bits, index into `shuffles` above that
+    u16 masks[1 << kShuffleMaskBits];
+    VarintShuffle shuffles[kMaxShuffles];
+    u32 shuffle_count;
+};
+
+// Too much work for a constexpr table on MSVC, so it gets built once when the decoder is picked
+static VarintTables gVarintTables;
+
+static void build_varint_tables()
+{
+    VarintTables *tables = &gVarintTables;
+    // Entry 0 is the one for "use decode_one"
+    tables->shuffle_count = 1;
+
+    // A shuffle is fully defined by the lane size and the continuation bits of the bytes it consumes
+    std::vector<u16> known(2 << (kShuffleMaskBits + 4), 0);
+
+    for (u32 mask = 0; mask < (1 << kShuffleMaskBits); ++mask) {
+        // Lengths of the varints that end inside the 12 bytes
+        u32 lens[kShuffleMaskBits] = {};
+        u32 n = 0;
+        u32 len = 0;
+        for (u32 bit = 0; bit < kShuffleMaskBits; ++bit) {
+            len++;
+            if (!(mask & (1 << bit))) {
+                lens[n++] = len;
+                len = 0;
+            }
+        }
+
+        u32 count_16 = 0;
+        while (count_16 < n && count_16 < 8 && lens[count_16] <= 2) {
+            count_16++;
+        }
+        u32 count_32 = 0;
+        while (count_32 < n && count_32 < 4 && lens[count_32] <= 3) {
+            count_32++;
+        }
+        if (count_16 == 0 && count_32 == 0) {
+            tables->masks[mask] = 0;
+            continue;
+        }
+
+        VarintShuffle shuffle = {};
+        memset(shuffle.shuffle, 0x80, sizeof(shuffle.shuffle)); // pshufb writes 0 for these
+        shuffle.lane_bytes = count_16 >= count_32 ? 2 : 4;
+        shuffle.count = (u8)(shuffle.lane_bytes == 2 ? count_16 : count_32);
+        u32 consumed = 0;
+        for (u32 i = 0; i < shuffle.count; ++i) {
+            for (u32 b = 0; b < lens[i]; ++b) {
+                shuffle.shuffle[i * shuffle.lane_bytes + b] = (u8)(consumed + b);
+            }
+            consumed += lens[i];
+        }
+
+        u32 key = (shuffle.lane_bytes == 4) << (kShuffleMaskBits + 4) | consumed << kShuffleMaskBits
+                  | (mask & ((1 << consumed) - 1));
+        u16 index = known[key];
+        if (index == 0) {
+            ASSERT(tables->shuffle_count < kMaxShuffles);
+            index = (u16)tables->shuffle_count++;
+            tables->shuffles[index] = shuffle;
+            known[key] = index;
+        }
+        tables->masks[mask] = (u16)(index << 4 | consumed);
+    }
+}
+
+TARGET_SSSE3 static bool decode_varint_u32s_ssse3(const u8 *data, u32 len, u32 *out, u32 count, u32 *consumed)
+{
+    const u8 *it = data;
+    const u8 *end = data + len;
+    u32 *out_end = out + count;
+
+    const __m128i low7_16 = _mm_set1_epi16(0x007F);
+    const __m128i high7_16 = _mm_set1_epi16(0x7F00);
+    const __m128i byte0_32 = _mm_set1_epi32(0x0000007F);
+    const __m128i byte1_32 = _mm_set1_epi32(0x00007F00);
+    const __m128i byte2_32 = _mm_set1_epi32(0x007F0000);
+    const __m128i zero = _mm_setzero_si128();
+
+    // Every step loads 16 bytes and stores up to 8 values, so it only runs while both have that much room left
+    while (end - it >= 16 && out_end - out >= 8) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)it);
+        u32 mask = (u32)_mm_movemask_epi8(bytes) & ((1 << kShuffleMaskBits) - 1);
+        u16 mask_entry = gVarintTables.masks[mask];
+        const VarintShuffle &entry = gVarintTables.shuffles[mask_entry >> 4];
+
+        if (entry.lane_bytes == 0) {
+            if (!decode_one(&it, end, out)) {
+                return false;
+            }
+            out++;
+            continue;
+        }
+
+        __m128i lanes = _mm_shuffle_epi8(bytes, _mm_loadu_si128((const __m128i *)entry.shuffle));
+        if (entry.lane_bytes == 2) {
+            __m128i values = _mm_or_si128(_mm_and_si128(lanes, low7_16),
+                                          _mm_srli_epi16(_mm_and_si128(lanes, high7_16), 1));
+            _mm_storeu_si128((__m128i *)out, _mm_unpacklo_epi16(values, zero));
+            _mm_storeu_si128((__m128i *)(out + 4), _mm_unpackhi_epi16(values, zero));
+        } else {
+            __m128i values = _mm_or_si128(_mm_and_si128(lanes, byte0_32),
+                                          _mm_or_si128(_mm_srli_epi32(_mm_and_si128(lanes, byte1_32), 1),
+                                                       _mm_srli_epi32(_mm_and_si128(lanes, byte2_32), 2)));
+            _mm_storeu_si128((__m128i *)out, values);
+        }
+        it += mask_entry & 0xF;
+        out += entry.count;
+    }
+
+    u32 tail_consumed;
+    if (!decode_varint_u32s_scalar(it, (u32)(end - it), out, (u32)(out_end - out), &tail_consumed)) {
+        return false;
+    }
+    *consumed = (u32)(it - data) + tail_consumed;
+    return true;
+}
+#endif
+
+static std::vector<DecodeVarintsImpl> get_supported_decode_varints_impls()
+{
+    std::vector<DecodeVarintsImpl> impls;
+#if SIMD_X86
+    if (get_cpu_features().ssse3) {
+        build_varint_tables();
+        impls.push_back({"ssse3", decode_varint_u32s_ssse3});
+    }
+#endif
+    impls.push_back({"scalar", decode_varint_u32s_scalar});
+    return impls;
+}
+
+std::span<const DecodeVarintsImpl> get_decode_varints_impls()
+{
+    static const std::vector<DecodeVarintsImpl> impls = get_supported_decode_varints_impls();
+    return impls;
+}
+
+bool decode_varint_u32s(const u8 *data, u32 len, u32 *out, u32 count, u32 *consumed)
+{
+    static const DecodeVarintsFn decode = get_decode_varints_impls().front().fn;
+    return decode(data, len, out, count, consumed);
+}
+
+void zigzag_prefix_sum_scalar(u32 *values, u32 count)
+{
+    u32 sum = 0;
+    for (u32 i = 0; i < count; ++i) {
+        sum += (values[i] >> 1) ^ (0u - (values[i] & 1));
+        values[i] = sum;
+    }
+}
+
+void zigzag_prefix_sum(u32 *values, u32 count)
+{
+    u32 i = 0;
+#if SIMD_X86
+    // SSE2 is always there on x64, no need to dispatch. Four lanes get summed with two shifted adds and the running
+    // total from the previous block is broadcast on top
+    const __m128i one = _mm_set1_epi32(1);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i carry = zero;
+    for (; i + 4 <= count; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(values + i));
+        __m128i deltas = _mm_xor_si128(_mm_srli_epi32(v, 1), _mm_sub_epi32(zero, _mm_and_si128(v, one)));
+        deltas = _mm_add_epi32(deltas, _mm_slli_si128(deltas, 4));
+        deltas = _mm_add_epi32(deltas, _mm_slli_si128(deltas, 8));
+        __m128i sums = _mm_add_epi32(deltas, carry);
+        _mm_storeu_si128((__m128i *)(values + i), sums);
+        carry = _mm_shuffle_epi32(sums, _MM_SHUFFLE(3, 3, 3, 3));
+    }
+#endif
+
+    u32 sum = i > 0 ? values[i - 1] : 0;
+    for (; i < count; ++i) {
+        sum += (values[i] >> 1) ^ (0u - (values[i] & 1));
+        values[i] = sum;
+    }
+}
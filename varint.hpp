@@ -0,0 +1,25 @@
+#pragma once
+#include "shorthand.hpp"
+
+#include <span>
+
+// Decodes `count` LEB128 varints from [data, data + len) into `out`, same rules as deserialize_varint<u32>. Returns
+// false when the data runs out or a varint has more groups than fit in a u32, otherwise `consumed` is the amount of
+// bytes read. Uses a SSSE3 shuffle table when the cpu has it
+bool decode_varint_u32s(const u8 *data, u32 len, u32 *out, u32 count, u32 *consumed);
+// One varint at a time, the reference for the version above
+bool decode_varint_u32s_scalar(const u8 *data, u32 len, u32 *out, u32 count, u32 *consumed);
+
+// Every way decode_varint_u32s can run on this cpu, fastest first, decode_varint_u32s goes with the first one. Only
+// here so each of them can be checked against the scalar version
+using DecodeVarintsFn = bool (*)(const u8 *data, u32 len, u32 *out, u32 count, u32 *consumed);
+struct DecodeVarintsImpl {
+    const char *name;
+    DecodeVarintsFn fn;
+};
+std::span<const DecodeVarintsImpl> get_decode_varints_impls();
+
+// Turns zig-zag encoded deltas back into the values they were taken from, in place. The first delta is relative to 0
+// and everything wraps around like u32 math does
+void zigzag_prefix_sum(u32 *values, u32 count);
+void zigzag_prefix_sum_scalar(u32 *values, u32 count);
@@ -0,0 +1,119 @@
+#include "worker_pool.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace {
+struct WorkerPool {
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable work_ready;
+    std::condition_variable work_done;
+    bool running = false;
+
+    // Current job. `generation` changes every time a new one is published so sleeping workers know to wake up
+    const std::function<void(u32)> *fn = nullptr;
+    u32 count = 0;
+    u64 generation = 0;
+    std::atomic<u32> next_index = 0;
+    u32 busy_workers = 0;
+};
+
+WorkerPool gPool;
+
+// Grabs indices until there are none left. Shared by the workers and the thread calling parallel_for
+void run_job(const std::function<void(u32)> &fn, u32 count)
+{
+    for (u32 i = gPool.next_index.fetch_add(1, std::memory_order_relaxed); i < count;
+         i = gPool.next_index.fetch_add(1, std::memory_order_relaxed)) {
+        fn(i);
+    }
+}
+
+void worker_main()
+{
+    u64 seen_generation = 0;
+    std::unique_lock lock(gPool.mutex);
+    while (true) {
+        gPool.work_ready.wait(lock, [&] { return !gPool.running || gPool.generation != seen_generation; });
+        if (!gPool.running) {
+            return;
+        }
+        seen_generation = gPool.generation;
+        // Woke up after the job was already finished by everybody else
+        if (gPool.fn == nullptr) {
+            continue;
+        }
+        const std::function<void(u32)> *fn = gPool.fn;
+        u32 count = gPool.count;
+        ++gPool.busy_workers;
+
+        lock.unlock();
+        run_job(*fn, count);
+        lock.lock();
+
+        if (--gPool.busy_workers == 0) {
+            gPool.work_done.notify_one();
+        }
+    }
+}
+
+void start_pool()
+{
+    u32 cores = std::thread::hardware_concurrency();
+    u32 worker_count = cores > 1 ? cores - 1 : 0;
+    gPool.running = true;
+    for (u32 i = 0; i < worker_count; ++i) {
+        gPool.threads.emplace_back(worker_main);
+    }
+}
+} // namespace
+
+void parallel_for(u32 count, const std::function<void(u32)> &fn)
+{
+    // Not worth waking anybody up for a single item
+    if (count <= 1) {
+        if (count == 1) {
+            fn(0);
+        }
+        return;
+    }
+
+    if (!gPool.running) {
+        start_pool();
+    }
+
+    {
+        std::lock_guard lock(gPool.mutex);
+        gPool.fn = &fn;
+        gPool.count = count;
+        gPool.next_index.store(0, std::memory_order_relaxed);
+        ++gPool.generation;
+    }
+    gPool.work_ready.notify_all();
+
+    run_job(fn, count);
+
+    // Workers that woke up late might still be inside `fn` with the last indices, wait for them before `fn` goes
+    // out of scope. Workers that didn't wake up yet will find no indices left
+    std::unique_lock lock(gPool.mutex);
+    gPool.work_done.wait(lock, [] { return gPool.busy_workers == 0; });
+    gPool.fn = nullptr;
+    gPool.count = 0;
+}
+
+void worker_pool_shutdown()
+{
+    {
+        std::lock_guard lock(gPool.mutex);
+        gPool.running = false;
+    }
+    gPool.work_ready.notify_all();
+    for (std::thread &t : gPool.threads) {
+        t.join();
+    }
+    gPool.threads.clear();
+}
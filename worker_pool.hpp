@@ -0,0 +1,10 @@
+#pragma once
+#include "shorthand.hpp"
+
+#include <functional>
+
+// Runs `fn(i)` for every i in [0, count) spread over a pool of worker threads plus the calling thread, and returns
+// once all of them are done. The pool is started on first use with one thread less than the amount of cores.
+// Calls must come from a single thread (the main loop)
+void parallel_for(u32 count, const std::function<void(u32)> &fn);
+void worker_pool_shutdown();